@@ -9,24 +9,121 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <pthread.h>
 #include <error.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <alsa/asoundlib.h>
 
 #include "pa_ringbuffer.h"
 #include "audio.h"
 #include "conf.h"
+#include "reactor.h"
+#include "resample.h"
 #include "util.h"
 
 PaUtilRingBuffer g_playback_ringbuffer;
 PaUtilRingBuffer g_capture_ringbuffer;
 
-static pthread_t g_playback_thread;
-static pthread_t g_capture_thread;
+// Wakes the reader of a ring buffer when the frames it waits for are in.
+// The writer bumps seq after every write, and wakes the futex on it if the
+// reader is waiting for no more frames than there are.  The reader sets
+// want before it looks at seq and the ring, so either it sees the frames or
+// the writer sees it waiting.
+typedef struct _ring_event_t {
+    _Atomic int seq;
+    _Atomic long want;
+} ring_event_t;
 
-extern int g_is_quit;
+static ring_event_t g_playback_event;
+static ring_event_t g_capture_event;
+
+static audio_stats_t g_stats;
+static audio_latency_t g_latency;
+
+static uint64_t elapsed_ns(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+}
+
+static void ring_signal(PaUtilRingBuffer *rbuf, ring_event_t *event)
+{
+    atomic_fetch_add(&event->seq, 1);
+
+    long want = atomic_load(&event->want);
+    if (want && PaUtil_GetRingBufferReadAvailable(rbuf) >= want)
+    {
+        syscall(SYS_futex, &event->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// wait until frames can be read, or until the CLOCK_MONOTONIC deadline
+// (none if NULL) has passed; 0 if they can
+static int ring_wait(PaUtilRingBuffer *rbuf, ring_event_t *event, size_t frames, const struct timespec *deadline)
+{
+    int ret = 0;
+
+    if (PaUtil_GetRingBufferReadAvailable(rbuf) >= frames)
+    {
+        return 0;
+    }
+
+    atomic_store(&event->want, frames);
+    while (PaUtil_GetRingBufferReadAvailable(rbuf) < frames)
+    {
+        int seq = atomic_load(&event->seq);
+        if (PaUtil_GetRingBufferReadAvailable(rbuf) >= frames)
+        {
+            break;
+        }
+
+        // an absolute timeout, on CLOCK_MONOTONIC, with the bitset wait
+        if (syscall(SYS_futex, &event->seq, FUTEX_WAIT_BITSET_PRIVATE, seq, deadline, NULL, FUTEX_BITSET_MATCH_ANY) < 0 && errno == ETIMEDOUT)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    atomic_store(&event->want, 0);
+
+    return ret;
+}
+
+static void deadline_after(struct timespec *deadline, int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// the number of device frames which take as long as frames at the canceller's rate
+static unsigned device_frames(conf_t *conf, unsigned frames)
+{
+    return ((uint64_t)frames * conf->device_rate + conf->rate - 1) / conf->rate;
+}
+
+// the number of frames at the canceller's rate which take as long as frames at the device's
+static unsigned rate_frames(conf_t *conf, unsigned frames)
+{
+    unsigned n = ((uint64_t)frames * conf->rate + conf->device_rate / 2) / conf->device_rate;
+
+    return n ? n : 1;
+}
 
 
 static int xrun_recovery(snd_pcm_t *handle, int err)
@@ -52,7 +149,9 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
     return err;
 }
 
-int set_params(snd_pcm_t *handle, snd_pcm_hw_params_t *hw_params, unsigned rate, unsigned channels, unsigned chunk_size)
+// period_size and buffer_size are what to ask for, and come back as what
+// the device could do
+int set_params(snd_pcm_t *handle, snd_pcm_hw_params_t *hw_params, unsigned rate, unsigned channels, snd_pcm_uframes_t *period_size, snd_pcm_uframes_t *buffer_size)
 {
     int err;
     int mmap = 0;
@@ -84,12 +183,16 @@ int set_params(snd_pcm_t *handle, snd_pcm_hw_params_t *hw_params, unsigned rate,
     err = snd_pcm_hw_params_set_channels(handle, hw_params, channels);
     assert(err >= 0);
 
-    err = snd_pcm_hw_params_set_buffer_size(handle, hw_params, chunk_size * 2);
-    assert(err >= 0);
+    // the period first, as it is what the latency comes down to; the exact
+    // size is not supported by PulseAudio's ALSA plugin, so only the nearest
+    err = snd_pcm_hw_params_set_period_size_near(handle, hw_params, period_size, NULL);
+    if (err < 0)
+    {
+        fprintf(stderr, "Unable to set the period size: %s\n", snd_strerror(err));
+    }
 
-    // No supported by PulseAudio's ALSA plugin
-    // err = snd_pcm_hw_params_set_period_size(handle, hw_params, chunk_size, 0);
-    // assert(err >= 0);
+    err = snd_pcm_hw_params_set_buffer_size_near(handle, hw_params, buffer_size);
+    assert(err >= 0);
 
     err = snd_pcm_hw_params(handle, hw_params);
     if (err < 0)
@@ -98,6 +201,9 @@ int set_params(snd_pcm_t *handle, snd_pcm_hw_params_t *hw_params, unsigned rate,
         exit(1);
     }
 
+    snd_pcm_hw_params_get_period_size(hw_params, period_size, NULL);
+    snd_pcm_hw_params_get_buffer_size(hw_params, buffer_size);
+
     // {
     //     snd_output_t *out;
     //     snd_output_stdio_attach(&out, stderr, 0);
@@ -108,258 +214,504 @@ int set_params(snd_pcm_t *handle, snd_pcm_hw_params_t *hw_params, unsigned rate,
     return mmap;
 }
 
-void *playback(void *ptr)
+static void set_avail_min(snd_pcm_t *handle, unsigned frames)
 {
-    snd_pcm_hw_params_t *hw_params = NULL;
+    snd_pcm_sw_params_t *sw_params;
     int err;
-    unsigned chunk_bytes;
-    unsigned frame_bytes;
-    char *chunk = NULL;
-    snd_pcm_t *handle;
-    unsigned chunk_size = 1024;
-    unsigned zero_count = 0;
-    conf_t *conf = (conf_t *)ptr;
-    int mmap = 0;
 
-    if ((err = snd_pcm_open(&handle, conf->out_pcm, SND_PCM_STREAM_PLAYBACK, 0)) < 0)
+    err = snd_pcm_sw_params_malloc(&sw_params);
+    assert(err >= 0);
+
+    err = snd_pcm_sw_params_current(handle, sw_params);
+    assert(err >= 0);
+
+    // ready (for poll) once this much can be read or written
+    err = snd_pcm_sw_params_set_avail_min(handle, sw_params, frames);
+    assert(err >= 0);
+
+    err = snd_pcm_sw_params(handle, sw_params);
+    assert(err >= 0);
+
+    snd_pcm_sw_params_free(sw_params);
+}
+
+// Put a PCM's poll descriptors in the reactor.  They can not be used as
+// they are: their events have to go back through
+// snd_pcm_poll_descriptors_revents() (see pcm_revents()).
+static int pcm_watch(struct reactor *reactor, snd_pcm_t *handle, struct pollfd **pfds, reactor_handler_t handler, void *arg)
+{
+    int nfds = snd_pcm_poll_descriptors_count(handle);
+    if (nfds <= 0)
     {
-        fprintf(stderr, "cannot open audio device %s (%s)\n",
-                conf->out_pcm,
-                snd_strerror(err));
-        exit(1);
+        return -1;
     }
 
-    mmap = set_params(handle, hw_params, conf->rate, conf->ref_channels, chunk_size);
+    *pfds = (struct pollfd *)calloc(nfds, sizeof(struct pollfd));
+    if (*pfds == NULL || snd_pcm_poll_descriptors(handle, *pfds, nfds) != nfds)
+    {
+        return -1;
+    }
 
-    frame_bytes = conf->ref_channels * 2;
-    chunk_bytes = chunk_size * frame_bytes;
-    chunk = (char *)malloc(chunk_bytes);
-    if (chunk == NULL)
+    // the POLLxxx and EPOLLxxx bits are the same
+    for (int i = 0; i < nfds; i++)
     {
-        fprintf(stderr, "not enough memory\n");
-        exit(1);
+        if (reactor_add(reactor, (*pfds)[i].fd, (*pfds)[i].events, handler, arg) < 0)
+        {
+            return -1;
+        }
     }
 
-    struct stat st;
+    return nfds;
+}
 
-    if (stat(conf->playback_fifo, &st) != 0)
+static void pcm_mute(struct reactor *reactor, struct pollfd *pfds, int nfds, int mute)
+{
+    for (int i = 0; i < nfds; i++)
     {
-        mkfifo(conf->playback_fifo, 0666);
+        reactor_modify(reactor, pfds[i].fd, mute ? 0 : pfds[i].events);
     }
-    else if (!S_ISFIFO(st.st_mode))
+}
+
+static unsigned short pcm_revents(snd_pcm_t *handle, struct pollfd *pfds, int nfds, int fd, uint32_t events)
+{
+    unsigned short revents = 0;
+
+    for (int i = 0; i < nfds; i++)
     {
-        remove(conf->playback_fifo);
-        mkfifo(conf->playback_fifo, 0666);
+        pfds[i].revents = (pfds[i].fd == fd) ? events : 0;
     }
+    snd_pcm_poll_descriptors_revents(handle, pfds, nfds, &revents);
+
+    return revents;
+}
+
+static void pcm_recover(snd_pcm_t *handle)
+{
+    int err = (snd_pcm_state(handle) == SND_PCM_STATE_SUSPENDED) ? -ESTRPIPE : -EPIPE;
 
-    int fd = open(conf->playback_fifo, O_RDONLY | O_NONBLOCK);
-    if (fd < 0)
+    if (xrun_recovery(handle, err) < 0)
     {
-        fprintf(stderr, "failed to open %s, error %d\n", conf->playback_fifo, fd);
         exit(1);
     }
-    long pipe_size = (long)fcntl(fd, F_GETPIPE_SZ);
-    if (pipe_size == -1)
+}
+
+// The playback side.  The FIFO is read into chunk as data comes in.  When
+// the device has room for a chunk it gets this one, and if the FIFO has not
+// filled it within half a chunk's time, the rest is zeros.
+struct playback_stream
+{
+    conf_t *conf;
+    struct reactor *reactor;
+    snd_pcm_t *handle;
+    int mmap;
+    struct pollfd *pfds;
+    int nfds;
+    int fifo_fd;
+    int timer_fd;
+    unsigned chunk_size;
+    unsigned frame_bytes;
+    char *chunk;            // from the FIFO, at the canceller's rate
+    unsigned count;         // bytes of chunk filled
+    char *device_chunk;     // to the device, at its rate
+    char *pending;          // the part of device_chunk still to write
+    unsigned pending_frames;
+    int waiting;            // for the FIFO, with the device parked
+    unsigned zero_count;
+    struct resample_state *resampler;
+};
+
+struct capture_stream
+{
+    conf_t *conf;
+    snd_pcm_t *handle;
+    int mmap;
+    struct pollfd *pfds;
+    int nfds;
+    unsigned chunk_size;    // in device frames, a period
+    unsigned frame_bytes;
+    void *chunk;            // read into, without mmap
+    void *rate_chunk;       // resampled into, when the ring wraps
+    struct resample_state *resampler;
+};
+
+static struct playback_stream g_playback;
+static struct capture_stream g_capture;
+
+static void playback_timer(struct playback_stream *p, long ns)
+{
+    struct itimerspec its = {.it_value = {.tv_sec = ns / 1000000000L, .tv_nsec = ns % 1000000000L}};
+
+    timerfd_settime(p->timer_fd, 0, &its, NULL);
+}
+
+static void playback_write(struct playback_stream *p)
+{
+    while (p->pending_frames > 0)
     {
-        perror("get pipe size failed.");
+        snd_pcm_sframes_t r;
+        if (p->mmap)
+        {
+            r = snd_pcm_mmap_writei(p->handle, p->pending, p->pending_frames);
+        }
+        else
+        {
+            r = snd_pcm_writei(p->handle, p->pending, p->pending_frames);
+        }
+
+        if (r == -EAGAIN)
+        {
+            break;
+        }
+        else if (r < 0)
+        {
+            fprintf(stderr, "playback write error: %s\n", snd_strerror(r));
+            if (xrun_recovery(p->handle, r) < 0)
+            {
+                exit(1);
+            }
+            continue;
+        }
+
+        p->pending_frames -= r;
+        p->pending += r * p->frame_bytes;
     }
-    printf("default pipe size: %ld\n", pipe_size);
 
-    int ret = fcntl(fd, F_SETPIPE_SZ, chunk_bytes * 4);
-    if (ret < 0)
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(p->handle, &delay) == 0)
     {
-        perror("set pipe size failed.");
+        g_latency.playback_delay = delay;
     }
+}
 
-    pipe_size = (long)fcntl(fd, F_GETPIPE_SZ);
-    if (pipe_size == -1)
+// hand the device the next chunk
+static void playback_feed(struct playback_stream *p)
+{
+    conf_t *conf = p->conf;
+    unsigned chunk_bytes = p->chunk_size * p->frame_bytes;
+    unsigned count = p->count;
+
+    if (p->waiting)
     {
-        perror("get pipe size 2 failed.");
+        p->waiting = 0;
+        playback_timer(p, 0);
+        pcm_mute(p->reactor, p->pfds, p->nfds, 0);
     }
-    printf("new pipe size: %ld\n", pipe_size);
 
-    int wait_us = chunk_size * 1000000 / conf->rate / 4;
-    while (!g_is_quit)
+    if (count < chunk_bytes)
     {
-        int count = 0;
+        memset(p->chunk + count, 0, chunk_bytes - count);
 
-        for (int i = 0; i < 2; i++)
+        if (count)
         {
-            int result = read(fd, chunk + count, chunk_bytes - count);
-            if (result < 0)
-            {
-                if (errno != EAGAIN)
-                {
-                    fprintf(stderr, "read() returned %d, errno = %d\n", result, errno);
-                    exit(1);
-                }
-            }
-            else
-            {
-                count += result;
-            }
+            printf("playback filled %d bytes zero\n", chunk_bytes - count);
+        }
+    }
 
-            if (count >= chunk_bytes)
+    if (0 == count)
+    {
+        // bypass AEC when no playback
+        if (p->zero_count > (conf->filter_length + g_playback_ringbuffer.bufferSize))
+        {
+            if (!conf->bypass)
             {
-                break;
+                conf->bypass = 1;
+                printf("No playback, bypass AEC\n");
             }
-
-            usleep(wait_us);
         }
+        else
+        {
+            p->zero_count += p->chunk_size;
+        }
+    }
+    else
+    {
+        if (conf->bypass)
+        {
+            conf->bypass = 0;
+            p->zero_count = 0;
+            printf("Enable AEC\n");
+        }
+    }
+
+    // the reference goes to the canceller as the chunk goes to the device
+    PaUtil_WriteRingBuffer(&g_playback_ringbuffer, p->chunk, p->chunk_size);
+    ring_signal(&g_playback_ringbuffer, &g_playback_event);
 
-        if (count < chunk_bytes)
+    if (p->resampler)
+    {
+        struct timespec start;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        p->pending_frames = resample_process(p->resampler, (int16_t *)p->chunk, p->chunk_size, (int16_t *)p->device_chunk);
+        g_stats.playback_ns += elapsed_ns(&start);
+        g_stats.playback_frames += p->chunk_size;
+    }
+    else
+    {
+        // the same size at the same rate, so swap them rather than copy:
+        // device_chunk has all been written, or there would be no feed
+        char *chunk = p->device_chunk;
+        p->device_chunk = p->chunk;
+        p->chunk = chunk;
+        p->pending_frames = p->chunk_size;
+    }
+    p->pending = p->device_chunk;
+
+    // the FIFO was parked while chunk was full
+    if (count == chunk_bytes)
+    {
+        reactor_modify(p->reactor, p->fifo_fd, EPOLLIN);
+    }
+    p->count = 0;
+
+    playback_write(p);
+}
+
+static void playback_fifo_ready(void *arg, int fd, uint32_t events)
+{
+    struct playback_stream *p = (struct playback_stream *)arg;
+    unsigned chunk_bytes = p->chunk_size * p->frame_bytes;
+
+    int result = read(fd, p->chunk + p->count, chunk_bytes - p->count);
+    if (result < 0)
+    {
+        if (errno != EAGAIN)
         {
-            memset(chunk + count, 0, chunk_bytes - count);
+            fprintf(stderr, "read() returned %d, errno = %d\n", result, errno);
+            exit(1);
+        }
+        return;
+    }
 
-            if (count)
-            {
-                printf("playback filled %d bytes zero\n", chunk_bytes - count);
-            }
+    p->count += result;
+    if (p->count == chunk_bytes)
+    {
+        // leave the rest in the FIFO until the device takes this chunk
+        reactor_modify(p->reactor, fd, 0);
+        if (p->waiting)
+        {
+            playback_feed(p);
         }
+    }
+}
+
+static void playback_timer_ready(void *arg, int fd, uint32_t events)
+{
+    struct playback_stream *p = (struct playback_stream *)arg;
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) > 0 && p->waiting)
+    {
+        playback_feed(p);
+    }
+}
+
+static void playback_ready(void *arg, int fd, uint32_t events)
+{
+    struct playback_stream *p = (struct playback_stream *)arg;
+    unsigned short revents = pcm_revents(p->handle, p->pfds, p->nfds, fd, events);
+
+    if (revents & POLLERR)
+    {
+        pcm_recover(p->handle);
+    }
+    else if (!(revents & POLLOUT))
+    {
+        return;
+    }
+
+    if (p->pending_frames)
+    {
+        playback_write(p);
+    }
+    else if (p->count == p->chunk_size * p->frame_bytes)
+    {
+        playback_feed(p);
+    }
+    else if (!p->waiting)
+    {
+        // give the FIFO half a chunk to fill it, as the device still has
+        // a chunk to play
+        p->waiting = 1;
+        pcm_mute(p->reactor, p->pfds, p->nfds, 1);
+        playback_timer(p, p->chunk_size * 500000000LL / p->conf->rate);
+    }
+}
+
+// Put frames from src in the capture ring.  src is the device's own buffer
+// in mmap mode, so it goes straight into the ring's free space, through the
+// resampler if there is one.  Only when the free space wraps too close to
+// the end of the ring for what the resampler can produce does it go through
+// rate_chunk.
+static void capture_write(struct capture_stream *c, const void *src, snd_pcm_sframes_t r)
+{
+    ring_buffer_size_t want = c->resampler ? resample_out_max(c->resampler, r) : r;
+    ring_buffer_size_t size1, size2, written;
+    void *data1, *data2;
+
+    PaUtil_GetRingBufferWriteRegions(&g_capture_ringbuffer, want, &data1, &size1, &data2, &size2);
+
+    if (c->resampler)
+    {
+        struct timespec start;
+        int direct = (size1 >= want);
 
-        if (0 == count)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        r = resample_process(c->resampler, (const int16_t *)src, r, (int16_t *)(direct ? data1 : c->rate_chunk));
+        g_stats.capture_ns += elapsed_ns(&start);
+        g_stats.capture_frames += r;
+
+        if (direct)
         {
-            // bypass AEC when no playback
-            if (zero_count > (conf->filter_length + conf->buffer_size))
-            {
-                if (!conf->bypass)
-                {
-                    conf->bypass = 1;
-                    printf("No playback, bypass AEC\n");
-                }
-            }
-            else
-            {
-                zero_count += chunk_size;
-            }
+            PaUtil_AdvanceRingBufferWriteIndex(&g_capture_ringbuffer, r);
+            written = r;
         }
         else
         {
-            if (conf->bypass)
-            {
-                conf->bypass = 0;
-                zero_count = 0;
-                printf("Enable AEC\n");
-            }
+            written = PaUtil_WriteRingBuffer(&g_capture_ringbuffer, c->rate_chunk, r);
         }
+    }
+    else
+    {
+        memcpy(data1, src, size1 * c->frame_bytes);
+        if (size2 > 0)
+        {
+            memcpy(data2, (const char *)src + size1 * c->frame_bytes, size2 * c->frame_bytes);
+        }
+        written = size1 + size2;
+        PaUtil_AdvanceRingBufferWriteIndex(&g_capture_ringbuffer, written);
+    }
 
-        count = chunk_size;
-        char *data = (char *)chunk;
-        while (count > 0 && !g_is_quit)
+    ring_signal(&g_capture_ringbuffer, &g_capture_event);
+    if (written < (r))
+    {
+        printf("lost %ld frames\n", r - written);
+    }
+}
+
+// Take what the device has captured straight from its buffer, without
+// snd_pcm_mmap_readi() copying it to chunk first.  With the resampler the
+// areas are passed to it no more than chunk_size frames at a time.
+static snd_pcm_sframes_t capture_mmap(struct capture_stream *c)
+{
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(c->handle);
+    if (avail < 0)
+    {
+        return avail;
+    }
+
+    while (avail > 0)
+    {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = avail;
+
+        if (c->resampler && frames > c->chunk_size)
         {
-            ssize_t r;
-            if (mmap)
-            {
-                r = snd_pcm_mmap_writei(handle, data, count);
-            }
-            else
-            {
-                r = snd_pcm_writei(handle, data, count);
-            }
+            frames = c->chunk_size;
+        }
 
-            if (r == -EAGAIN || (r >= 0 && (size_t)r < count))
-            {
-                fprintf(stderr, "w playback read error: %s\n", snd_strerror(r));
-                snd_pcm_wait(handle, 100);
-            }
-            else if (r < 0)
-            {
-                fprintf(stderr, "playback read error: %s\n", snd_strerror(r));
-                if (xrun_recovery(handle, r) < 0)
-                {
-                    exit(1);
-                }
-            }
-            if (r > 0)
-            {
-                PaUtil_WriteRingBuffer(&g_playback_ringbuffer, data, r);
-                count -= r;
-                data += r * frame_bytes;
-            }
+        // at most up to the end of the device's buffer
+        int err = snd_pcm_mmap_begin(c->handle, &areas, &offset, &frames);
+        if (err < 0)
+        {
+            return err;
         }
-    }
 
-    snd_pcm_close(handle);
-    free(chunk);
+        // interleaved, so the first area has every channel
+        const char *src = (const char *)areas[0].addr + areas[0].first / 8 + offset * areas[0].step / 8;
+        capture_write(c, src, frames);
 
-    return NULL;
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(c->handle, offset, frames);
+        if (committed < 0)
+        {
+            return committed;
+        }
+        if ((snd_pcm_uframes_t)committed != frames)
+        {
+            return -EPIPE;
+        }
+
+        avail -= frames;
+    }
+
+    return 0;
 }
 
-void *capture(void *ptr)
+static void capture_ready(void *arg, int fd, uint32_t events)
 {
-    snd_pcm_hw_params_t *hw_params = NULL;
-    int err;
-    unsigned frame_bytes;
-    void *chunk = NULL;
-    snd_pcm_t *handle;
-    unsigned chunk_size = 1024;
-    conf_t *conf = (conf_t *)ptr;
-    int mmap = 0;
+    struct capture_stream *c = (struct capture_stream *)arg;
+    unsigned short revents = pcm_revents(c->handle, c->pfds, c->nfds, fd, events);
 
-    if ((err = snd_pcm_open(&handle, conf->rec_pcm, SND_PCM_STREAM_CAPTURE, 0)) < 0)
+    if (revents & POLLERR)
     {
-        fprintf(stderr, "cannot open audio device %s (%s)\n",
-                conf->rec_pcm,
-                snd_strerror(err));
-        exit(1);
+        pcm_recover(c->handle);
+        snd_pcm_start(c->handle);
+        return;
+    }
+    if (!(revents & POLLIN))
+    {
+        return;
     }
 
-    mmap = set_params(handle, hw_params, conf->rate, conf->rec_channels, chunk_size * 2);
-
-    frame_bytes = conf->rec_channels * 2;
-    chunk = malloc(chunk_size * frame_bytes);
-    if (chunk == NULL)
+    // how long the oldest frame has waited in the device
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(c->handle, &delay) == 0)
     {
-        fprintf(stderr, "not enough memory\n");
-        exit(1);
+        g_latency.capture_delay = delay;
     }
 
-    while (!g_is_quit)
+    for (;;)
     {
-        ssize_t r;
-        if (mmap)
+        snd_pcm_sframes_t r;
+        if (c->mmap)
         {
-            r = snd_pcm_mmap_readi(handle, chunk, chunk_size);
+            r = capture_mmap(c);
         }
         else
         {
-            r = snd_pcm_readi(handle, chunk, chunk_size);
+            r = snd_pcm_readi(c->handle, c->chunk, c->chunk_size);
         }
-        if (r == -EAGAIN || (r >= 0 && (size_t)r < chunk_size))
+
+        if (r == -EAGAIN)
         {
-            fprintf(stderr, "1 read error: %s\n", snd_strerror(r));
-            snd_pcm_wait(handle, 100);
+            break;
         }
         else if (r < 0)
         {
             fprintf(stderr, "read error: %s\n", snd_strerror(r));
-            if (xrun_recovery(handle, r) < 0)
+            if (xrun_recovery(c->handle, r) < 0)
             {
                 exit(1);
             }
+            snd_pcm_start(c->handle);
+            break;
+        }
+
+        // capture_mmap() has taken all there was
+        if (c->mmap)
+        {
+            break;
         }
 
         if (r > 0)
         {
-            ring_buffer_size_t written =
-                PaUtil_WriteRingBuffer(&g_capture_ringbuffer, chunk, r);
-            if (written < (r))
-            {
-                printf("lost %ld frames\n", r - written);
-            }
+            capture_write(c, c->chunk, r);
+        }
+        if ((size_t)r < c->chunk_size)
+        {
+            break;
         }
     }
-
-    snd_pcm_close(handle);
-    free(chunk);
-
-    return NULL;
 }
 
-int capture_start(conf_t *conf)
+// At least 4 periods (at the canceller's rate), so that the device can hand
+// over a period while the canceller is still working through the last, or
+// conf->buffer_size if that is more.
+static void *ring_alloc(PaUtilRingBuffer *rbuf, unsigned channels, conf_t *conf, unsigned period)
 {
-    unsigned buffer_size = power2(conf->buffer_size);
-    unsigned buffer_bytes = conf->rec_channels * conf->bits_per_sample / 8;
+    unsigned buffer_size = power2(conf->buffer_size > 4 * period ? conf->buffer_size : 4 * period);
+    unsigned buffer_bytes = channels * conf->bits_per_sample / 8;
 
     void *buf = calloc(buffer_size, buffer_bytes);
     if (buf == NULL)
@@ -368,46 +720,237 @@ int capture_start(conf_t *conf)
         exit(1);
     }
 
-    ring_buffer_size_t ret = PaUtil_InitializeRingBuffer(&g_capture_ringbuffer, buffer_bytes, buffer_size, buf);
+    ring_buffer_size_t ret = PaUtil_InitializeRingBuffer(rbuf, buffer_bytes, buffer_size, buf);
     if (ret == -1)
     {
         fprintf(stderr, "Initialize ring buffer but element count is not a power of 2.\n");
         exit(1);
     }
 
-    pthread_create(&g_capture_thread, NULL, capture, conf);
+    if (conf->realtime)
+    {
+        memory_prefault(buf, buffer_size * buffer_bytes);
+    }
+
+    return buf;
+}
+
+int capture_start(conf_t *conf, struct reactor *reactor)
+{
+    struct capture_stream *c = &g_capture;
+    snd_pcm_hw_params_t *hw_params = NULL;
+    int err;
+
+    c->conf = conf;
+    if ((err = snd_pcm_open(&c->handle, conf->rec_pcm, SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK)) < 0)
+    {
+        fprintf(stderr, "cannot open audio device %s (%s)\n",
+                conf->rec_pcm,
+                snd_strerror(err));
+        exit(1);
+    }
+
+    // read a period at a time; the buffer is twice the playback's, as a
+    // deeper capture buffer adds headroom but no latency
+    snd_pcm_uframes_t period = device_frames(conf, conf->period_size);
+    snd_pcm_uframes_t buffer = period * conf->periods * 2;
+    c->mmap = set_params(c->handle, hw_params, conf->device_rate, conf->rec_channels, &period, &buffer);
+    c->chunk_size = period;
+    set_avail_min(c->handle, c->chunk_size);
+
+    g_latency.capture_period = period;
+    g_latency.capture_buffer = buffer;
+    ring_alloc(&g_capture_ringbuffer, conf->rec_channels, conf, rate_frames(conf, period));
+
+    // in mmap mode the frames are taken straight from the device's buffer
+    c->frame_bytes = conf->rec_channels * 2;
+    if (!c->mmap)
+    {
+        c->chunk = malloc(c->chunk_size * c->frame_bytes);
+        if (c->chunk == NULL)
+        {
+            fprintf(stderr, "not enough memory\n");
+            exit(1);
+        }
+    }
+
+    // the device is at its own rate, the ring buffer at the canceller's
+    if (conf->device_rate != conf->rate)
+    {
+        c->resampler = resample_create(conf->device_rate, conf->rate, conf->rec_channels, c->chunk_size);
+        if (c->resampler == NULL)
+        {
+            fprintf(stderr, "not enough memory\n");
+            exit(1);
+        }
+        c->rate_chunk = malloc(resample_out_max(c->resampler, c->chunk_size) * c->frame_bytes);
+        if (c->rate_chunk == NULL)
+        {
+            fprintf(stderr, "not enough memory\n");
+            exit(1);
+        }
+    }
+
+    if (conf->realtime)
+    {
+        if (c->chunk)
+        {
+            memory_prefault(c->chunk, c->chunk_size * c->frame_bytes);
+        }
+        if (c->resampler)
+        {
+            memory_prefault(c->rate_chunk, resample_out_max(c->resampler, c->chunk_size) * c->frame_bytes);
+        }
+    }
+
+    c->nfds = pcm_watch(reactor, c->handle, &c->pfds, capture_ready, c);
+    if (c->nfds < 0)
+    {
+        fprintf(stderr, "cannot poll audio device %s\n", conf->rec_pcm);
+        exit(1);
+    }
+
+    snd_pcm_start(c->handle);
 
     return 0;
 }
 
-int playback_start(conf_t *conf)
+int playback_start(conf_t *conf, struct reactor *reactor)
 {
-    unsigned buffer_size = power2(conf->buffer_size);
-    unsigned buffer_bytes = conf->ref_channels * conf->bits_per_sample / 8;
+    struct playback_stream *p = &g_playback;
+    snd_pcm_hw_params_t *hw_params = NULL;
+    unsigned chunk_bytes;
+    int err;
 
-    void *buf = calloc(buffer_size, buffer_bytes);
-    if (buf == NULL)
+    p->conf = conf;
+    p->reactor = reactor;
+    if ((err = snd_pcm_open(&p->handle, conf->out_pcm, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) < 0)
     {
-        fprintf(stderr, "Fail to allocate memory.\n");
+        fprintf(stderr, "cannot open audio device %s (%s)\n",
+                conf->out_pcm,
+                snd_strerror(err));
         exit(1);
     }
 
-    ring_buffer_size_t ret = PaUtil_InitializeRingBuffer(&g_playback_ringbuffer, buffer_bytes, buffer_size, buf);
-    if (ret == -1)
+    // a chunk from the FIFO for each period
+    snd_pcm_uframes_t period = device_frames(conf, conf->period_size);
+    snd_pcm_uframes_t buffer = period * conf->periods;
+    p->mmap = set_params(p->handle, hw_params, conf->device_rate, conf->ref_channels, &period, &buffer);
+    p->chunk_size = rate_frames(conf, period);
+    set_avail_min(p->handle, period);
+
+    g_latency.playback_period = period;
+    g_latency.playback_buffer = buffer;
+    ring_alloc(&g_playback_ringbuffer, conf->ref_channels, conf, p->chunk_size);
+
+    p->frame_bytes = conf->ref_channels * 2;
+    chunk_bytes = p->chunk_size * p->frame_bytes;
+    p->chunk = (char *)malloc(chunk_bytes);
+    if (p->chunk == NULL)
     {
-        fprintf(stderr, "Initialize ring buffer but element count is not a power of 2.\n");
+        fprintf(stderr, "not enough memory\n");
         exit(1);
     }
 
-    pthread_create(&g_playback_thread, NULL, playback, conf);
+    // the FIFO and the reference are at the canceller's rate, the device at its own
+    if (conf->device_rate != conf->rate)
+    {
+        p->resampler = resample_create(conf->rate, conf->device_rate, conf->ref_channels, p->chunk_size);
+        if (p->resampler == NULL)
+        {
+            fprintf(stderr, "not enough memory\n");
+            exit(1);
+        }
+        p->device_chunk = (char *)malloc(resample_out_max(p->resampler, p->chunk_size) * p->frame_bytes);
+    }
+    else
+    {
+        p->device_chunk = (char *)malloc(chunk_bytes);
+    }
+    if (p->device_chunk == NULL)
+    {
+        fprintf(stderr, "not enough memory\n");
+        exit(1);
+    }
+
+    if (conf->realtime)
+    {
+        memory_prefault(p->chunk, chunk_bytes);
+        memory_prefault(p->device_chunk, p->resampler ? resample_out_max(p->resampler, p->chunk_size) * p->frame_bytes : chunk_bytes);
+    }
+
+    struct stat st;
+
+    if (stat(conf->playback_fifo, &st) != 0)
+    {
+        mkfifo(conf->playback_fifo, 0666);
+    }
+    else if (!S_ISFIFO(st.st_mode))
+    {
+        remove(conf->playback_fifo);
+        mkfifo(conf->playback_fifo, 0666);
+    }
+
+    // opened for writing as well, so that it never reads as end of file
+    // (which epoll would report all the time) while nothing is playing
+    p->fifo_fd = open(conf->playback_fifo, O_RDWR | O_NONBLOCK);
+    if (p->fifo_fd < 0)
+    {
+        fprintf(stderr, "failed to open %s, error %d\n", conf->playback_fifo, p->fifo_fd);
+        exit(1);
+    }
+    long pipe_size = (long)fcntl(p->fifo_fd, F_GETPIPE_SZ);
+    if (pipe_size == -1)
+    {
+        perror("get pipe size failed.");
+    }
+    printf("default pipe size: %ld\n", pipe_size);
+
+    int ret = fcntl(p->fifo_fd, F_SETPIPE_SZ, chunk_bytes * 4);
+    if (ret < 0)
+    {
+        perror("set pipe size failed.");
+    }
+
+    pipe_size = (long)fcntl(p->fifo_fd, F_GETPIPE_SZ);
+    if (pipe_size == -1)
+    {
+        perror("get pipe size 2 failed.");
+    }
+    printf("new pipe size: %ld\n", pipe_size);
+
+    p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (p->timer_fd < 0)
+    {
+        perror("timerfd_create failed.");
+        exit(1);
+    }
+
+    p->nfds = pcm_watch(reactor, p->handle, &p->pfds, playback_ready, p);
+    if (p->nfds < 0 ||
+        reactor_add(reactor, p->fifo_fd, EPOLLIN, playback_fifo_ready, p) < 0 ||
+        reactor_add(reactor, p->timer_fd, EPOLLIN, playback_timer_ready, p) < 0)
+    {
+        fprintf(stderr, "cannot poll audio device %s\n", conf->out_pcm);
+        exit(1);
+    }
 
     return 0;
 }
 
+// after the reactor has stopped
 int capture_stop()
 {
-    void *ret = NULL;
-    pthread_join(g_capture_thread, &ret);
+    struct capture_stream *c = &g_capture;
+
+    snd_pcm_close(c->handle);
+    free(c->pfds);
+    free(c->chunk);
+    free(c->rate_chunk);
+    if (c->resampler)
+    {
+        resample_free(c->resampler);
+    }
 
     free(g_capture_ringbuffer.buffer);
 
@@ -416,8 +959,18 @@ int capture_stop()
 
 int playback_stop()
 {
-    void *ret = NULL;
-    pthread_join(g_playback_thread, &ret);
+    struct playback_stream *p = &g_playback;
+
+    snd_pcm_close(p->handle);
+    close(p->fifo_fd);
+    close(p->timer_fd);
+    free(p->pfds);
+    free(p->chunk);
+    free(p->device_chunk);
+    if (p->resampler)
+    {
+        resample_free(p->resampler);
+    }
 
     free(g_playback_ringbuffer.buffer);
 
@@ -426,31 +979,41 @@ int playback_stop()
 
 int capture_read(void *buf, size_t frames, int timeout_ms)
 {
-    while (PaUtil_GetRingBufferReadAvailable(&g_capture_ringbuffer) < frames && timeout_ms > 0)
-    {
-        usleep(10);
-        timeout_ms--;
-    }
+    struct timespec deadline;
+
+    deadline_after(&deadline, timeout_ms);
+    ring_wait(&g_capture_ringbuffer, &g_capture_event, frames, &deadline);
 
     return PaUtil_ReadRingBuffer(&g_capture_ringbuffer, buf, frames);
 }
 
 int capture_skip(size_t frames)
 {
-    while (PaUtil_GetRingBufferReadAvailable(&g_capture_ringbuffer) < frames)
-    {
-        usleep(1000);
-    }
+    ring_wait(&g_capture_ringbuffer, &g_capture_event, frames, NULL);
+
     return PaUtil_AdvanceRingBufferReadIndex(&g_capture_ringbuffer, frames);
 }
 
 int playback_read(void *buf, size_t frames, int timeout_ms)
 {
-    while (PaUtil_GetRingBufferReadAvailable(&g_playback_ringbuffer) < frames && timeout_ms > 0)
-    {
-        usleep(1000);
-        timeout_ms--;
-    }
+    struct timespec deadline;
+
+    deadline_after(&deadline, timeout_ms);
+    ring_wait(&g_playback_ringbuffer, &g_playback_event, frames, &deadline);
 
     return PaUtil_ReadRingBuffer(&g_playback_ringbuffer, buf, frames);
 }
+
+void audio_get_stats(audio_stats_t *stats)
+{
+    *stats = g_stats;
+}
+
+void audio_get_latency(audio_latency_t *latency)
+{
+    *latency = g_latency;
+    latency->capture_ring = g_capture_ringbuffer.bufferSize;
+    latency->capture_queued = PaUtil_GetRingBufferReadAvailable(&g_capture_ringbuffer);
+    latency->playback_ring = g_playback_ringbuffer.bufferSize;
+    latency->playback_queued = PaUtil_GetRingBufferReadAvailable(&g_playback_ringbuffer);
+}
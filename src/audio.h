@@ -2,16 +2,45 @@
 #ifndef _AUDIO_H_
 #define _AUDIO_H_
 
+#include <stdint.h>
+
 #include "conf.h"
+#include "reactor.h"
+
+// time spent resampling, and the frames resampled at the canceller's rate
+typedef struct _audio_stats_t {
+    uint64_t capture_ns;
+    uint64_t capture_frames;
+    uint64_t playback_ns;
+    uint64_t playback_frames;
+} audio_stats_t;
 
+// The ALSA periods and buffers as negotiated, and the device delays last
+// seen, in frames at the device's rate; the ring buffers' sizes and the
+// frames waiting in them, at the canceller's rate.
+typedef struct _audio_latency_t {
+    unsigned capture_period;
+    unsigned capture_buffer;
+    long capture_delay;
+    unsigned capture_ring;
+    unsigned capture_queued;
+    unsigned playback_period;
+    unsigned playback_buffer;
+    long playback_delay;
+    unsigned playback_ring;
+    unsigned playback_queued;
+} audio_latency_t;
 
-int capture_start(conf_t *conf);
+int capture_start(conf_t *conf, struct reactor *reactor);
 int capture_stop();
 int capture_read(void *buf, size_t frames, int timeout_ms);
 int capture_skip(size_t frames);
 
-int playback_start(conf_t *conf);
+int playback_start(conf_t *conf, struct reactor *reactor);
 int playback_stop();
 int playback_read(void *buf, size_t frames, int timeout_ms);
 
+void audio_get_stats(audio_stats_t *stats);
+void audio_get_latency(audio_latency_t *latency);
+
 #endif // _AUDIO_H_
@@ -8,14 +8,18 @@ typedef struct _conf_t {
     char *playback_fifo;    // playback FIFO
     char *out_fifo;         // AEC output FIFO
     unsigned rate;
+    unsigned device_rate;   // sound card rate, resampled to and from rate
     unsigned rec_channels;  // recording channels
     unsigned ref_channels;  // reference (playback) channels
     unsigned out_channels;  // processed audio output channels
     unsigned bits_per_sample;
-    unsigned buffer_size;
+    unsigned buffer_size;   // ring buffers, at least 4 periods
+    unsigned period_size;   // ALSA period, at rate
+    unsigned periods;       // ALSA playback buffer, in periods
     unsigned playback_fifo_size;
     unsigned filter_length;
     unsigned bypass;
+    unsigned realtime;      // prefault the buffers
 } conf_t;
 
 #endif // _CONF_H_
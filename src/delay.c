@@ -0,0 +1,272 @@
+/*
+ * delay.c - Bulk delay estimation between playback and capture
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "fft.h"
+#include "delay.h"
+
+#define ANALYSIS_BLOCK		256	/* decimated samples per estimate */
+#define CROSS_SMOOTHING		0.1f
+#define MIN_LEVEL		64.0f	/* mean magnitude, per input sample */
+#define PEAK_THRESHOLD		8.0f	/* peak over mean correlation */
+#define STABLE_BLOCKS		3
+
+struct delay_est_state {
+	int decimation;
+	int max_lag;
+	int n;
+	int bins;
+
+	struct fft_state *fft;
+
+	/* decimator */
+	float far_acc;
+	float mic_acc;
+	int phase;
+
+	/* the last n decimated far samples, and the current mic block */
+	float *far_hist;
+	float *mic_block;
+	int fill;
+
+	/* smoothed cross spectrum */
+	complexf_t *cross;
+	complexf_t *X;
+	complexf_t *Y;
+	float *work;
+
+	int candidate;
+	int hits;
+	int estimate;
+};
+
+struct delay_line_state {
+	int16_t *buf;
+	int mask;
+	int pos;
+};
+
+struct delay_est_state *delay_est_create(int max_delay, int decimation)
+{
+	struct delay_est_state *de;
+
+	if (decimation < 1 || max_delay < 0)
+		return NULL;
+
+	de = calloc(1, sizeof(*de));
+	if (!de)
+		return NULL;
+
+	de->decimation = decimation;
+	de->max_lag = (max_delay + decimation - 1) / decimation;
+	for (de->n = 4; de->n < de->max_lag + ANALYSIS_BLOCK; de->n <<= 1) ;
+	de->bins = de->n / 2 + 1;
+
+	de->fft = fft_create(de->n);
+	de->far_hist = calloc(de->n, sizeof(float));
+	de->mic_block = calloc(ANALYSIS_BLOCK, sizeof(float));
+	de->cross = calloc(de->bins, sizeof(complexf_t));
+	de->X = calloc(de->bins, sizeof(complexf_t));
+	de->Y = calloc(de->bins, sizeof(complexf_t));
+	de->work = calloc(de->n, sizeof(float));
+	if (!de->fft || !de->far_hist || !de->mic_block || !de->cross
+	    || !de->X || !de->Y || !de->work) {
+		delay_est_free(de);
+		return NULL;
+	}
+
+	delay_est_flush(de);
+
+	return de;
+}
+
+void delay_est_free(struct delay_est_state *de)
+{
+	if (de->fft)
+		fft_free(de->fft);
+	free(de->far_hist);
+	free(de->mic_block);
+	free(de->cross);
+	free(de->X);
+	free(de->Y);
+	free(de->work);
+	free(de);
+}
+
+void delay_est_flush(struct delay_est_state *de)
+{
+	memset(de->far_hist, 0, de->n * sizeof(float));
+	memset(de->mic_block, 0, ANALYSIS_BLOCK * sizeof(float));
+	memset(de->cross, 0, de->bins * sizeof(complexf_t));
+	de->far_acc = de->mic_acc = 0.0f;
+	de->phase = 0;
+	de->fill = 0;
+	de->candidate = -1;
+	de->hits = 0;
+	de->estimate = -1;
+}
+
+static float mean_level(const float *x, int n)
+{
+	float sum;
+	int i;
+
+	sum = 0.0f;
+	for (i = 0; i < n; i++)
+		sum += fabsf(x[i]);
+	return sum / n;
+}
+
+/* Correlate the latest block, and update the estimate */
+static void delay_est_analyse(struct delay_est_state *de)
+{
+	float *far_block = &de->far_hist[de->n - ANALYSIS_BLOCK];
+	float level = MIN_LEVEL * de->decimation;
+	float mag;
+	float peak;
+	float sum;
+	int lag;
+	int k;
+
+	/* Nothing useful to correlate during silence */
+	if (mean_level(far_block, ANALYSIS_BLOCK) < level
+	    || mean_level(de->mic_block, ANALYSIS_BLOCK) < level / 8)
+		return;
+
+	fft_real(de->fft, de->far_hist, de->X);
+
+	/* The mic block lines up in time with the newest far block, so lag l
+	   of the circular correlation pairs it with far l samples earlier.
+	   The zero padding keeps lags up to n - ANALYSIS_BLOCK free of wrap. */
+	memset(de->work, 0, (de->n - ANALYSIS_BLOCK) * sizeof(float));
+	memcpy(&de->work[de->n - ANALYSIS_BLOCK], de->mic_block,
+	       ANALYSIS_BLOCK * sizeof(float));
+	fft_real(de->fft, de->work, de->Y);
+
+	/* Smoothed Y.conj(X), then the phase transform */
+	for (k = 0; k < de->bins; k++) {
+		de->cross[k].re += CROSS_SMOOTHING *
+		    (de->Y[k].re * de->X[k].re + de->Y[k].im * de->X[k].im -
+		     de->cross[k].re);
+		de->cross[k].im += CROSS_SMOOTHING *
+		    (de->Y[k].im * de->X[k].re - de->Y[k].re * de->X[k].im -
+		     de->cross[k].im);
+		mag = sqrtf(de->cross[k].re * de->cross[k].re +
+			    de->cross[k].im * de->cross[k].im) + 1e-20f;
+		de->Y[k].re = de->cross[k].re / mag;
+		de->Y[k].im = de->cross[k].im / mag;
+	}
+	fft_real_inverse(de->fft, de->Y, de->work);
+
+	peak = 0.0f;
+	sum = 0.0f;
+	k = 0;
+	for (lag = 0; lag <= de->max_lag; lag++) {
+		sum += fabsf(de->work[lag]);
+		if (de->work[lag] > peak) {
+			peak = de->work[lag];
+			k = lag;
+		}
+	}
+	if (peak < PEAK_THRESHOLD * sum / (de->max_lag + 1)) {
+		de->hits = 0;
+		return;
+	}
+
+	/* Only report a candidate which holds still for a while */
+	if (de->candidate >= 0 && abs(k - de->candidate) <= 1)
+		de->hits++;
+	else
+		de->hits = 1;
+	de->candidate = k;
+	if (de->hits >= STABLE_BLOCKS)
+		de->estimate = k * de->decimation;
+}
+
+int delay_est_update(struct delay_est_state *de, const int16_t *far,
+		     const int16_t *mic, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		/* Decimate with a simple boxcar. The resolution is only a
+		   decimated sample anyway, and both paths see the same delay. */
+		de->far_acc += far[i];
+		de->mic_acc += mic[i];
+		if (++de->phase < de->decimation)
+			continue;
+
+		de->far_hist[de->n - ANALYSIS_BLOCK + de->fill] = de->far_acc;
+		de->mic_block[de->fill] = de->mic_acc;
+		de->far_acc = de->mic_acc = 0.0f;
+		de->phase = 0;
+		if (++de->fill == ANALYSIS_BLOCK) {
+			delay_est_analyse(de);
+			memmove(de->far_hist, &de->far_hist[ANALYSIS_BLOCK],
+				(de->n - ANALYSIS_BLOCK) * sizeof(float));
+			de->fill = 0;
+		}
+	}
+
+	return de->estimate;
+}
+
+struct delay_line_state *delay_line_create(int max_delay)
+{
+	struct delay_line_state *dl;
+	int len;
+
+	dl = calloc(1, sizeof(*dl));
+	if (!dl)
+		return NULL;
+
+	for (len = 1; len <= max_delay; len <<= 1) ;
+	dl->buf = calloc(len, sizeof(int16_t));
+	if (!dl->buf) {
+		free(dl);
+		return NULL;
+	}
+	dl->mask = len - 1;
+	dl->pos = 0;
+
+	return dl;
+}
+
+void delay_line_free(struct delay_line_state *dl)
+{
+	free(dl->buf);
+	free(dl);
+}
+
+void delay_line_process(struct delay_line_state *dl, const int16_t *in,
+			int16_t *out, int n, int delay)
+{
+	int i;
+
+	if (delay < 0)
+		delay = 0;
+	if (delay > dl->mask)
+		delay = dl->mask;
+
+	for (i = 0; i < n; i++) {
+		dl->buf[dl->pos] = in[i];
+		out[i] = dl->buf[(dl->pos - delay) & dl->mask];
+		dl->pos = (dl->pos + 1) & dl->mask;
+	}
+}
+
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,101 @@
+/*
+ * delay.h - Bulk delay estimation between playback and capture
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*! \page delay_page Bulk delay estimation
+\section delay_page_sec_1 What does it do?
+Estimates the bulk delay between the signal sent to the loudspeaker and its
+echo in the microphone signal, so the reference can be delayed to match.
+The adaptive filter then only has to model the echo tail itself, rather
+than the tail plus all the buffering in the audio path.
+
+\section delay_page_sec_2 How does it work?
+Both signals are decimated, and their cross correlation is found with the
+generalised cross correlation, phase transform (GCC-PHAT) method: the cross
+spectrum is smoothed over time, normalised to unit magnitude in each bin,
+and transformed back.  This whitens the signals, so the correlation has a
+sharp peak at the delay even for speech and music.  A new estimate is only
+reported once its peak stands well clear of the rest of the correlation,
+and it has held for several analysis blocks.
+
+A delay line, which applies the estimate to the reference signal, is also
+provided.
+*/
+
+#if !defined(_DELAY_H_)
+#define _DELAY_H_
+
+#include <stdint.h>
+
+/*!
+    Delay estimator descriptor.
+*/
+struct delay_est_state;
+
+/*!
+    Delay line descriptor.
+*/
+struct delay_line_state;
+
+/*! Create a delay estimator.
+    \param max_delay The longest delay to look for, in samples.
+    \param decimation The decimation factor applied before correlating. The
+           estimate has this resolution.
+    \return The new estimator, or NULL if it could not be created.
+*/
+struct delay_est_state *delay_est_create(int max_delay, int decimation);
+
+/*! Free a delay estimator.
+    \param de The delay estimator.
+*/
+void delay_est_free(struct delay_est_state *de);
+
+/*! Forget all history and the current estimate.
+    \param de The delay estimator.
+*/
+void delay_est_flush(struct delay_est_state *de);
+
+/*! Feed a block of samples to a delay estimator.
+    \param de The delay estimator.
+    \param far The reference (playback) samples.
+    \param mic The microphone (capture) samples.
+    \param n The number of samples.
+    \return The current estimate of how far mic lags far, in samples, or -1
+            if there is no confident estimate yet.
+*/
+int delay_est_update(struct delay_est_state *de, const int16_t *far,
+		     const int16_t *mic, int n);
+
+/*! Create a delay line.
+    \param max_delay The longest delay, in samples.
+    \return The new delay line, or NULL if it could not be created.
+*/
+struct delay_line_state *delay_line_create(int max_delay);
+
+/*! Free a delay line.
+    \param dl The delay line.
+*/
+void delay_line_free(struct delay_line_state *dl);
+
+/*! Delay a block of samples.
+    \param dl The delay line.
+    \param in The input samples.
+    \param out The output samples. This may be the same buffer as in.
+    \param n The number of samples.
+    \param delay The delay, in samples. This is clamped to the range of the
+           delay line.
+*/
+void delay_line_process(struct delay_line_state *dl, const int16_t *in,
+			int16_t *out, int n, int delay);
+
+#endif
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,380 @@
+/*
+ * fdaf.c - Partitioned block frequency domain echo canceller
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "fft.h"
+#include "fdaf.h"
+
+#define DC_BETA			0.125f	/* DC filter Beta, as in oslec */
+#define MIN_TX_LEVEL_FOR_ADAPTION	16.0f
+#define MIN_RX_LEVEL_FOR_ADAPTION	128.0f
+#define DTD_HANGOVER			600	/* samples */
+#define TRANSFER_BLOCKS			2
+#define STEP_SIZE			0.5f	/* normalised LMS step, mu */
+#define POWER_SMOOTHING			0.25f
+#define POWER_FLOOR			100.0f	/* per sample, so about -50dBov */
+#define BGN_LEVEL_LIMIT			80.0f
+
+struct fdaf_state {
+	int taps;
+	int block;
+	int parts;
+	int bins;
+	int adaption_mode;
+
+	struct fft_state *fft;
+
+	/* the last two blocks of tx, for overlap-save */
+	float *x_time;
+	/* tx spectra, one per partition, newest at x_head */
+	complexf_t *X;
+	int x_head;
+	/* smoothed tx power per bin */
+	float *Sxx;
+
+	/* foreground and background filter spectra */
+	complexf_t *W[2];
+	int constrain_part;
+
+	/* sample buffering, so callers can use any block size */
+	int16_t *tx_in;
+	int16_t *rx_in;
+	int16_t *out_buf;
+	int pos;
+
+	/* work space */
+	float *t_work;
+	complexf_t *f_work;
+	float *echo;
+	float *clean;
+	float *clean_bg;
+
+	/* levels, as mean magnitude per sample */
+	float Ltx, Lrx, Lclean, Lclean_bg, Lbgn;
+	int nonupdate_dwell;
+	int cond_met;
+
+	/* DC blocking filter state */
+	float rx_1, rx_2;
+};
+
+static complexf_t *part(struct fdaf_state *ec, complexf_t *spectra, int p)
+{
+	return &spectra[p * ec->bins];
+}
+
+static complexf_t *x_part(struct fdaf_state *ec, int p)
+{
+	return part(ec, ec->X, (ec->x_head + p) % ec->parts);
+}
+
+struct fdaf_state *fdaf_create(int len, int block, int adaption_mode)
+{
+	struct fdaf_state *ec;
+	int i;
+
+	if (block < 4 || (block & (block - 1)) || len < 1)
+		return NULL;
+
+	ec = calloc(1, sizeof(*ec));
+	if (!ec)
+		return NULL;
+
+	ec->block = block;
+	ec->parts = (len + block - 1) / block;
+	ec->taps = ec->parts * block;
+	ec->bins = block + 1;
+
+	ec->fft = fft_create(2 * block);
+	ec->x_time = calloc(2 * block, sizeof(float));
+	ec->X = calloc(ec->parts * ec->bins, sizeof(complexf_t));
+	ec->Sxx = calloc(ec->bins, sizeof(float));
+	for (i = 0; i < 2; i++)
+		ec->W[i] = calloc(ec->parts * ec->bins, sizeof(complexf_t));
+	ec->tx_in = calloc(block, sizeof(int16_t));
+	ec->rx_in = calloc(block, sizeof(int16_t));
+	ec->out_buf = calloc(block, sizeof(int16_t));
+	ec->t_work = calloc(2 * block, sizeof(float));
+	ec->f_work = calloc(ec->bins, sizeof(complexf_t));
+	ec->echo = calloc(block, sizeof(float));
+	ec->clean = calloc(block, sizeof(float));
+	ec->clean_bg = calloc(block, sizeof(float));
+	if (!ec->fft || !ec->x_time || !ec->X || !ec->Sxx || !ec->W[0]
+	    || !ec->W[1] || !ec->tx_in || !ec->rx_in || !ec->out_buf
+	    || !ec->t_work || !ec->f_work || !ec->echo || !ec->clean
+	    || !ec->clean_bg) {
+		fdaf_free(ec);
+		return NULL;
+	}
+
+	fdaf_adaption_mode(ec, adaption_mode);
+	fdaf_flush(ec);
+
+	return ec;
+}
+
+void fdaf_free(struct fdaf_state *ec)
+{
+	if (ec->fft)
+		fft_free(ec->fft);
+	free(ec->x_time);
+	free(ec->X);
+	free(ec->Sxx);
+	free(ec->W[0]);
+	free(ec->W[1]);
+	free(ec->tx_in);
+	free(ec->rx_in);
+	free(ec->out_buf);
+	free(ec->t_work);
+	free(ec->f_work);
+	free(ec->echo);
+	free(ec->clean);
+	free(ec->clean_bg);
+	free(ec);
+}
+
+void fdaf_adaption_mode(struct fdaf_state *ec, int adaption_mode)
+{
+	ec->adaption_mode = adaption_mode;
+}
+
+void fdaf_flush(struct fdaf_state *ec)
+{
+	int i;
+
+	memset(ec->x_time, 0, 2 * ec->block * sizeof(float));
+	memset(ec->X, 0, ec->parts * ec->bins * sizeof(complexf_t));
+	memset(ec->Sxx, 0, ec->bins * sizeof(float));
+	for (i = 0; i < 2; i++)
+		memset(ec->W[i], 0, ec->parts * ec->bins * sizeof(complexf_t));
+	memset(ec->tx_in, 0, ec->block * sizeof(int16_t));
+	memset(ec->rx_in, 0, ec->block * sizeof(int16_t));
+	memset(ec->out_buf, 0, ec->block * sizeof(int16_t));
+	ec->x_head = 0;
+	ec->constrain_part = 0;
+	ec->pos = 0;
+
+	ec->Ltx = ec->Lrx = ec->Lclean = ec->Lclean_bg = 0.0f;
+	ec->Lbgn = 0.0f;
+	ec->nonupdate_dwell = 0;
+	ec->cond_met = 0;
+	ec->rx_1 = ec->rx_2 = 0.0f;
+}
+
+/* Run the tx spectra through a filter, leaving the echo estimate for the
+   current block in ec->echo. */
+static void fdaf_filter(struct fdaf_state *ec, complexf_t *W)
+{
+	complexf_t *Y = ec->f_work;
+	complexf_t *w;
+	complexf_t *x;
+	int p;
+	int k;
+
+	memset(Y, 0, ec->bins * sizeof(complexf_t));
+	for (p = 0; p < ec->parts; p++) {
+		w = part(ec, W, p);
+		x = x_part(ec, p);
+		for (k = 0; k < ec->bins; k++) {
+			Y[k].re += w[k].re * x[k].re - w[k].im * x[k].im;
+			Y[k].im += w[k].re * x[k].im + w[k].im * x[k].re;
+		}
+	}
+	fft_real_inverse(ec->fft, Y, ec->t_work);
+
+	/* overlap-save: only the second half is linear convolution */
+	memcpy(ec->echo, &ec->t_work[ec->block], ec->block * sizeof(float));
+}
+
+static float mean_level(const float *x, int n)
+{
+	float sum;
+	int i;
+
+	sum = 0.0f;
+	for (i = 0; i < n; i++)
+		sum += fabsf(x[i]);
+	return sum / n;
+}
+
+/* Normalised LMS update of the background filter from the error in
+   ec->clean_bg. */
+static void fdaf_adapt(struct fdaf_state *ec)
+{
+	complexf_t *E = ec->f_work;
+	complexf_t *w;
+	complexf_t *x;
+	complexf_t g;
+	float scale;
+	int p;
+	int k;
+
+	memset(ec->t_work, 0, ec->block * sizeof(float));
+	memcpy(&ec->t_work[ec->block], ec->clean_bg, ec->block * sizeof(float));
+	fft_real(ec->fft, ec->t_work, E);
+
+	/* E/(P*Sxx), with the 2 from the overlap-save block length folded into
+	   the step size */
+	for (k = 0; k < ec->bins; k++) {
+		scale = 2.0f * STEP_SIZE / (ec->parts * (ec->Sxx[k] +
+			2 * ec->block * POWER_FLOOR));
+		E[k].re *= scale;
+		E[k].im *= scale;
+	}
+
+	for (p = 0; p < ec->parts; p++) {
+		w = part(ec, ec->W[1], p);
+		x = x_part(ec, p);
+		for (k = 0; k < ec->bins; k++) {
+			/* conj(X)*E */
+			g.re = x[k].re * E[k].re + x[k].im * E[k].im;
+			g.im = x[k].re * E[k].im - x[k].im * E[k].re;
+			w[k].re += g.re;
+			w[k].im += g.im;
+		}
+	}
+
+	/* Gradient constraint.  The unconstrained update lets circular
+	   convolution terms leak into the second half of each partition's
+	   impulse response.  Zeroing them for one partition per block, in
+	   rotation, keeps that leakage bounded at a fraction of the cost. */
+	w = part(ec, ec->W[1], ec->constrain_part);
+	fft_real_inverse(ec->fft, w, ec->t_work);
+	memset(&ec->t_work[ec->block], 0, ec->block * sizeof(float));
+	fft_real(ec->fft, ec->t_work, w);
+	if (++ec->constrain_part >= ec->parts)
+		ec->constrain_part = 0;
+}
+
+/* Process one whole block from ec->tx_in and ec->rx_in into ec->out_buf */
+static void fdaf_process(struct fdaf_state *ec)
+{
+	complexf_t *x;
+	float rx[ec->block];
+	float tmp;
+	float clean;
+	int k;
+	int i;
+
+	/* DC block the rx signal, as oslec does */
+	for (i = 0; i < ec->block; i++) {
+		rx[i] = ec->rx_in[i];
+		if (ec->adaption_mode & ECHO_CAN_USE_RX_HPF) {
+			tmp = rx[i] * (1.0f - 1.0f / 16.0f);
+			ec->rx_1 += -ec->rx_1 * DC_BETA + tmp - ec->rx_2;
+			ec->rx_2 = tmp;
+			rx[i] = ec->rx_1;
+		}
+	}
+
+	/* New tx spectrum, from the last two blocks */
+	memmove(ec->x_time, &ec->x_time[ec->block], ec->block * sizeof(float));
+	for (i = 0; i < ec->block; i++)
+		ec->x_time[ec->block + i] = ec->tx_in[i];
+	ec->x_head = (ec->x_head + ec->parts - 1) % ec->parts;
+	x = x_part(ec, 0);
+	fft_real(ec->fft, ec->x_time, x);
+	for (k = 0; k < ec->bins; k++) {
+		ec->Sxx[k] += POWER_SMOOTHING * (x[k].re * x[k].re +
+						 x[k].im * x[k].im - ec->Sxx[k]);
+	}
+
+	/* Foreground and background filters */
+	fdaf_filter(ec, ec->W[0]);
+	for (i = 0; i < ec->block; i++)
+		ec->clean[i] = rx[i] - ec->echo[i];
+	fdaf_filter(ec, ec->W[1]);
+	for (i = 0; i < ec->block; i++)
+		ec->clean_bg[i] = rx[i] - ec->echo[i];
+
+	/* Block levels, smoothed a little */
+	ec->Ltx += 0.5f * (mean_level(&ec->x_time[ec->block], ec->block) - ec->Ltx);
+	ec->Lrx += 0.5f * (mean_level(rx, ec->block) - ec->Lrx);
+	ec->Lclean += 0.5f * (mean_level(ec->clean, ec->block) - ec->Lclean);
+	ec->Lclean_bg += 0.5f * (mean_level(ec->clean_bg, ec->block) - ec->Lclean_bg);
+
+	/* Background filter adaption, with the same very simple DTD */
+	if (ec->nonupdate_dwell == 0 && ec->Ltx > MIN_TX_LEVEL_FOR_ADAPTION)
+		fdaf_adapt(ec);
+
+	if ((ec->Lrx > MIN_RX_LEVEL_FOR_ADAPTION) && (ec->Lrx > ec->Ltx))
+		ec->nonupdate_dwell = DTD_HANGOVER;
+	ec->nonupdate_dwell -= ec->block;
+	if (ec->nonupdate_dwell < 0)
+		ec->nonupdate_dwell = 0;
+
+	/* Transfer logic, as in oslec */
+	if ((ec->adaption_mode & ECHO_CAN_USE_ADAPTION) &&
+	    (ec->nonupdate_dwell == 0) &&
+	    (8 * ec->Lclean_bg < 7 * ec->Lclean) &&
+	    (8 * ec->Lclean_bg < ec->Ltx)) {
+		if (ec->cond_met == TRANSFER_BLOCKS) {
+			memcpy(ec->W[0], ec->W[1],
+			       ec->parts * ec->bins * sizeof(complexf_t));
+			for (i = 0; i < ec->block; i++)
+				ec->clean[i] = ec->clean_bg[i];
+			ec->Lclean = ec->Lclean_bg;
+		} else
+			ec->cond_met++;
+	} else
+		ec->cond_met = 0;
+
+	/* Non-linear processing */
+	for (i = 0; i < ec->block; i++) {
+		clean = ec->clean[i];
+		if (ec->adaption_mode & ECHO_CAN_USE_NLP) {
+			if (16 * ec->Lclean < ec->Ltx) {
+				if (ec->adaption_mode & ECHO_CAN_USE_CLIP) {
+					if (clean > ec->Lbgn)
+						clean = ec->Lbgn;
+					if (clean < -ec->Lbgn)
+						clean = -ec->Lbgn;
+				} else
+					clean = 0.0f;
+			} else if (ec->Lclean < BGN_LEVEL_LIMIT) {
+				ec->Lbgn += (fabsf(clean) - ec->Lbgn) / 4096.0f;
+			}
+		}
+		if (ec->adaption_mode & ECHO_CAN_DISABLE)
+			clean = ec->rx_in[i];
+		if (clean > 32767.0f)
+			clean = 32767.0f;
+		if (clean < -32768.0f)
+			clean = -32768.0f;
+		ec->out_buf[i] = (int16_t) lrintf(clean);
+	}
+}
+
+void fdaf_update_block(struct fdaf_state *ec, const int16_t *tx,
+		       const int16_t *rx, int16_t *out, int n)
+{
+	int16_t clean;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		clean = ec->out_buf[ec->pos];
+		ec->tx_in[ec->pos] = tx[i];
+		ec->rx_in[ec->pos] = rx[i];
+		out[i] = clean;
+		if (++ec->pos == ec->block) {
+			fdaf_process(ec);
+			ec->pos = 0;
+		}
+	}
+}
+
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,91 @@
+/*
+ * fdaf.h - Partitioned block frequency domain echo canceller
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*! \page fdaf_page Frequency domain echo canceller
+\section fdaf_page_sec_1 What does it do?
+This is an alternative to the time domain OSLEC canceller for long echo
+tails.  It has the same dual path structure - a background filter which
+always adapts, and a foreground filter which produces the output and is
+only updated from the background one when that is doing better - but the
+filtering and adaption are done on blocks of samples in the frequency
+domain.  The cost per sample grows with the number of partitions, rather
+than with the number of taps, so tails of several thousand taps are cheap.
+
+\section fdaf_page_sec_2 How does it work?
+The echo path is split into partitions of one block each.  The transmitted
+signal is transformed in overlapping blocks of twice the block length
+(overlap-save), and each partition of the filter is a spectrum which
+multiplies a delayed input spectrum.  The background filter is adapted with
+a per-bin normalised LMS update.  The gradient constraint, which stops
+circular convolution errors building up, is applied to one partition per
+block in rotation.
+
+The canceller works on whole blocks, so its output lags its input by one
+block.
+*/
+
+#if !defined(_FDAF_H_)
+#define _FDAF_H_
+
+#include <stdint.h>
+
+#include "oslec.h"
+
+/*!
+    Frequency domain echo canceller descriptor.
+*/
+struct fdaf_state;
+
+/*! Create a frequency domain echo canceller context.
+    \param len The length of the canceller, in samples.
+    \param block The block (partition) length, in samples. This must be a
+           power of 2.
+    \param adaption_mode The mode, using the same ECHO_CAN_xxx bits as
+           oslec_create(). ECHO_CAN_USE_ADAPTION, ECHO_CAN_USE_NLP,
+           ECHO_CAN_USE_CLIP, ECHO_CAN_USE_RX_HPF and ECHO_CAN_DISABLE are
+           supported.
+    \return The new canceller context, or NULL if the canceller could not be created.
+*/
+struct fdaf_state *fdaf_create(int len, int block, int adaption_mode);
+
+/*! Free a frequency domain echo canceller context.
+    \param ec The echo canceller context.
+*/
+void fdaf_free(struct fdaf_state *ec);
+
+/*! Flush (reinitialise) a frequency domain echo canceller context.
+    \param ec The echo canceller context.
+*/
+void fdaf_flush(struct fdaf_state *ec);
+
+/*! Set the adaption mode of a frequency domain echo canceller context.
+    \param ec The echo canceller context.
+    \param adaption_mode The mode.
+*/
+void fdaf_adaption_mode(struct fdaf_state *ec, int adaption_mode);
+
+/*! Process a block of samples through a frequency domain echo canceller.
+    Any number of samples may be passed; the output lags the input by one
+    canceller block.
+    \param ec The echo canceller context.
+    \param tx The transmitted audio samples.
+    \param rx The received audio samples.
+    \param out The clean (echo cancelled) received samples. This may be the
+           same buffer as rx.
+    \param n The number of samples.
+*/
+void fdaf_update_block(struct fdaf_state *ec, const int16_t *tx,
+		       const int16_t *rx, int16_t *out, int n);
+
+#endif
+/*- End of file ------------------------------------------------------------*/
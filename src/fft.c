@@ -0,0 +1,182 @@
+/*
+ * fft.c - Real valued FFT
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "fft.h"
+
+struct fft_state {
+	/* real transform length, and the complex length used to do it */
+	int n;
+	int half;
+
+	/* bit reversal permutation of 0..half-1 */
+	int *bitrev;
+	/* e^(-2*pi*i*k/half), for the complex transform */
+	complexf_t *twiddle;
+	/* e^(-2*pi*i*k/n), for splitting the real transform */
+	complexf_t *split;
+
+	complexf_t *work;
+};
+
+struct fft_state *fft_create(int n)
+{
+	struct fft_state *s;
+	int bits;
+	int i;
+	int j;
+
+	if (n < 4 || (n & (n - 1)))
+		return NULL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->n = n;
+	s->half = n / 2;
+	s->bitrev = malloc(s->half * sizeof(int));
+	s->twiddle = malloc(s->half * sizeof(complexf_t));
+	s->split = malloc(s->half * sizeof(complexf_t));
+	s->work = malloc(s->half * sizeof(complexf_t));
+	if (!s->bitrev || !s->twiddle || !s->split || !s->work) {
+		fft_free(s);
+		return NULL;
+	}
+
+	for (bits = 0; (1 << bits) < s->half; bits++) ;
+	for (i = 0; i < s->half; i++) {
+		s->bitrev[i] = 0;
+		for (j = 0; j < bits; j++) {
+			if (i & (1 << j))
+				s->bitrev[i] |= 1 << (bits - 1 - j);
+		}
+		s->twiddle[i].re = cos(2.0 * M_PI * i / s->half);
+		s->twiddle[i].im = -sin(2.0 * M_PI * i / s->half);
+		s->split[i].re = cos(2.0 * M_PI * i / n);
+		s->split[i].im = -sin(2.0 * M_PI * i / n);
+	}
+
+	return s;
+}
+
+void fft_free(struct fft_state *s)
+{
+	free(s->bitrev);
+	free(s->twiddle);
+	free(s->split);
+	free(s->work);
+	free(s);
+}
+
+/* In place forward complex transform of s->work, which must already be in
+   bit reversed order. */
+static void fft_complex(struct fft_state *s)
+{
+	complexf_t *a = s->work;
+	complexf_t u;
+	complexf_t v;
+	complexf_t w;
+	int len;
+	int step;
+	int i;
+	int j;
+
+	for (len = 2, step = s->half / 2; len <= s->half; len <<= 1, step >>= 1) {
+		for (i = 0; i < s->half; i += len) {
+			for (j = 0; j < len / 2; j++) {
+				w = s->twiddle[j * step];
+				u = a[i + j];
+				v.re = a[i + j + len / 2].re * w.re -
+				    a[i + j + len / 2].im * w.im;
+				v.im = a[i + j + len / 2].re * w.im +
+				    a[i + j + len / 2].im * w.re;
+				a[i + j].re = u.re + v.re;
+				a[i + j].im = u.im + v.im;
+				a[i + j + len / 2].re = u.re - v.re;
+				a[i + j + len / 2].im = u.im - v.im;
+			}
+		}
+	}
+}
+
+void fft_real(struct fft_state *s, const float *in, complexf_t *out)
+{
+	complexf_t *z = s->work;
+	complexf_t even;
+	complexf_t odd;
+	complexf_t zk;
+	complexf_t zc;
+	int half = s->half;
+	int k;
+
+	for (k = 0; k < half; k++) {
+		z[s->bitrev[k]].re = in[2 * k];
+		z[s->bitrev[k]].im = in[2 * k + 1];
+	}
+	fft_complex(s);
+
+	out[0].re = z[0].re + z[0].im;
+	out[0].im = 0.0f;
+	out[half].re = z[0].re - z[0].im;
+	out[half].im = 0.0f;
+	for (k = 1; k < half; k++) {
+		zk = z[k];
+		zc.re = z[half - k].re;
+		zc.im = -z[half - k].im;
+		/* spectra of the even and odd samples */
+		even.re = 0.5f * (zk.re + zc.re);
+		even.im = 0.5f * (zk.im + zc.im);
+		odd.re = 0.5f * (zk.im - zc.im);
+		odd.im = -0.5f * (zk.re - zc.re);
+		out[k].re = even.re + s->split[k].re * odd.re -
+		    s->split[k].im * odd.im;
+		out[k].im = even.im + s->split[k].re * odd.im +
+		    s->split[k].im * odd.re;
+	}
+}
+
+void fft_real_inverse(struct fft_state *s, const complexf_t *in, float *out)
+{
+	complexf_t *z = s->work;
+	complexf_t even;
+	complexf_t odd;
+	complexf_t t;
+	float scale;
+	int half = s->half;
+	int k;
+
+	/* Rebuild the packed half length spectrum, conjugated so the forward
+	   transform does the inverse. */
+	for (k = 0; k < half; k++) {
+		even.re = 0.5f * (in[k].re + in[half - k].re);
+		even.im = 0.5f * (in[k].im - in[half - k].im);
+		t.re = 0.5f * (in[k].re - in[half - k].re);
+		t.im = 0.5f * (in[k].im + in[half - k].im);
+		odd.re = t.re * s->split[k].re + t.im * s->split[k].im;
+		odd.im = t.im * s->split[k].re - t.re * s->split[k].im;
+		z[s->bitrev[k]].re = even.re - odd.im;
+		z[s->bitrev[k]].im = -(even.im + odd.re);
+	}
+	fft_complex(s);
+
+	scale = 1.0f / half;
+	for (k = 0; k < half; k++) {
+		out[2 * k] = z[k].re * scale;
+		out[2 * k + 1] = -z[k].im * scale;
+	}
+}
+
+/*- End of file ------------------------------------------------------------*/
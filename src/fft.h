@@ -0,0 +1,70 @@
+/*
+ * fft.h - Real valued FFT
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*! \page fft_page Real valued FFT
+\section fft_page_sec_1 What does it do?
+Transforms blocks of real samples to and from the frequency domain, for the
+block processing parts of the canceller.
+
+\section fft_page_sec_2 How does it work?
+A real transform of length n is done as a complex radix 2 transform of
+length n/2, on the even samples packed into the real parts and the odd ones
+into the imaginary parts, followed by a twiddle pass which separates the two
+halves again.  Only the n/2 + 1 non-redundant bins are stored.
+*/
+
+#if !defined(_FFT_H_)
+#define _FFT_H_
+
+/*!
+    Single precision complex number.
+*/
+typedef struct {
+	float re;
+	float im;
+} complexf_t;
+
+/*!
+    FFT descriptor. This holds the tables and work space for transforms of one
+    length.
+*/
+struct fft_state;
+
+/*! Create an FFT context.
+    \param n The transform length. This must be a power of 2, and at least 4.
+    \return The new context, or NULL if it could not be created.
+*/
+struct fft_state *fft_create(int n);
+
+/*! Free an FFT context.
+    \param s The FFT context.
+*/
+void fft_free(struct fft_state *s);
+
+/*! Forward transform of n real samples.
+    \param s The FFT context.
+    \param in The n input samples.
+    \param out The n/2 + 1 output bins, from DC to Nyquist.
+*/
+void fft_real(struct fft_state *s, const float *in, complexf_t *out);
+
+/*! Inverse transform to n real samples. This is scaled by 1/n, so it exactly
+    undoes fft_real().
+    \param s The FFT context.
+    \param in The n/2 + 1 input bins, from DC to Nyquist.
+    \param out The n output samples.
+*/
+void fft_real_inverse(struct fft_state *s, const complexf_t *in, float *out);
+
+#endif
+/*- End of file ------------------------------------------------------------*/
@@ -1,61 +1,115 @@
-
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
-#include <pthread.h>
 
 #include "pa_ringbuffer.h"
 #include "conf.h"
+#include "reactor.h"
 #include "util.h"
 
-extern int g_is_quit;
-
 PaUtilRingBuffer g_out_ringbuffer;
 
-void *fifo_thread(void *ptr)
+static conf_t *g_conf;
+static struct reactor *g_reactor;
+static int g_out_fd = -1;
+static int g_out_event = -1;    // eventfd, kicked by fifo_write()
+static unsigned g_out_offset;   // bytes of the next frame already written
+
+static void fifo_out_ready(void *arg, int fd, uint32_t events);
+
+static void fifo_clear(void)
+{
+    PaUtil_AdvanceRingBufferReadIndex(&g_out_ringbuffer, PaUtil_GetRingBufferReadAvailable(&g_out_ringbuffer));
+    g_out_offset = 0;
+}
+
+static void fifo_close(void)
+{
+    reactor_remove(g_reactor, g_out_fd);
+    close(g_out_fd);
+    g_out_fd = -1;
+}
+
+// write out as much as the reader takes, in the reactor
+static void fifo_flush(void)
 {
-    conf_t *conf = (conf_t *)ptr;
     ring_buffer_size_t size1, size2, available;
     void *data1, *data2;
-    int fd = open(conf->out_fifo, O_WRONLY);      // will block until reader is available
-    if (fd < 0) {
-        printf("failed to open %s, error %d\n", conf->out_fifo, fd);
-        return NULL;
+
+    if (g_out_fd < 0)
+    {
+        // this fails until there is a reader, and what came before it is
+        // thrown away
+        g_out_fd = open(g_conf->out_fifo, O_WRONLY | O_NONBLOCK);
+        fifo_clear();
+        if (g_out_fd >= 0 && reactor_add(g_reactor, g_out_fd, 0, fifo_out_ready, NULL) < 0)
+        {
+            close(g_out_fd);
+            g_out_fd = -1;
+        }
+        return;
     }
 
-    // clear
-    PaUtil_AdvanceRingBufferReadIndex(&g_out_ringbuffer, PaUtil_GetRingBufferReadAvailable(&g_out_ringbuffer));
-    while (!g_is_quit)
+    while ((available = PaUtil_GetRingBufferReadAvailable(&g_out_ringbuffer)) > 0)
     {
-        available = PaUtil_GetRingBufferReadAvailable(&g_out_ringbuffer);
         PaUtil_GetRingBufferReadRegions(&g_out_ringbuffer, available, &data1, &size1, &data2, &size2);
-        if (size1 > 0) {
-            int result = write(fd, data1, size1 * g_out_ringbuffer.elementSizeBytes);
-            // printf("write %d of %d\n", result / 2, size1);
-            if (result > 0) {
-                PaUtil_AdvanceRingBufferReadIndex(&g_out_ringbuffer, result / g_out_ringbuffer.elementSizeBytes);
-            } else {
-                sleep(1);
+        int result = write(g_out_fd, (char *)data1 + g_out_offset, size1 * g_out_ringbuffer.elementSizeBytes - g_out_offset);
+        if (result < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                // the FIFO is full, carry on when the reader makes room
+                reactor_modify(g_reactor, g_out_fd, EPOLLOUT);
             }
-        } else {
-            usleep(100000);
+            else
+            {
+                // the reader has gone, wait for the next one
+                fifo_close();
+            }
+            return;
         }
+
+        // the pipe may take part of a frame; the rest goes first next time
+        unsigned written = g_out_offset + result;
+        PaUtil_AdvanceRingBufferReadIndex(&g_out_ringbuffer, written / g_out_ringbuffer.elementSizeBytes);
+        g_out_offset = written % g_out_ringbuffer.elementSizeBytes;
     }
+    reactor_modify(g_reactor, g_out_fd, 0);
+}
 
-    close(fd);
+static void fifo_out_ready(void *arg, int fd, uint32_t events)
+{
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        fifo_close();
+        return;
+    }
+    fifo_flush();
+}
 
-    return NULL;
+static void fifo_event_ready(void *arg, int fd, uint32_t events)
+{
+    eventfd_t count;
+
+    if (eventfd_read(fd, &count) == 0)
+    {
+        fifo_flush();
+    }
 }
 
-int fifo_setup(conf_t *conf)
+int fifo_setup(conf_t *conf, struct reactor *reactor)
 {
-    pthread_t writer;
     struct stat st;
 
-    unsigned buffer_size = power2(conf->buffer_size);
+    // as the audio ring buffers, at least 4 periods
+    unsigned buffer_size = power2(conf->buffer_size > 4 * conf->period_size ? conf->buffer_size : 4 * conf->period_size);
     unsigned buffer_bytes = conf->out_channels * conf->bits_per_sample / 8;
 
     void *buf = calloc(buffer_size, buffer_bytes);
@@ -72,6 +126,11 @@ int fifo_setup(conf_t *conf)
         exit(1);
     }
 
+    if (conf->realtime)
+    {
+        memory_prefault(buf, buffer_size * buffer_bytes);
+    }
+
     if (stat(conf->out_fifo, &st) != 0) {
         mkfifo(conf->out_fifo, 0666);
     } else if (!S_ISFIFO(st.st_mode)) {
@@ -79,7 +138,14 @@ int fifo_setup(conf_t *conf)
         mkfifo(conf->out_fifo, 0666);
     }
 
-    pthread_create(&writer, NULL, fifo_thread, conf);
+    g_conf = conf;
+    g_reactor = reactor;
+    g_out_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_out_event < 0 || reactor_add(reactor, g_out_event, EPOLLIN, fifo_event_ready, NULL) < 0)
+    {
+        fprintf(stderr, "Fail to set up %s\n", conf->out_fifo);
+        exit(1);
+    }
 
     return 0;
 }
@@ -87,5 +153,9 @@ int fifo_setup(conf_t *conf)
 
 int fifo_write(void *buf, size_t frames)
 {
-    return PaUtil_WriteRingBuffer(&g_out_ringbuffer, buf, frames);
+    int written = PaUtil_WriteRingBuffer(&g_out_ringbuffer, buf, frames);
+
+    eventfd_write(g_out_event, 1);
+
+    return written;
 }
@@ -64,9 +64,22 @@
    can.
 */
 
-#if defined(USE_MMX)  ||  defined(USE_SSE2)
-#include "mmx.h"
-#endif
+/*
+   HISTORY NOTES:
+
+   All the filters keep their history unrolled (mirrored), as the Blackfin
+   code always has: the history is twice the filter length, and each sample
+   is written at curr_pos and at curr_pos + taps.  The taps - 1 samples
+   before the newest one are then always the contiguous run starting at
+   curr_pos, so the inner loops are single straight runs with no
+   wraparound split, which the compiler (and the hand-written SSE2, AVX2,
+   AVX-512 and NEON kernels in fir_simd.c) can vectorise cleanly.  The
+   history is allocated cache line aligned.
+*/
+
+#include "fir_simd.h"
+
+#define FIR_HISTORY_ALIGN	64
 
 /*!
     16 bit integer FIR descriptor. This defines the working state for a single
@@ -102,27 +115,29 @@ typedef struct {
 	float *history;
 } fir_float_state_t;
 
+static __inline__ void *fir_history_alloc(int taps, size_t size)
+{
+	void *history;
+
+	if (posix_memalign(&history, FIR_HISTORY_ALIGN, 2 * taps * size))
+		return NULL;
+	memset(history, 0, 2 * taps * size);
+	return history;
+}
+
 static __inline__ const int16_t *fir16_create(fir16_state_t * fir,
 					      const int16_t * coeffs, int taps)
 {
 	fir->taps = taps;
 	fir->curr_pos = taps - 1;
 	fir->coeffs = coeffs;
-#if defined(USE_MMX)  ||  defined(USE_SSE2) || defined(__bfin__)
-	fir->history = calloc(2 * taps, sizeof(int16_t));
-#else
-	fir->history = calloc(taps, sizeof(int16_t));
-#endif
+	fir->history = fir_history_alloc(taps, sizeof(int16_t));
 	return fir->history;
 }
 
 static __inline__ void fir16_flush(fir16_state_t * fir)
 {
-#if defined(USE_MMX)  ||  defined(USE_SSE2) || defined(__bfin__)
 	memset(fir->history, 0, 2 * fir->taps * sizeof(int16_t));
-#else
-	memset(fir->history, 0, fir->taps * sizeof(int16_t));
-#endif
 }
 
 static __inline__ void fir16_free(fir16_state_t * fir)
@@ -159,90 +174,14 @@ static inline int32_t dot_asm(short *x, short *y, int len)
 
 static __inline__ int16_t fir16(fir16_state_t * fir, int16_t sample)
 {
-	int32_t y;
-#if defined(USE_MMX)
-	int i;
-	mmx_t *mmx_coeffs;
-	mmx_t *mmx_hist;
-
-	fir->history[fir->curr_pos] = sample;
-	fir->history[fir->curr_pos + fir->taps] = sample;
-
-	mmx_coeffs = (mmx_t *) fir->coeffs;
-	mmx_hist = (mmx_t *) & fir->history[fir->curr_pos];
-	i = fir->taps;
-	pxor_r2r(mm4, mm4);
-	/* 8 samples per iteration, so the filter must be a multiple of 8 long. */
-	while (i > 0) {
-		movq_m2r(mmx_coeffs[0], mm0);
-		movq_m2r(mmx_coeffs[1], mm2);
-		movq_m2r(mmx_hist[0], mm1);
-		movq_m2r(mmx_hist[1], mm3);
-		mmx_coeffs += 2;
-		mmx_hist += 2;
-		pmaddwd_r2r(mm1, mm0);
-		pmaddwd_r2r(mm3, mm2);
-		paddd_r2r(mm0, mm4);
-		paddd_r2r(mm2, mm4);
-		i -= 8;
-	}
-	movq_r2r(mm4, mm0);
-	psrlq_i2r(32, mm0);
-	paddd_r2r(mm0, mm4);
-	movd_r2m(mm4, y);
-	emms();
-#elif defined(USE_SSE2)
-	int i;
-	xmm_t *xmm_coeffs;
-	xmm_t *xmm_hist;
-
-	fir->history[fir->curr_pos] = sample;
-	fir->history[fir->curr_pos + fir->taps] = sample;
-
-	xmm_coeffs = (xmm_t *) fir->coeffs;
-	xmm_hist = (xmm_t *) & fir->history[fir->curr_pos];
-	i = fir->taps;
-	pxor_r2r(xmm4, xmm4);
-	/* 16 samples per iteration, so the filter must be a multiple of 16 long. */
-	while (i > 0) {
-		movdqu_m2r(xmm_coeffs[0], xmm0);
-		movdqu_m2r(xmm_coeffs[1], xmm2);
-		movdqu_m2r(xmm_hist[0], xmm1);
-		movdqu_m2r(xmm_hist[1], xmm3);
-		xmm_coeffs += 2;
-		xmm_hist += 2;
-		pmaddwd_r2r(xmm1, xmm0);
-		pmaddwd_r2r(xmm3, xmm2);
-		paddd_r2r(xmm0, xmm4);
-		paddd_r2r(xmm2, xmm4);
-		i -= 16;
-	}
-	movdqa_r2r(xmm4, xmm0);
-	psrldq_i2r(8, xmm0);
-	paddd_r2r(xmm0, xmm4);
-	movdqa_r2r(xmm4, xmm0);
-	psrldq_i2r(4, xmm0);
-	paddd_r2r(xmm0, xmm4);
-	movd_r2m(xmm4, y);
-#elif defined(__bfin__)
+	int64_t y;
 	fir->history[fir->curr_pos] = sample;
 	fir->history[fir->curr_pos + fir->taps] = sample;
+#if defined(__bfin__)
 	y = dot_asm((int16_t *) fir->coeffs, &fir->history[fir->curr_pos],
 		    fir->taps);
 #else
-	int i;
-	int offset1;
-	int offset2;
-
-	fir->history[fir->curr_pos] = sample;
-
-	offset2 = fir->curr_pos;
-	offset1 = fir->taps - offset2;
-	y = 0;
-	for (i = fir->taps - 1; i >= offset1; i--)
-		y += fir->coeffs[i] * fir->history[i - offset1];
-	for (; i >= 0; i--)
-		y += fir->coeffs[i] * fir->history[i + offset2];
+	y = fir16_dot(fir->coeffs, &fir->history[fir->curr_pos], fir->taps);
 #endif
 	if (fir->curr_pos <= 0)
 		fir->curr_pos = fir->taps;
@@ -256,13 +195,13 @@ static __inline__ const int16_t *fir32_create(fir32_state_t * fir,
 	fir->taps = taps;
 	fir->curr_pos = taps - 1;
 	fir->coeffs = coeffs;
-	fir->history = calloc(taps, sizeof(int16_t));
+	fir->history = fir_history_alloc(taps, sizeof(int16_t));
 	return fir->history;
 }
 
 static __inline__ void fir32_flush(fir32_state_t * fir)
 {
-	memset(fir->history, 0, fir->taps * sizeof(int16_t));
+	memset(fir->history, 0, 2 * fir->taps * sizeof(int16_t));
 }
 
 static __inline__ void fir32_free(fir32_state_t * fir)
@@ -273,23 +212,53 @@ static __inline__ void fir32_free(fir32_state_t * fir)
 static __inline__ int16_t fir32(fir32_state_t * fir, int16_t sample)
 {
 	int i;
-	int32_t y;
-	int offset1;
-	int offset2;
+	int64_t y;
+	const int16_t *hist;
 
 	fir->history[fir->curr_pos] = sample;
-	offset2 = fir->curr_pos;
-	offset1 = fir->taps - offset2;
+	fir->history[fir->curr_pos + fir->taps] = sample;
+	hist = &fir->history[fir->curr_pos];
 	y = 0;
-	for (i = fir->taps - 1; i >= offset1; i--)
-		y += fir->coeffs[i] * fir->history[i - offset1];
-	for (; i >= 0; i--)
-		y += fir->coeffs[i] * fir->history[i + offset2];
+	for (i = 0; i < fir->taps; i++)
+		y += (int64_t) fir->coeffs[i] * hist[i];
 	if (fir->curr_pos <= 0)
 		fir->curr_pos = fir->taps;
 	fir->curr_pos--;
 	return (int16_t) (y >> 15);
 }
 
+static __inline__ const float *fir_float_create(fir_float_state_t * fir,
+						 const float * coeffs, int taps)
+{
+	fir->taps = taps;
+	fir->curr_pos = taps - 1;
+	fir->coeffs = coeffs;
+	fir->history = fir_history_alloc(taps, sizeof(float));
+	return fir->history;
+}
+
+static __inline__ void fir_float_flush(fir_float_state_t * fir)
+{
+	memset(fir->history, 0, 2 * fir->taps * sizeof(float));
+}
+
+static __inline__ void fir_float_free(fir_float_state_t * fir)
+{
+	free(fir->history);
+}
+
+static __inline__ float fir_float(fir_float_state_t * fir, float sample)
+{
+	float y;
+
+	fir->history[fir->curr_pos] = sample;
+	fir->history[fir->curr_pos + fir->taps] = sample;
+	y = fir_float_dot(fir->coeffs, &fir->history[fir->curr_pos], fir->taps);
+	if (fir->curr_pos <= 0)
+		fir->curr_pos = fir->taps;
+	fir->curr_pos--;
+	return y;
+}
+
 #endif
 /*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,1316 @@
+/*
+ * fir_simd.c - SIMD kernels for the FIR hot loops
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdint.h>
+
+#if defined(__i386__)  ||  defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "fir_simd.h"
+
+/* Portable versions -------------------------------------------------------*/
+
+static int64_t fir16_dot_c(const int16_t * coeffs, const int16_t * hist,
+			   int len)
+{
+	int64_t y;
+	int i;
+
+	y = 0;
+	for (i = 0; i < len; i++)
+		y += coeffs[i] * hist[i];
+	return y;
+}
+
+/* One tap of the LMS update, exactly as lms_adapt_bg() has always done it */
+static __inline__ int16_t lms_step(int16_t hist, int32_t factor)
+{
+	int32_t exp;
+
+	exp = hist * factor;
+	return (int16_t) ((exp + (1 << 14)) >> 15);
+}
+
+static void fir16_lms_c(int16_t * coeffs, const int16_t * src,
+			const int16_t * hist, int32_t factor, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		coeffs[i] = src[i] + lms_step(hist[i], factor);
+}
+
+static int64_t fir16_dot_lms_c(int16_t * coeffs, const int16_t * src,
+			       const int16_t * hist, int32_t factor, int len)
+{
+	int64_t y;
+	int i;
+
+	y = 0;
+	for (i = 0; i < len; i++) {
+		coeffs[i] = src[i] + lms_step(hist[i + 1], factor);
+		y += coeffs[i] * hist[i];
+	}
+	return y;
+}
+
+/* The lane kernels run FIR16_LANES independent filters side by side, for
+   the canceller bank.  Everything is interleaved by lane, so tap i of lane
+   l is at [i*FIR16_LANES + l], and the lanes map straight onto the SIMD
+   lanes: the arithmetic is vertical, with no horizontal adds at all. */
+
+static void fir16_lanes_c(const int16_t * fg, int16_t * bg,
+			  const int16_t * hist, const int32_t * factor,
+			  int64_t * y_fg, int64_t * y_bg, int len)
+{
+	int i;
+	int l;
+
+	for (l = 0; l < FIR16_LANES; l++)
+		y_fg[l] = y_bg[l] = 0;
+	for (i = 0; i < len; i++) {
+		for (l = 0; l < FIR16_LANES; l++) {
+			bg[l] += lms_step(hist[FIR16_LANES + l], factor[l]);
+			y_fg[l] += fg[l] * hist[l];
+			y_bg[l] += bg[l] * hist[l];
+		}
+		fg += FIR16_LANES;
+		bg += FIR16_LANES;
+		hist += FIR16_LANES;
+	}
+}
+
+/* The factor split used by LMS_STEP, for each lane */
+static __inline__ void lms_split(const int32_t * factor, int16_t * fl,
+				 int16_t * fh, int16_t * fmask)
+{
+	int l;
+
+	for (l = 0; l < FIR16_LANES; l++) {
+		fl[l] = (int16_t) factor[l];
+		fh[l] = (int16_t) (factor[l] >> 16);
+		fmask[l] = (factor[l] & 0x8000) ? -1 : 0;
+	}
+}
+
+/* The 64 bit sum from the two halves the SIMD kernels keep: lo, the low
+   32 bits of the sum, and hi, the sum of each term shifted down by 16 bits.
+   hi << 16 is at most 2^31 below the sum, and never above it, so the gap
+   is what lo says it is, modulo 2^32. */
+static __inline__ int64_t acc_join(int32_t hi, int32_t lo)
+{
+	int64_t approx = (int64_t) hi * 65536;
+
+	return approx + (uint32_t) ((uint32_t) lo - (uint32_t) approx);
+}
+
+/* The same, for each lane of a lane kernel */
+static __inline__ void lanes_join(const int32_t * hi, const int32_t * lo,
+				  int64_t * y)
+{
+	int l;
+
+	for (l = 0; l < FIR16_LANES; l++)
+		y[l] = acc_join(hi[l], lo[l]);
+}
+
+/* The floating point kernels, for the float canceller.  There are no
+   rounding rules to match here, so the SIMD versions only agree with these
+   to within the usual reassociation error. */
+
+static float fir_float_dot_c(const float * coeffs, const float * hist,
+			     int len)
+{
+	float y;
+	int i;
+
+	y = 0.0f;
+	for (i = 0; i < len; i++)
+		y += coeffs[i] * hist[i];
+	return y;
+}
+
+static float fir_float_dot_lms_c(float * coeffs, const float * hist,
+				 float factor, int len)
+{
+	float y;
+	int i;
+
+	y = 0.0f;
+	for (i = 0; i < len; i++) {
+		coeffs[i] += factor * hist[i + 1];
+		y += coeffs[i] * hist[i];
+	}
+	return y;
+}
+
+#if defined(__i386__)  ||  defined(__x86_64__)
+
+/* x86 versions ------------------------------------------------------------*/
+
+/* pmaddwd does the multiplies and the first level of adds in one go, so
+   each kernel is just a stream of pmaddwd results summed up, plus a
+   horizontal add at the end.  The history is only 16 bit aligned, so all
+   loads are unaligned ones.  Two accumulators hide the paddd latency.
+
+   With full scale input the sum can need more than 32 bits, so it is
+   found in two parts.  Plain wrapping adds of the pmaddwd results give its
+   low 32 bits exactly, as they always did.  Alongside them the results
+   less 1, shifted down by 16, are summed, which cannot overflow; that sum
+   times 2^16 is below the true one by at most 2^16 per pmaddwd result, so
+   within FIR16_MAX_LEN taps it is at most 2^30 out, and pins down which of
+   the sums with those low 32 bits is the right one.  acc_join() puts them
+   together.
+
+   The 1 is taken off for the one pair which does not fit: -32768 * -32768
+   twice is 2^31, which pmaddwd wraps to -2^31.  Less 1, the wrapped result
+   is 2^31 - 1, as it should be, and every other result less 1 still fits.
+   That is one shift and two adds more per pmaddwd, and the result is exact
+   for any 16 bit input. */
+
+#define ACC_SPLIT(hi, lo, m, ones, add, srai) \
+	do { \
+		hi = add(hi, srai(add(m, ones), 16)); \
+		lo = add(lo, m); \
+	} while (0)
+
+__attribute__((target("sse2")))
+static __inline__ int64_t acc_join_sse2(__m128i hi, __m128i lo)
+{
+	hi = _mm_add_epi32(hi, _mm_srli_si128(hi, 8));
+	hi = _mm_add_epi32(hi, _mm_srli_si128(hi, 4));
+	lo = _mm_add_epi32(lo, _mm_srli_si128(lo, 8));
+	lo = _mm_add_epi32(lo, _mm_srli_si128(lo, 4));
+	return acc_join(_mm_cvtsi128_si32(hi), _mm_cvtsi128_si32(lo));
+}
+
+__attribute__((target("avx2")))
+static __inline__ int64_t acc_join_avx2(__m256i hi, __m256i lo)
+{
+	return acc_join_sse2(_mm_add_epi32(_mm256_castsi256_si128(hi),
+					   _mm256_extracti128_si256(hi, 1)),
+			     _mm_add_epi32(_mm256_castsi256_si128(lo),
+					   _mm256_extracti128_si256(lo, 1)));
+}
+
+/* Not _mm512_reduce_add_epi32(), which adds the lanes as signed ints: lo
+   wraps, and that would be signed overflow. */
+__attribute__((target("avx512bw")))
+static __inline__ int64_t acc_join_avx512(__m512i hi, __m512i lo)
+{
+	return acc_join_avx2(_mm256_add_epi32(_mm512_castsi512_si256(hi),
+					      _mm512_extracti64x4_epi64(hi, 1)),
+			     _mm256_add_epi32(_mm512_castsi512_si256(lo),
+					      _mm512_extracti64x4_epi64(lo, 1)));
+}
+
+__attribute__((target("sse2")))
+static int64_t fir16_dot_sse2(const int16_t * coeffs, const int16_t * hist,
+			      int len)
+{
+	__m128i hi0, lo0, hi1, lo1, m, ones;
+	int64_t y;
+	int i;
+
+	hi0 = lo0 = hi1 = lo1 = _mm_setzero_si128();
+	ones = _mm_set1_epi32(-1);
+	for (i = 0; i + 16 <= len; i += 16) {
+		m = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) &coeffs[i]),
+				   _mm_loadu_si128((const __m128i *) &hist[i]));
+		ACC_SPLIT(hi0, lo0, m, ones, _mm_add_epi32, _mm_srai_epi32);
+		m = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) &coeffs[i + 8]),
+				   _mm_loadu_si128((const __m128i *) &hist[i + 8]));
+		ACC_SPLIT(hi1, lo1, m, ones, _mm_add_epi32, _mm_srai_epi32);
+	}
+	y = acc_join_sse2(_mm_add_epi32(hi0, hi1), _mm_add_epi32(lo0, lo1));
+	for (; i < len; i++)
+		y += coeffs[i] * hist[i];
+	return y;
+}
+
+__attribute__((target("avx2")))
+static int64_t fir16_dot_avx2(const int16_t * coeffs, const int16_t * hist,
+			      int len)
+{
+	__m256i hi0, lo0, hi1, lo1, m, ones;
+	int64_t y;
+	int i;
+
+	hi0 = lo0 = hi1 = lo1 = _mm256_setzero_si256();
+	ones = _mm256_set1_epi32(-1);
+	for (i = 0; i + 32 <= len; i += 32) {
+		m = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *) &coeffs[i]),
+				      _mm256_loadu_si256((const __m256i *) &hist[i]));
+		ACC_SPLIT(hi0, lo0, m, ones, _mm256_add_epi32, _mm256_srai_epi32);
+		m = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *) &coeffs[i + 16]),
+				      _mm256_loadu_si256((const __m256i *) &hist[i + 16]));
+		ACC_SPLIT(hi1, lo1, m, ones, _mm256_add_epi32, _mm256_srai_epi32);
+	}
+	y = acc_join_avx2(_mm256_add_epi32(hi0, hi1),
+			  _mm256_add_epi32(lo0, lo1));
+	for (; i < len; i++)
+		y += coeffs[i] * hist[i];
+	return y;
+}
+
+__attribute__((target("avx512bw")))
+static int64_t fir16_dot_avx512(const int16_t * coeffs,
+				const int16_t * hist, int len)
+{
+	__m512i hi0, lo0, hi1, lo1, m, ones;
+	int64_t y;
+	int i;
+
+	hi0 = lo0 = hi1 = lo1 = _mm512_setzero_si512();
+	ones = _mm512_set1_epi32(-1);
+	for (i = 0; i + 64 <= len; i += 64) {
+		m = _mm512_madd_epi16(_mm512_loadu_si512(&coeffs[i]),
+				      _mm512_loadu_si512(&hist[i]));
+		ACC_SPLIT(hi0, lo0, m, ones, _mm512_add_epi32, _mm512_srai_epi32);
+		m = _mm512_madd_epi16(_mm512_loadu_si512(&coeffs[i + 32]),
+				      _mm512_loadu_si512(&hist[i + 32]));
+		ACC_SPLIT(hi1, lo1, m, ones, _mm512_add_epi32, _mm512_srai_epi32);
+	}
+	y = acc_join_avx512(_mm512_add_epi32(hi0, hi1),
+			    _mm512_add_epi32(lo0, lo1));
+	for (; i < len; i++)
+		y += coeffs[i] * hist[i];
+	return y;
+}
+
+/* The LMS update needs the low 32 bits of a 16x32 bit product, which SSE2
+   cannot do directly.  Split the factor into a signed high half fh and an
+   unsigned low half fl, so that
+
+       h*factor = (h*fh << 16) + h*fl
+
+   h*fl is formed from the signed pmullw/pmulhw pair, adding h back into the
+   high half when fl has its top bit set.  The rounding add and the >> 15
+   are then done on the high:low pair directly, so everything stays in 16
+   bit lanes and the result is bit exact with the C version. */
+
+#define LMS_STEP(v, mullo, mulhi, add, and, or, slli, srli, h, fl, fh, fmask, round) \
+	do { \
+		lo = mullo(h, fl); \
+		hi = add(add(mulhi(h, fl), and(h, fmask)), mullo(h, fh)); \
+		carry = srli(and(lo, slli(lo, 1)), 15); \
+		lo = add(lo, round); \
+		hi = add(hi, carry); \
+		v = or(slli(hi, 1), srli(lo, 15)); \
+	} while (0)
+
+__attribute__((target("sse2")))
+static void fir16_lms_sse2(int16_t * coeffs, const int16_t * src,
+			   const int16_t * hist, int32_t factor, int len)
+{
+	__m128i fl, fh, fmask, round;
+	__m128i h, lo, hi, carry, v;
+	int i;
+
+	fl = _mm_set1_epi16((int16_t) factor);
+	fh = _mm_set1_epi16((int16_t) (factor >> 16));
+	fmask = _mm_set1_epi16((factor & 0x8000) ? -1 : 0);
+	round = _mm_set1_epi16(1 << 14);
+	for (i = 0; i + 8 <= len; i += 8) {
+		h = _mm_loadu_si128((const __m128i *) &hist[i]);
+		LMS_STEP(v, _mm_mullo_epi16, _mm_mulhi_epi16, _mm_add_epi16,
+			 _mm_and_si128, _mm_or_si128, _mm_slli_epi16,
+			 _mm_srli_epi16, h, fl, fh, fmask, round);
+		_mm_storeu_si128((__m128i *) &coeffs[i],
+				 _mm_add_epi16(_mm_loadu_si128((const __m128i *) &src[i]), v));
+	}
+	for (; i < len; i++)
+		coeffs[i] = src[i] + lms_step(hist[i], factor);
+}
+
+__attribute__((target("avx2")))
+static void fir16_lms_avx2(int16_t * coeffs, const int16_t * src,
+			   const int16_t * hist, int32_t factor, int len)
+{
+	__m256i fl, fh, fmask, round;
+	__m256i h, lo, hi, carry, v;
+	int i;
+
+	fl = _mm256_set1_epi16((int16_t) factor);
+	fh = _mm256_set1_epi16((int16_t) (factor >> 16));
+	fmask = _mm256_set1_epi16((factor & 0x8000) ? -1 : 0);
+	round = _mm256_set1_epi16(1 << 14);
+	for (i = 0; i + 16 <= len; i += 16) {
+		h = _mm256_loadu_si256((const __m256i *) &hist[i]);
+		LMS_STEP(v, _mm256_mullo_epi16, _mm256_mulhi_epi16,
+			 _mm256_add_epi16, _mm256_and_si256, _mm256_or_si256,
+			 _mm256_slli_epi16, _mm256_srli_epi16, h, fl, fh, fmask,
+			 round);
+		_mm256_storeu_si256((__m256i *) &coeffs[i],
+				    _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &src[i]), v));
+	}
+	for (; i < len; i++)
+		coeffs[i] = src[i] + lms_step(hist[i], factor);
+}
+
+__attribute__((target("avx512bw")))
+static void fir16_lms_avx512(int16_t * coeffs, const int16_t * src,
+			     const int16_t * hist, int32_t factor, int len)
+{
+	__m512i fl, fh, fmask, round;
+	__m512i h, lo, hi, carry, v;
+	int i;
+
+	fl = _mm512_set1_epi16((int16_t) factor);
+	fh = _mm512_set1_epi16((int16_t) (factor >> 16));
+	fmask = _mm512_set1_epi16((factor & 0x8000) ? -1 : 0);
+	round = _mm512_set1_epi16(1 << 14);
+	for (i = 0; i + 32 <= len; i += 32) {
+		h = _mm512_loadu_si512(&hist[i]);
+		LMS_STEP(v, _mm512_mullo_epi16, _mm512_mulhi_epi16,
+			 _mm512_add_epi16, _mm512_and_si512, _mm512_or_si512,
+			 _mm512_slli_epi16, _mm512_srli_epi16, h, fl, fh, fmask,
+			 round);
+		_mm512_storeu_si512(&coeffs[i],
+				    _mm512_add_epi16(_mm512_loadu_si512(&src[i]), v));
+	}
+	for (; i < len; i++)
+		coeffs[i] = src[i] + lms_step(hist[i], factor);
+}
+
+/* The fused kernels apply the update deferred from the previous sample,
+   whose history is the same run shifted by one, and take the dot product
+   with the updated coefficients in the same sweep.  The coefficients and
+   history only stream through the cache once. */
+
+__attribute__((target("sse2")))
+static int64_t fir16_dot_lms_sse2(int16_t * coeffs, const int16_t * src,
+				  const int16_t * hist, int32_t factor, int len)
+{
+	__m128i fl, fh, fmask, round;
+	__m128i h, lo, hi, carry, v, c;
+	__m128i acc_hi, acc_lo, m, ones;
+	int64_t y;
+	int i;
+
+	fl = _mm_set1_epi16((int16_t) factor);
+	fh = _mm_set1_epi16((int16_t) (factor >> 16));
+	fmask = _mm_set1_epi16((factor & 0x8000) ? -1 : 0);
+	round = _mm_set1_epi16(1 << 14);
+	acc_hi = acc_lo = _mm_setzero_si128();
+	ones = _mm_set1_epi32(-1);
+	for (i = 0; i + 8 <= len; i += 8) {
+		h = _mm_loadu_si128((const __m128i *) &hist[i + 1]);
+		LMS_STEP(v, _mm_mullo_epi16, _mm_mulhi_epi16, _mm_add_epi16,
+			 _mm_and_si128, _mm_or_si128, _mm_slli_epi16,
+			 _mm_srli_epi16, h, fl, fh, fmask, round);
+		c = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &src[i]), v);
+		_mm_storeu_si128((__m128i *) &coeffs[i], c);
+		m = _mm_madd_epi16(c, _mm_loadu_si128((const __m128i *) &hist[i]));
+		ACC_SPLIT(acc_hi, acc_lo, m, ones, _mm_add_epi32, _mm_srai_epi32);
+	}
+	y = acc_join_sse2(acc_hi, acc_lo);
+	for (; i < len; i++) {
+		coeffs[i] = src[i] + lms_step(hist[i + 1], factor);
+		y += coeffs[i] * hist[i];
+	}
+	return y;
+}
+
+__attribute__((target("avx2")))
+static int64_t fir16_dot_lms_avx2(int16_t * coeffs, const int16_t * src,
+				  const int16_t * hist, int32_t factor, int len)
+{
+	__m256i fl, fh, fmask, round;
+	__m256i h, lo, hi, carry, v, c;
+	__m256i acc_hi, acc_lo, m, ones;
+	int64_t y;
+	int i;
+
+	fl = _mm256_set1_epi16((int16_t) factor);
+	fh = _mm256_set1_epi16((int16_t) (factor >> 16));
+	fmask = _mm256_set1_epi16((factor & 0x8000) ? -1 : 0);
+	round = _mm256_set1_epi16(1 << 14);
+	acc_hi = acc_lo = _mm256_setzero_si256();
+	ones = _mm256_set1_epi32(-1);
+	for (i = 0; i + 16 <= len; i += 16) {
+		h = _mm256_loadu_si256((const __m256i *) &hist[i + 1]);
+		LMS_STEP(v, _mm256_mullo_epi16, _mm256_mulhi_epi16,
+			 _mm256_add_epi16, _mm256_and_si256, _mm256_or_si256,
+			 _mm256_slli_epi16, _mm256_srli_epi16, h, fl, fh, fmask,
+			 round);
+		c = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &src[i]), v);
+		_mm256_storeu_si256((__m256i *) &coeffs[i], c);
+		m = _mm256_madd_epi16(c, _mm256_loadu_si256((const __m256i *) &hist[i]));
+		ACC_SPLIT(acc_hi, acc_lo, m, ones, _mm256_add_epi32, _mm256_srai_epi32);
+	}
+	y = acc_join_avx2(acc_hi, acc_lo);
+	for (; i < len; i++) {
+		coeffs[i] = src[i] + lms_step(hist[i + 1], factor);
+		y += coeffs[i] * hist[i];
+	}
+	return y;
+}
+
+__attribute__((target("avx512bw")))
+static int64_t fir16_dot_lms_avx512(int16_t * coeffs, const int16_t * src,
+				    const int16_t * hist, int32_t factor,
+				    int len)
+{
+	__m512i fl, fh, fmask, round;
+	__m512i h, lo, hi, carry, v, c;
+	__m512i acc_hi, acc_lo, m, ones;
+	int64_t y;
+	int i;
+
+	fl = _mm512_set1_epi16((int16_t) factor);
+	fh = _mm512_set1_epi16((int16_t) (factor >> 16));
+	fmask = _mm512_set1_epi16((factor & 0x8000) ? -1 : 0);
+	round = _mm512_set1_epi16(1 << 14);
+	acc_hi = acc_lo = _mm512_setzero_si512();
+	ones = _mm512_set1_epi32(-1);
+	for (i = 0; i + 32 <= len; i += 32) {
+		h = _mm512_loadu_si512(&hist[i + 1]);
+		LMS_STEP(v, _mm512_mullo_epi16, _mm512_mulhi_epi16,
+			 _mm512_add_epi16, _mm512_and_si512, _mm512_or_si512,
+			 _mm512_slli_epi16, _mm512_srli_epi16, h, fl, fh, fmask,
+			 round);
+		c = _mm512_add_epi16(_mm512_loadu_si512(&src[i]), v);
+		_mm512_storeu_si512(&coeffs[i], c);
+		m = _mm512_madd_epi16(c, _mm512_loadu_si512(&hist[i]));
+		ACC_SPLIT(acc_hi, acc_lo, m, ones, _mm512_add_epi32, _mm512_srai_epi32);
+	}
+	y = acc_join_avx512(acc_hi, acc_lo);
+	for (; i < len; i++) {
+		coeffs[i] = src[i] + lms_step(hist[i + 1], factor);
+		y += coeffs[i] * hist[i];
+	}
+	return y;
+}
+
+/* For the lane kernels the products have to stay in their own lanes.
+   pmaddwd can still do the work when it is given the same lane of two
+   neighbouring taps side by side: interleaving the words of tap i with
+   those of tap i + 1 leaves lanes 0-3 in one register and lanes 4-7 in
+   another (per 128 bit half, for the wider versions), and each 32 bit sum
+   is then both taps of one lane.  The sums are split for 64 bits as in the
+   other kernels, using the caller's m as the scratch register. */
+
+#define MAC_PAIR(hi0, lo0, hi1, lo1, c0, c1, hlo, hhi, unpacklo, unpackhi, \
+		 madd, add, srai, ones) \
+	do { \
+		m = madd(unpacklo(c0, c1), hlo); \
+		ACC_SPLIT(hi0, lo0, m, ones, add, srai); \
+		m = madd(unpackhi(c0, c1), hhi); \
+		ACC_SPLIT(hi1, lo1, m, ones, add, srai); \
+	} while (0)
+
+__attribute__((target("sse2")))
+static void fir16_lanes_sse2(const int16_t * fg, int16_t * bg,
+			     const int16_t * hist, const int32_t * factor,
+			     int64_t * y_fg, int64_t * y_bg, int len)
+{
+	int16_t fl_s[FIR16_LANES], fh_s[FIR16_LANES], fmask_s[FIR16_LANES];
+	int32_t hi_s[FIR16_LANES], lo_s[FIR16_LANES];
+	__m128i fl[2], fh[2], fmask[2], round;
+	__m128i fg_hi[4], fg_lo[4], bg_hi[4], bg_lo[4];
+	__m128i h0, h1, h2, hlo, hhi, lo, hi, carry, v, c0, c1, m, ones;
+	int i;
+	int k;
+
+	lms_split(factor, fl_s, fh_s, fmask_s);
+	for (k = 0; k < 2; k++) {
+		fl[k] = _mm_loadu_si128((const __m128i *) &fl_s[8 * k]);
+		fh[k] = _mm_loadu_si128((const __m128i *) &fh_s[8 * k]);
+		fmask[k] = _mm_loadu_si128((const __m128i *) &fmask_s[8 * k]);
+	}
+	round = _mm_set1_epi16(1 << 14);
+	for (k = 0; k < 4; k++) {
+		fg_hi[k] = fg_lo[k] = _mm_setzero_si128();
+		bg_hi[k] = bg_lo[k] = _mm_setzero_si128();
+	}
+
+	/* two taps at a time, the second one zero if len is odd */
+	ones = _mm_set1_epi32(-1);
+	for (i = 0; i < len; i += 2) {
+		for (k = 0; k < 2; k++) {
+			h0 = _mm_loadu_si128((const __m128i *) &hist[8 * k]);
+			h1 = _mm_loadu_si128((const __m128i *) &hist[FIR16_LANES + 8 * k]);
+			LMS_STEP(v, _mm_mullo_epi16, _mm_mulhi_epi16,
+				 _mm_add_epi16, _mm_and_si128, _mm_or_si128,
+				 _mm_slli_epi16, _mm_srli_epi16, h1, fl[k],
+				 fh[k], fmask[k], round);
+			c0 = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &bg[8 * k]), v);
+			_mm_storeu_si128((__m128i *) &bg[8 * k], c0);
+			c1 = _mm_setzero_si128();
+			if (i + 1 < len) {
+				h2 = _mm_loadu_si128((const __m128i *) &hist[2 * FIR16_LANES + 8 * k]);
+				LMS_STEP(v, _mm_mullo_epi16, _mm_mulhi_epi16,
+					 _mm_add_epi16, _mm_and_si128,
+					 _mm_or_si128, _mm_slli_epi16,
+					 _mm_srli_epi16, h2, fl[k], fh[k],
+					 fmask[k], round);
+				c1 = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &bg[FIR16_LANES + 8 * k]), v);
+				_mm_storeu_si128((__m128i *) &bg[FIR16_LANES + 8 * k], c1);
+			}
+			hlo = _mm_unpacklo_epi16(h0, h1);
+			hhi = _mm_unpackhi_epi16(h0, h1);
+			MAC_PAIR(bg_hi[2 * k], bg_lo[2 * k], bg_hi[2 * k + 1],
+				 bg_lo[2 * k + 1], c0, c1, hlo, hhi,
+				 _mm_unpacklo_epi16, _mm_unpackhi_epi16,
+				 _mm_madd_epi16, _mm_add_epi32, _mm_srai_epi32, ones);
+			c0 = _mm_loadu_si128((const __m128i *) &fg[8 * k]);
+			c1 = _mm_setzero_si128();
+			if (i + 1 < len)
+				c1 = _mm_loadu_si128((const __m128i *) &fg[FIR16_LANES + 8 * k]);
+			MAC_PAIR(fg_hi[2 * k], fg_lo[2 * k], fg_hi[2 * k + 1],
+				 fg_lo[2 * k + 1], c0, c1, hlo, hhi,
+				 _mm_unpacklo_epi16, _mm_unpackhi_epi16,
+				 _mm_madd_epi16, _mm_add_epi32, _mm_srai_epi32, ones);
+		}
+		fg += 2 * FIR16_LANES;
+		bg += 2 * FIR16_LANES;
+		hist += 2 * FIR16_LANES;
+	}
+
+	for (k = 0; k < 4; k++) {
+		_mm_storeu_si128((__m128i *) &hi_s[4 * k], fg_hi[k]);
+		_mm_storeu_si128((__m128i *) &lo_s[4 * k], fg_lo[k]);
+	}
+	lanes_join(hi_s, lo_s, y_fg);
+	for (k = 0; k < 4; k++) {
+		_mm_storeu_si128((__m128i *) &hi_s[4 * k], bg_hi[k]);
+		_mm_storeu_si128((__m128i *) &lo_s[4 * k], bg_lo[k]);
+	}
+	lanes_join(hi_s, lo_s, y_bg);
+}
+
+__attribute__((target("avx2")))
+static __inline__ void lanes_store_avx2(__m256i hi0, __m256i lo0,
+					__m256i hi1, __m256i lo1, int64_t * y)
+{
+	int32_t hi_s[FIR16_LANES], lo_s[FIR16_LANES];
+
+	_mm256_storeu_si256((__m256i *) &hi_s[0], _mm256_permute2x128_si256(hi0, hi1, 0x20));
+	_mm256_storeu_si256((__m256i *) &hi_s[8], _mm256_permute2x128_si256(hi0, hi1, 0x31));
+	_mm256_storeu_si256((__m256i *) &lo_s[0], _mm256_permute2x128_si256(lo0, lo1, 0x20));
+	_mm256_storeu_si256((__m256i *) &lo_s[8], _mm256_permute2x128_si256(lo0, lo1, 0x31));
+	lanes_join(hi_s, lo_s, y);
+}
+
+__attribute__((target("avx2")))
+static void fir16_lanes_avx2(const int16_t * fg, int16_t * bg,
+			     const int16_t * hist, const int32_t * factor,
+			     int64_t * y_fg, int64_t * y_bg, int len)
+{
+	int16_t fl_s[FIR16_LANES], fh_s[FIR16_LANES], fmask_s[FIR16_LANES];
+	__m256i fl, fh, fmask, round;
+	__m256i fg_hi0, fg_lo0, fg_hi1, fg_lo1, bg_hi0, bg_lo0, bg_hi1, bg_lo1;
+	__m256i h0, h1, h2, hlo, hhi, lo, hi, carry, v, c0, c1, m, ones;
+	int i;
+
+	lms_split(factor, fl_s, fh_s, fmask_s);
+	fl = _mm256_loadu_si256((const __m256i *) fl_s);
+	fh = _mm256_loadu_si256((const __m256i *) fh_s);
+	fmask = _mm256_loadu_si256((const __m256i *) fmask_s);
+	round = _mm256_set1_epi16(1 << 14);
+	fg_hi0 = fg_lo0 = fg_hi1 = fg_lo1 = _mm256_setzero_si256();
+	bg_hi0 = bg_lo0 = bg_hi1 = bg_lo1 = _mm256_setzero_si256();
+
+	ones = _mm256_set1_epi32(-1);
+	for (i = 0; i < len; i += 2) {
+		h0 = _mm256_loadu_si256((const __m256i *) hist);
+		h1 = _mm256_loadu_si256((const __m256i *) &hist[FIR16_LANES]);
+		LMS_STEP(v, _mm256_mullo_epi16, _mm256_mulhi_epi16,
+			 _mm256_add_epi16, _mm256_and_si256, _mm256_or_si256,
+			 _mm256_slli_epi16, _mm256_srli_epi16, h1, fl, fh, fmask,
+			 round);
+		c0 = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) bg), v);
+		_mm256_storeu_si256((__m256i *) bg, c0);
+		c1 = _mm256_setzero_si256();
+		if (i + 1 < len) {
+			h2 = _mm256_loadu_si256((const __m256i *) &hist[2 * FIR16_LANES]);
+			LMS_STEP(v, _mm256_mullo_epi16, _mm256_mulhi_epi16,
+				 _mm256_add_epi16, _mm256_and_si256,
+				 _mm256_or_si256, _mm256_slli_epi16,
+				 _mm256_srli_epi16, h2, fl, fh, fmask, round);
+			c1 = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &bg[FIR16_LANES]), v);
+			_mm256_storeu_si256((__m256i *) &bg[FIR16_LANES], c1);
+		}
+		hlo = _mm256_unpacklo_epi16(h0, h1);
+		hhi = _mm256_unpackhi_epi16(h0, h1);
+		MAC_PAIR(bg_hi0, bg_lo0, bg_hi1, bg_lo1, c0, c1, hlo, hhi,
+			 _mm256_unpacklo_epi16, _mm256_unpackhi_epi16,
+			 _mm256_madd_epi16, _mm256_add_epi32, _mm256_srai_epi32, ones);
+		c0 = _mm256_loadu_si256((const __m256i *) fg);
+		c1 = _mm256_setzero_si256();
+		if (i + 1 < len)
+			c1 = _mm256_loadu_si256((const __m256i *) &fg[FIR16_LANES]);
+		MAC_PAIR(fg_hi0, fg_lo0, fg_hi1, fg_lo1, c0, c1, hlo, hhi,
+			 _mm256_unpacklo_epi16, _mm256_unpackhi_epi16,
+			 _mm256_madd_epi16, _mm256_add_epi32, _mm256_srai_epi32, ones);
+		fg += 2 * FIR16_LANES;
+		bg += 2 * FIR16_LANES;
+		hist += 2 * FIR16_LANES;
+	}
+
+	/* the first of each pair holds lanes 0-3 and 8-11, the second lanes
+	   4-7 and 12-15 */
+	lanes_store_avx2(fg_hi0, fg_lo0, fg_hi1, fg_lo1, y_fg);
+	lanes_store_avx2(bg_hi0, bg_lo0, bg_hi1, bg_lo1, y_bg);
+}
+
+/* A 512 bit register holds two taps of all the lanes, so taps i and i + 1
+   are paired with taps i + 2 and i + 3, and the two halves of each
+   accumulator are added together at the end. */
+
+#define HALVES_ADD(a) \
+	_mm256_add_epi32(_mm512_castsi512_si256(a), _mm512_extracti64x4_epi64(a, 1))
+
+__attribute__((target("avx512bw")))
+static void fir16_lanes_avx512(const int16_t * fg, int16_t * bg,
+			       const int16_t * hist, const int32_t * factor,
+			       int64_t * y_fg, int64_t * y_bg, int len)
+{
+	int16_t fl_s[FIR16_LANES], fh_s[FIR16_LANES], fmask_s[FIR16_LANES];
+	__m512i fl, fh, fmask, round;
+	__m512i fg_hi0, fg_lo0, fg_hi1, fg_lo1, bg_hi0, bg_lo0, bg_hi1, bg_lo1;
+	__m512i h0, h1, hlo, hhi, lo, hi, carry, v, c0, c1, m, ones;
+	int i;
+	int l;
+
+	lms_split(factor, fl_s, fh_s, fmask_s);
+	fl = _mm512_broadcast_i64x4(_mm256_loadu_si256((const __m256i *) fl_s));
+	fh = _mm512_broadcast_i64x4(_mm256_loadu_si256((const __m256i *) fh_s));
+	fmask = _mm512_broadcast_i64x4(_mm256_loadu_si256((const __m256i *) fmask_s));
+	round = _mm512_set1_epi16(1 << 14);
+	fg_hi0 = fg_lo0 = fg_hi1 = fg_lo1 = _mm512_setzero_si512();
+	bg_hi0 = bg_lo0 = bg_hi1 = bg_lo1 = _mm512_setzero_si512();
+
+	ones = _mm512_set1_epi32(-1);
+	for (i = 0; i + 4 <= len; i += 4) {
+		h0 = _mm512_loadu_si512(&hist[FIR16_LANES]);
+		LMS_STEP(v, _mm512_mullo_epi16, _mm512_mulhi_epi16,
+			 _mm512_add_epi16, _mm512_and_si512, _mm512_or_si512,
+			 _mm512_slli_epi16, _mm512_srli_epi16, h0, fl, fh, fmask,
+			 round);
+		c0 = _mm512_add_epi16(_mm512_loadu_si512(bg), v);
+		_mm512_storeu_si512(bg, c0);
+		h1 = _mm512_loadu_si512(&hist[3 * FIR16_LANES]);
+		LMS_STEP(v, _mm512_mullo_epi16, _mm512_mulhi_epi16,
+			 _mm512_add_epi16, _mm512_and_si512, _mm512_or_si512,
+			 _mm512_slli_epi16, _mm512_srli_epi16, h1, fl, fh, fmask,
+			 round);
+		c1 = _mm512_add_epi16(_mm512_loadu_si512(&bg[2 * FIR16_LANES]), v);
+		_mm512_storeu_si512(&bg[2 * FIR16_LANES], c1);
+		h0 = _mm512_loadu_si512(hist);
+		h1 = _mm512_loadu_si512(&hist[2 * FIR16_LANES]);
+		hlo = _mm512_unpacklo_epi16(h0, h1);
+		hhi = _mm512_unpackhi_epi16(h0, h1);
+		MAC_PAIR(bg_hi0, bg_lo0, bg_hi1, bg_lo1, c0, c1, hlo, hhi,
+			 _mm512_unpacklo_epi16, _mm512_unpackhi_epi16,
+			 _mm512_madd_epi16, _mm512_add_epi32, _mm512_srai_epi32, ones);
+		c0 = _mm512_loadu_si512(fg);
+		c1 = _mm512_loadu_si512(&fg[2 * FIR16_LANES]);
+		MAC_PAIR(fg_hi0, fg_lo0, fg_hi1, fg_lo1, c0, c1, hlo, hhi,
+			 _mm512_unpacklo_epi16, _mm512_unpackhi_epi16,
+			 _mm512_madd_epi16, _mm512_add_epi32, _mm512_srai_epi32, ones);
+		fg += 4 * FIR16_LANES;
+		bg += 4 * FIR16_LANES;
+		hist += 4 * FIR16_LANES;
+	}
+
+	lanes_store_avx2(HALVES_ADD(fg_hi0), HALVES_ADD(fg_lo0),
+			 HALVES_ADD(fg_hi1), HALVES_ADD(fg_lo1), y_fg);
+	lanes_store_avx2(HALVES_ADD(bg_hi0), HALVES_ADD(bg_lo0),
+			 HALVES_ADD(bg_hi1), HALVES_ADD(bg_lo1), y_bg);
+
+	for (; i < len; i++) {
+		for (l = 0; l < FIR16_LANES; l++) {
+			bg[l] += lms_step(hist[FIR16_LANES + l], factor[l]);
+			y_fg[l] += fg[l] * hist[l];
+			y_bg[l] += bg[l] * hist[l];
+		}
+		fg += FIR16_LANES;
+		bg += FIR16_LANES;
+		hist += FIR16_LANES;
+	}
+}
+
+/* The AVX2 and AVX-512 float kernels keep four accumulators, which is about
+   what it takes to cover the FMA latency, and need the FMA extension as
+   well as AVX2.  Plain SSE2 has no FMA, so it uses a multiply and an add. */
+
+__attribute__((target("sse2")))
+static float fir_float_dot_sse2(const float * coeffs, const float * hist,
+				int len)
+{
+	__m128 acc0;
+	__m128 acc1;
+	float y;
+	int i;
+
+	acc0 = _mm_setzero_ps();
+	acc1 = _mm_setzero_ps();
+	for (i = 0; i + 8 <= len; i += 8) {
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(&coeffs[i]),
+						   _mm_loadu_ps(&hist[i])));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(&coeffs[i + 4]),
+						   _mm_loadu_ps(&hist[i + 4])));
+	}
+	acc0 = _mm_add_ps(acc0, acc1);
+	acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+	acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+	y = _mm_cvtss_f32(acc0);
+	for (; i < len; i++)
+		y += coeffs[i] * hist[i];
+	return y;
+}
+
+__attribute__((target("sse2")))
+static float fir_float_dot_lms_sse2(float * coeffs, const float * hist,
+				    float factor, int len)
+{
+	__m128 f;
+	__m128 c0;
+	__m128 c1;
+	__m128 acc0;
+	__m128 acc1;
+	float y;
+	int i;
+
+	f = _mm_set1_ps(factor);
+	acc0 = _mm_setzero_ps();
+	acc1 = _mm_setzero_ps();
+	for (i = 0; i + 8 <= len; i += 8) {
+		c0 = _mm_add_ps(_mm_loadu_ps(&coeffs[i]),
+				_mm_mul_ps(f, _mm_loadu_ps(&hist[i + 1])));
+		c1 = _mm_add_ps(_mm_loadu_ps(&coeffs[i + 4]),
+				_mm_mul_ps(f, _mm_loadu_ps(&hist[i + 5])));
+		_mm_storeu_ps(&coeffs[i], c0);
+		_mm_storeu_ps(&coeffs[i + 4], c1);
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(c0, _mm_loadu_ps(&hist[i])));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(c1, _mm_loadu_ps(&hist[i + 4])));
+	}
+	acc0 = _mm_add_ps(acc0, acc1);
+	acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+	acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+	y = _mm_cvtss_f32(acc0);
+	for (; i < len; i++) {
+		coeffs[i] += factor * hist[i + 1];
+		y += coeffs[i] * hist[i];
+	}
+	return y;
+}
+
+__attribute__((target("avx2,fma")))
+static float fir_float_dot_avx2(const float * coeffs, const float * hist,
+				int len)
+{
+	__m256 acc[4];
+	__m128 sum;
+	float y;
+	int i;
+	int k;
+
+	for (k = 0; k < 4; k++)
+		acc[k] = _mm256_setzero_ps();
+	for (i = 0; i + 32 <= len; i += 32) {
+		for (k = 0; k < 4; k++)
+			acc[k] = _mm256_fmadd_ps(_mm256_loadu_ps(&coeffs[i + 8 * k]),
+						 _mm256_loadu_ps(&hist[i + 8 * k]),
+						 acc[k]);
+	}
+	acc[0] = _mm256_add_ps(_mm256_add_ps(acc[0], acc[1]),
+			       _mm256_add_ps(acc[2], acc[3]));
+	sum = _mm_add_ps(_mm256_castps256_ps128(acc[0]),
+			 _mm256_extractf128_ps(acc[0], 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	y = _mm_cvtss_f32(sum);
+	for (; i < len; i++)
+		y += coeffs[i] * hist[i];
+	return y;
+}
+
+__attribute__((target("avx2,fma")))
+static float fir_float_dot_lms_avx2(float * coeffs, const float * hist,
+				    float factor, int len)
+{
+	__m256 acc[4];
+	__m256 f;
+	__m256 c;
+	__m128 sum;
+	float y;
+	int i;
+	int k;
+
+	f = _mm256_set1_ps(factor);
+	for (k = 0; k < 4; k++)
+		acc[k] = _mm256_setzero_ps();
+	for (i = 0; i + 32 <= len; i += 32) {
+		for (k = 0; k < 4; k++) {
+			c = _mm256_fmadd_ps(f, _mm256_loadu_ps(&hist[i + 8 * k + 1]),
+					    _mm256_loadu_ps(&coeffs[i + 8 * k]));
+			_mm256_storeu_ps(&coeffs[i + 8 * k], c);
+			acc[k] = _mm256_fmadd_ps(c, _mm256_loadu_ps(&hist[i + 8 * k]),
+						 acc[k]);
+		}
+	}
+	acc[0] = _mm256_add_ps(_mm256_add_ps(acc[0], acc[1]),
+			       _mm256_add_ps(acc[2], acc[3]));
+	sum = _mm_add_ps(_mm256_castps256_ps128(acc[0]),
+			 _mm256_extractf128_ps(acc[0], 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	y = _mm_cvtss_f32(sum);
+	for (; i < len; i++) {
+		coeffs[i] += factor * hist[i + 1];
+		y += coeffs[i] * hist[i];
+	}
+	return y;
+}
+
+__attribute__((target("avx512f")))
+static float fir_float_dot_avx512(const float * coeffs, const float * hist,
+				  int len)
+{
+	__m512 acc[4];
+	float y;
+	int i;
+	int k;
+
+	for (k = 0; k < 4; k++)
+		acc[k] = _mm512_setzero_ps();
+	for (i = 0; i + 64 <= len; i += 64) {
+		for (k = 0; k < 4; k++)
+			acc[k] = _mm512_fmadd_ps(_mm512_loadu_ps(&coeffs[i + 16 * k]),
+						 _mm512_loadu_ps(&hist[i + 16 * k]),
+						 acc[k]);
+	}
+	y = _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc[0], acc[1]),
+					       _mm512_add_ps(acc[2], acc[3])));
+	for (; i < len; i++)
+		y += coeffs[i] * hist[i];
+	return y;
+}
+
+__attribute__((target("avx512f")))
+static float fir_float_dot_lms_avx512(float * coeffs, const float * hist,
+				      float factor, int len)
+{
+	__m512 acc[4];
+	__m512 f;
+	__m512 c;
+	float y;
+	int i;
+	int k;
+
+	f = _mm512_set1_ps(factor);
+	for (k = 0; k < 4; k++)
+		acc[k] = _mm512_setzero_ps();
+	for (i = 0; i + 64 <= len; i += 64) {
+		for (k = 0; k < 4; k++) {
+			c = _mm512_fmadd_ps(f, _mm512_loadu_ps(&hist[i + 16 * k + 1]),
+					    _mm512_loadu_ps(&coeffs[i + 16 * k]));
+			_mm512_storeu_ps(&coeffs[i + 16 * k], c);
+			acc[k] = _mm512_fmadd_ps(c, _mm512_loadu_ps(&hist[i + 16 * k]),
+						 acc[k]);
+		}
+	}
+	y = _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc[0], acc[1]),
+					       _mm512_add_ps(acc[2], acc[3])));
+	for (; i < len; i++) {
+		coeffs[i] += factor * hist[i + 1];
+		y += coeffs[i] * hist[i];
+	}
+	return y;
+}
+
+#elif defined(__ARM_NEON)
+
+/* ARM versions ------------------------------------------------------------*/
+
+/* NEON is always there on the ARM targets we build for, so there is no
+   run time selection.  It has a 32 bit low multiply and a truncating
+   narrow, so the LMS update maps straight onto the C arithmetic.  Single
+   products always fit 32 bits, and vpadal adds pairs of them straight into
+   64 bit accumulators, so the dot products need no splitting. */
+
+static int64_t fir16_dot_neon(const int16_t * coeffs, const int16_t * hist,
+			      int len)
+{
+	int64x2_t acc0;
+	int64x2_t acc1;
+	int16x8_t c;
+	int16x8_t h;
+	int64_t y;
+	int i;
+
+	acc0 = vdupq_n_s64(0);
+	acc1 = vdupq_n_s64(0);
+	for (i = 0; i + 8 <= len; i += 8) {
+		c = vld1q_s16(&coeffs[i]);
+		h = vld1q_s16(&hist[i]);
+		acc0 = vpadalq_s32(acc0, vmull_s16(vget_low_s16(c), vget_low_s16(h)));
+		acc1 = vpadalq_s32(acc1, vmull_s16(vget_high_s16(c), vget_high_s16(h)));
+	}
+	acc0 = vaddq_s64(acc0, acc1);
+	y = vgetq_lane_s64(acc0, 0) + vgetq_lane_s64(acc0, 1);
+	for (; i < len; i++)
+		y += coeffs[i] * hist[i];
+	return y;
+}
+
+static void fir16_lms_neon(int16_t * coeffs, const int16_t * src,
+			   const int16_t * hist, int32_t factor, int len)
+{
+	int32x4_t round;
+	int32x4_t lo;
+	int32x4_t hi;
+	int16x8_t h;
+	int i;
+
+	round = vdupq_n_s32(1 << 14);
+	for (i = 0; i + 8 <= len; i += 8) {
+		h = vld1q_s16(&hist[i]);
+		lo = vmulq_n_s32(vmovl_s16(vget_low_s16(h)), factor);
+		hi = vmulq_n_s32(vmovl_s16(vget_high_s16(h)), factor);
+		lo = vshrq_n_s32(vaddq_s32(lo, round), 15);
+		hi = vshrq_n_s32(vaddq_s32(hi, round), 15);
+		vst1q_s16(&coeffs[i], vaddq_s16(vld1q_s16(&src[i]),
+						vcombine_s16(vmovn_s32(lo),
+							     vmovn_s32(hi))));
+	}
+	for (; i < len; i++)
+		coeffs[i] = src[i] + lms_step(hist[i], factor);
+}
+
+static int64_t fir16_dot_lms_neon(int16_t * coeffs, const int16_t * src,
+				  const int16_t * hist, int32_t factor, int len)
+{
+	int32x4_t round;
+	int64x2_t acc;
+	int32x4_t lo;
+	int32x4_t hi;
+	int16x8_t h;
+	int16x8_t c;
+	int64_t y;
+	int i;
+
+	round = vdupq_n_s32(1 << 14);
+	acc = vdupq_n_s64(0);
+	for (i = 0; i + 8 <= len; i += 8) {
+		h = vld1q_s16(&hist[i + 1]);
+		lo = vmulq_n_s32(vmovl_s16(vget_low_s16(h)), factor);
+		hi = vmulq_n_s32(vmovl_s16(vget_high_s16(h)), factor);
+		lo = vshrq_n_s32(vaddq_s32(lo, round), 15);
+		hi = vshrq_n_s32(vaddq_s32(hi, round), 15);
+		c = vaddq_s16(vld1q_s16(&src[i]),
+			      vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)));
+		vst1q_s16(&coeffs[i], c);
+		h = vld1q_s16(&hist[i]);
+		acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(c), vget_low_s16(h)));
+		acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(c), vget_high_s16(h)));
+	}
+	y = vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1);
+	for (; i < len; i++) {
+		coeffs[i] = src[i] + lms_step(hist[i + 1], factor);
+		y += coeffs[i] * hist[i];
+	}
+	return y;
+}
+
+/* The lanes have to stay apart, so here the sums are kept in two parts as
+   in the x86 kernels.  vsra does the shift and the add in one. */
+
+#define LANE_MAC(hi, lo, c, h) \
+	do { \
+		int32x4_t p_ = vmull_s16(c, h); \
+		hi = vsraq_n_s32(hi, p_, 16); \
+		lo = vaddq_s32(lo, p_); \
+	} while (0)
+
+static void fir16_lanes_neon(const int16_t * fg, int16_t * bg,
+			     const int16_t * hist, const int32_t * factor,
+			     int64_t * y_fg, int64_t * y_bg, int len)
+{
+	int32_t hi_s[FIR16_LANES], lo_s[FIR16_LANES];
+	int32x4_t f[4];
+	int32x4_t fg_hi[4], fg_lo[4];
+	int32x4_t bg_hi[4], bg_lo[4];
+	int32x4_t round;
+	int32x4_t lo;
+	int32x4_t hi;
+	int16x8_t h;
+	int16x8_t c;
+	int i;
+	int k;
+
+	round = vdupq_n_s32(1 << 14);
+	for (k = 0; k < 4; k++) {
+		f[k] = vld1q_s32(&factor[4 * k]);
+		fg_hi[k] = fg_lo[k] = vdupq_n_s32(0);
+		bg_hi[k] = bg_lo[k] = vdupq_n_s32(0);
+	}
+
+	for (i = 0; i < len; i++) {
+		for (k = 0; k < 2; k++) {
+			h = vld1q_s16(&hist[FIR16_LANES + 8 * k]);
+			lo = vmulq_s32(vmovl_s16(vget_low_s16(h)), f[2 * k]);
+			hi = vmulq_s32(vmovl_s16(vget_high_s16(h)), f[2 * k + 1]);
+			lo = vshrq_n_s32(vaddq_s32(lo, round), 15);
+			hi = vshrq_n_s32(vaddq_s32(hi, round), 15);
+			c = vaddq_s16(vld1q_s16(&bg[8 * k]),
+				      vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)));
+			vst1q_s16(&bg[8 * k], c);
+			h = vld1q_s16(&hist[8 * k]);
+			LANE_MAC(bg_hi[2 * k], bg_lo[2 * k], vget_low_s16(c), vget_low_s16(h));
+			LANE_MAC(bg_hi[2 * k + 1], bg_lo[2 * k + 1], vget_high_s16(c), vget_high_s16(h));
+			c = vld1q_s16(&fg[8 * k]);
+			LANE_MAC(fg_hi[2 * k], fg_lo[2 * k], vget_low_s16(c), vget_low_s16(h));
+			LANE_MAC(fg_hi[2 * k + 1], fg_lo[2 * k + 1], vget_high_s16(c), vget_high_s16(h));
+		}
+		fg += FIR16_LANES;
+		bg += FIR16_LANES;
+		hist += FIR16_LANES;
+	}
+
+	for (k = 0; k < 4; k++) {
+		vst1q_s32(&hi_s[4 * k], fg_hi[k]);
+		vst1q_s32(&lo_s[4 * k], fg_lo[k]);
+	}
+	lanes_join(hi_s, lo_s, y_fg);
+	for (k = 0; k < 4; k++) {
+		vst1q_s32(&hi_s[4 * k], bg_hi[k]);
+		vst1q_s32(&lo_s[4 * k], bg_lo[k]);
+	}
+	lanes_join(hi_s, lo_s, y_bg);
+}
+
+/* vfmaq_f32 needs VFPv4, which AArch64 always has; older cores get the
+   separate multiply and add. */
+#if defined(__ARM_FEATURE_FMA)
+#define FLOAT_MLA(acc, a, b)	vfmaq_f32(acc, a, b)
+#else
+#define FLOAT_MLA(acc, a, b)	vmlaq_f32(acc, a, b)
+#endif
+
+static float fir_float_dot_neon(const float * coeffs, const float * hist,
+				int len)
+{
+	float32x4_t acc[4];
+	float32x4_t sum;
+	float y;
+	int i;
+	int k;
+
+	for (k = 0; k < 4; k++)
+		acc[k] = vdupq_n_f32(0.0f);
+	for (i = 0; i + 16 <= len; i += 16) {
+		for (k = 0; k < 4; k++)
+			acc[k] = FLOAT_MLA(acc[k], vld1q_f32(&coeffs[i + 4 * k]),
+					   vld1q_f32(&hist[i + 4 * k]));
+	}
+	sum = vaddq_f32(vaddq_f32(acc[0], acc[1]), vaddq_f32(acc[2], acc[3]));
+	y = vgetq_lane_f32(sum, 0) + vgetq_lane_f32(sum, 1) +
+	    vgetq_lane_f32(sum, 2) + vgetq_lane_f32(sum, 3);
+	for (; i < len; i++)
+		y += coeffs[i] * hist[i];
+	return y;
+}
+
+static float fir_float_dot_lms_neon(float * coeffs, const float * hist,
+				    float factor, int len)
+{
+	float32x4_t acc[4];
+	float32x4_t f;
+	float32x4_t c;
+	float32x4_t sum;
+	float y;
+	int i;
+	int k;
+
+	f = vdupq_n_f32(factor);
+	for (k = 0; k < 4; k++)
+		acc[k] = vdupq_n_f32(0.0f);
+	for (i = 0; i + 16 <= len; i += 16) {
+		for (k = 0; k < 4; k++) {
+			c = FLOAT_MLA(vld1q_f32(&coeffs[i + 4 * k]), f,
+				      vld1q_f32(&hist[i + 4 * k + 1]));
+			vst1q_f32(&coeffs[i + 4 * k], c);
+			acc[k] = FLOAT_MLA(acc[k], c, vld1q_f32(&hist[i + 4 * k]));
+		}
+	}
+	sum = vaddq_f32(vaddq_f32(acc[0], acc[1]), vaddq_f32(acc[2], acc[3]));
+	y = vgetq_lane_f32(sum, 0) + vgetq_lane_f32(sum, 1) +
+	    vgetq_lane_f32(sum, 2) + vgetq_lane_f32(sum, 3);
+	for (; i < len; i++) {
+		coeffs[i] += factor * hist[i + 1];
+		y += coeffs[i] * hist[i];
+	}
+	return y;
+}
+#endif
+
+/* Fixed length kernels ----------------------------------------------------*/
+
+/* The general kernels inlined with a constant length, so the compiler
+   knows every trip count, drops the remainder loops and unrolls as it sees
+   fit.  flatten makes sure the general kernel really is inlined. */
+
+#define FIR16_FIXED(isa, target, n) \
+	target __attribute__((flatten)) \
+	static int64_t fir16_dot_##isa##_##n(const int16_t * coeffs, \
+					     const int16_t * hist, int len) \
+	{ \
+		(void) len; \
+		return fir16_dot_##isa(coeffs, hist, n); \
+	} \
+	target __attribute__((flatten)) \
+	static void fir16_lms_##isa##_##n(int16_t * coeffs, \
+					  const int16_t * src, \
+					  const int16_t * hist, \
+					  int32_t factor, int len) \
+	{ \
+		(void) len; \
+		fir16_lms_##isa(coeffs, src, hist, factor, n); \
+	} \
+	target __attribute__((flatten)) \
+	static int64_t fir16_dot_lms_##isa##_##n(int16_t * coeffs, \
+						 const int16_t * src, \
+						 const int16_t * hist, \
+						 int32_t factor, int len) \
+	{ \
+		(void) len; \
+		return fir16_dot_lms_##isa(coeffs, src, hist, factor, n); \
+	}
+
+#define FIR16_FIXED_ENTRY(isa, n) \
+	{ fir16_dot_##isa##_##n, fir16_lms_##isa##_##n, fir16_dot_lms_##isa##_##n }
+
+/* One set per instruction set, in the order of fir16_fixed_len[] */
+#define FIR16_FIXED_SET(isa, target) \
+	FIR16_FIXED(isa, target, 128) \
+	FIR16_FIXED(isa, target, 256) \
+	FIR16_FIXED(isa, target, 512) \
+	FIR16_FIXED(isa, target, 1024) \
+	FIR16_FIXED(isa, target, 2048) \
+	FIR16_FIXED(isa, target, 4096) \
+	static const fir16_kernels_t fir16_fixed_##isa[] = { \
+		FIR16_FIXED_ENTRY(isa, 128), \
+		FIR16_FIXED_ENTRY(isa, 256), \
+		FIR16_FIXED_ENTRY(isa, 512), \
+		FIR16_FIXED_ENTRY(isa, 1024), \
+		FIR16_FIXED_ENTRY(isa, 2048), \
+		FIR16_FIXED_ENTRY(isa, 4096) \
+	};
+
+static const int fir16_fixed_len[] = { 128, 256, 512, 1024, 2048, 4096 };
+
+#define FIR16_FIXED_LENGTHS \
+	((int) (sizeof(fir16_fixed_len) / sizeof(fir16_fixed_len[0])))
+
+FIR16_FIXED_SET(c, )
+
+#if defined(__i386__)  ||  defined(__x86_64__)
+FIR16_FIXED_SET(sse2, __attribute__((target("sse2"))))
+FIR16_FIXED_SET(avx2, __attribute__((target("avx2"))))
+FIR16_FIXED_SET(avx512, __attribute__((target("avx512bw"))))
+#elif defined(__ARM_NEON)
+FIR16_FIXED_SET(neon, )
+#endif
+
+/* Dispatch ----------------------------------------------------------------*/
+
+fir16_dot_func_t fir16_dot = fir16_dot_c;
+fir16_lms_func_t fir16_lms = fir16_lms_c;
+fir16_dot_lms_func_t fir16_dot_lms = fir16_dot_lms_c;
+fir16_lanes_func_t fir16_lanes = fir16_lanes_c;
+fir_float_dot_func_t fir_float_dot = fir_float_dot_c;
+fir_float_dot_lms_func_t fir_float_dot_lms = fir_float_dot_lms_c;
+
+static fir16_kernels_t fir16_general = {
+	fir16_dot_c, fir16_lms_c, fir16_dot_lms_c
+};
+static const fir16_kernels_t *fir16_fixed = fir16_fixed_c;
+
+static const char *simd_name = "c";
+
+void fir_simd_init(void)
+{
+#if defined(__i386__)  ||  defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw")) {
+		fir16_dot = fir16_dot_avx512;
+		fir16_lms = fir16_lms_avx512;
+		fir16_dot_lms = fir16_dot_lms_avx512;
+		fir16_lanes = fir16_lanes_avx512;
+		fir16_fixed = fir16_fixed_avx512;
+		fir_float_dot = fir_float_dot_avx512;
+		fir_float_dot_lms = fir_float_dot_lms_avx512;
+		simd_name = "avx512";
+	} else if (__builtin_cpu_supports("avx2")) {
+		fir16_dot = fir16_dot_avx2;
+		fir16_lms = fir16_lms_avx2;
+		fir16_dot_lms = fir16_dot_lms_avx2;
+		fir16_lanes = fir16_lanes_avx2;
+		fir16_fixed = fir16_fixed_avx2;
+		if (__builtin_cpu_supports("fma")) {
+			fir_float_dot = fir_float_dot_avx2;
+			fir_float_dot_lms = fir_float_dot_lms_avx2;
+		} else {
+			fir_float_dot = fir_float_dot_sse2;
+			fir_float_dot_lms = fir_float_dot_lms_sse2;
+		}
+		simd_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		fir16_dot = fir16_dot_sse2;
+		fir16_lms = fir16_lms_sse2;
+		fir16_dot_lms = fir16_dot_lms_sse2;
+		fir16_lanes = fir16_lanes_sse2;
+		fir16_fixed = fir16_fixed_sse2;
+		fir_float_dot = fir_float_dot_sse2;
+		fir_float_dot_lms = fir_float_dot_lms_sse2;
+		simd_name = "sse2";
+	}
+#elif defined(__ARM_NEON)
+	fir16_dot = fir16_dot_neon;
+	fir16_lms = fir16_lms_neon;
+	fir16_dot_lms = fir16_dot_lms_neon;
+	fir16_lanes = fir16_lanes_neon;
+	fir16_fixed = fir16_fixed_neon;
+	fir_float_dot = fir_float_dot_neon;
+	fir_float_dot_lms = fir_float_dot_lms_neon;
+	simd_name = "neon";
+#endif
+	fir16_general.dot = fir16_dot;
+	fir16_general.lms = fir16_lms;
+	fir16_general.dot_lms = fir16_dot_lms;
+}
+
+const fir16_kernels_t *fir16_kernels(int len)
+{
+	int i;
+
+	for (i = 0; i < FIR16_FIXED_LENGTHS; i++) {
+		if (fir16_fixed_len[i] == len)
+			return &fir16_fixed[i];
+	}
+	return &fir16_general;
+}
+
+const char *fir_simd_name(void)
+{
+	return simd_name;
+}
+
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,152 @@
+/*
+ * fir_simd.h - SIMD kernels for the FIR hot loops
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*! \page fir_simd_page SIMD FIR kernels
+\section fir_simd_page_sec_1 What does it do?
+Provides vectorised versions of the inner loops used by the FIR filters and
+the echo canceller - the dot product and the LMS coefficient update - and
+picks the best one for the CPU we are running on.
+
+\section fir_simd_page_sec_2 How does it work?
+Each kernel is built several times, once per instruction set, using GCC
+target attributes, so a single binary carries all of them.  fir_simd_init()
+asks CPUID what the host supports and points the kernel pointers at the
+widest implementation available.  On ARM the NEON versions are always
+used.  Until it is called the pointers refer to portable C versions, so the
+kernels are always safe to call.
+
+All kernels work on a contiguous run of history samples, so the caller must
+keep the history unrolled (mirrored), as the Blackfin code does.
+*/
+
+#if !defined(_FIR_SIMD_H_)
+#define _FIR_SIMD_H_
+
+#include <stdint.h>
+
+/*! The longest filter the 16 bit kernels will sum exactly. A sum of
+    products of full scale 16 bit values needs more than 32 bits after two
+    terms, so the kernels sum into 64 bits, using 32 bit partial sums which
+    are safe up to this many terms, -32768 included. */
+#define FIR16_MAX_LEN	32768
+
+/*! \brief Dot product of 16 bit coefficients and 16 bit samples.
+    \param coeffs The coefficients.
+    \param hist The samples, newest first.
+    \param len The number of terms, at most FIR16_MAX_LEN.
+    \return The exact sum of products. */
+typedef int64_t (*fir16_dot_func_t)(const int16_t * coeffs,
+				    const int16_t * hist, int len);
+
+/*! \brief LMS update of 16 bit coefficients. Each coefficient is set to
+           src[i] + ((hist[i]*factor + (1 << 14)) >> 15).
+    \param coeffs The updated coefficients.
+    \param src The coefficients to update. This may be coeffs, for an
+           update in place, or another buffer, which is left unchanged.
+    \param hist The samples, newest first.
+    \param factor The adaption factor, in Q30.
+    \param len The number of coefficients. */
+typedef void (*fir16_lms_func_t)(int16_t * coeffs, const int16_t * src,
+				 const int16_t * hist, int32_t factor,
+				 int len);
+
+/*! \brief LMS update fused with the dot product that follows it. The
+           update uses hist[1] to hist[len], the history of the previous
+           sample, and the dot product then uses the updated coefficients
+           with hist[0] to hist[len - 1]. This gives the same result as
+           fir16_lms() followed by fir16_dot(), in a single pass.
+    \param coeffs The updated coefficients.
+    \param src The coefficients to update, as for fir16_lms().
+    \param hist The samples, newest first. len + 1 samples are used.
+    \param factor The adaption factor, in Q30.
+    \param len The number of coefficients, at most FIR16_MAX_LEN.
+    \return The exact sum of products. */
+typedef int64_t (*fir16_dot_lms_func_t)(int16_t * coeffs,
+					const int16_t * src,
+					const int16_t * hist, int32_t factor,
+					int len);
+
+/*! \brief Dot product of floating point coefficients and samples.
+    \param coeffs The coefficients.
+    \param hist The samples, newest first.
+    \param len The number of terms.
+    \return The sum of products. */
+typedef float (*fir_float_dot_func_t)(const float * coeffs,
+				      const float * hist, int len);
+
+/*! \brief The floating point version of fir16_dot_lms(). Each coefficient
+           has factor*hist[i + 1] added to it before it is used.
+    \param coeffs The coefficients to update.
+    \param hist The samples, newest first. len + 1 samples are used.
+    \param factor The adaption factor.
+    \param len The number of coefficients.
+    \return The sum of products. */
+typedef float (*fir_float_dot_lms_func_t)(float * coeffs, const float * hist,
+					  float factor, int len);
+
+/*! The number of filters run side by side by a lane kernel. */
+#define FIR16_LANES	16
+
+/*! \brief FIR16_LANES independent foreground/background filter pairs, run
+           side by side. Every array is interleaved by lane, so element i of
+           lane l is at [i*FIR16_LANES + l]. For each lane this does what
+           fir16_dot() on the foreground filter and fir16_dot_lms() on the
+           background filter would.
+    \param fg The foreground coefficients.
+    \param bg The background coefficients, to update.
+    \param hist The samples, newest first. len + 1 samples are used.
+    \param factor The adaption factor for each lane, in Q30.
+    \param y_fg The foreground sum of products for each lane.
+    \param y_bg The background sum of products for each lane.
+    \param len The number of coefficients in each lane, at most
+           FIR16_MAX_LEN. */
+typedef void (*fir16_lanes_func_t)(const int16_t * fg, int16_t * bg,
+				   const int16_t * hist,
+				   const int32_t * factor, int64_t * y_fg,
+				   int64_t * y_bg, int len);
+
+/*!
+    The kernels for one filter length.
+*/
+typedef struct {
+	fir16_dot_func_t dot;
+	fir16_lms_func_t lms;
+	fir16_dot_lms_func_t dot_lms;
+} fir16_kernels_t;
+
+extern fir16_dot_func_t fir16_dot;
+extern fir16_lms_func_t fir16_lms;
+extern fir16_dot_lms_func_t fir16_dot_lms;
+extern fir16_lanes_func_t fir16_lanes;
+extern fir_float_dot_func_t fir_float_dot;
+extern fir_float_dot_lms_func_t fir_float_dot_lms;
+
+/*! \brief Select the fastest kernels supported by this CPU. This may be
+           called any number of times. */
+void fir_simd_init(void);
+
+/*! \brief Find the kernels for a filter length. The common lengths - 128,
+           256, 512, 1024, 2048 and 4096 - have kernels built for exactly
+           that length, with fixed loop bounds and no remainder handling,
+           which must only be called with that length. Other lengths get the
+           general kernels. Call fir_simd_init() first.
+    \param len The filter length.
+    \return The kernels. */
+const fir16_kernels_t *fir16_kernels(int len);
+
+/*! \brief Find which instruction set the kernels are using.
+    \return A short name, such as "avx2". */
+const char *fir_simd_name(void);
+
+#endif
+/*- End of file ------------------------------------------------------------*/
@@ -7,38 +7,73 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <signal.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "conf.h"
 #include "audio.h"
 #include "oslec.h"
-#include "fir_new.h"
+#include "fdaf.h"
+#include "oslec_float.h"
+#include "subband.h"
+#include "delay.h"
+#include "fir_simd.h"
+#include "pool.h"
+#include "reactor.h"
+#include "util.h"
 #include "bit_operations.h"
 
 #define DC_LOG2BETA			3	/* log2() of DC filter Beta */
-#define MIN_TX_POWER_FOR_ADAPTION	64
-#define MIN_RX_POWER_FOR_ADAPTION	64
+#define MIN_TX_POWER_FOR_ADAPTION	256
+#define MIN_RX_POWER_FOR_ADAPTION	128
+#define MIN_TX_LEVEL_FOR_SCAN		128
+#define BGN_LEVEL_LIMIT			80
+#define SILENT_TX_POWER			4	/* mean tx power per tap below which the filters are skipped */
 #define DTD_HANGOVER			600	/* 600 samples, or 75ms     */
 
+#define ACTIVE_BLOCK			16	/* window granularity, in taps */
+#define ACTIVE_GUARD			64	/* taps kept either side of the echo */
+#define ACTIVE_TRIM_LOG2		10	/* 30dB below the strongest block */
+#define ACTIVE_SCAN_INTERVAL		2048	/* samples between window scans */
+#define ACTIVE_FULL_SCANS		16	/* 1 scan interval in 16 is full length */
+
+#define PARTIAL_BLOCK			64	/* smallest partial update block, in taps */
+#define PARTIAL_BLOCKS			32	/* most partial update blocks */
+#define PARTIAL_PICK_INTERVAL		16	/* samples between M-max picks */
+
+#define OSLEC_ALIGN			64	/* a cache line */
+#define HUGE_PAGE_SIZE			(2 * 1024 * 1024)
+
+/* Where the memory of a canceller or reference came from */
+enum {
+	ARENA_CALLER,
+	ARENA_HEAP,
+	ARENA_MMAP
+};
+
+struct oslec_arena {
+	void *base;
+	size_t size;
+	int kind;
+};
+
 /*!
     G.168 echo canceller descriptor. This defines the working state for a line
     echo canceller.
 */
 struct oslec_state {
 	int16_t tx, rx;
-	int16_t clean;
-	int16_t clean_nlp;
+	int clean;
+	int clean_nlp;
 
 	int nonupdate_dwell;
-	int curr_pos;
 	int taps;
-	int log2taps;
 	int adaption_mode;
 
 	int cond_met;
-	int32_t Pstates;
 	int16_t adapt;
 	int32_t factor;
 	int16_t shift;
@@ -50,10 +85,17 @@ struct oslec_state {
 	int Lclean_bg;
 	int Lbgn, Lbgn_acc, Lbgn_upper, Lbgn_upper_acc;
 
-	/* foreground and background filter states */
-	fir16_state_t fir_state;
-	fir16_state_t fir_state_bg;
+	/* foreground and background filter taps, and the tx side state they
+	   filter, which may be shared with other cancellers.  After a
+	   transfer the foreground and background are the same buffer, and
+	   the other one is kept in fir_spare, see bg_taps(). */
 	int16_t *fir_taps16[2];
+	int16_t *fir_spare;
+	struct oslec_ref *ref;
+
+	/* kernels for the window length, see fir16_kernels() */
+	const fir16_kernels_t *kern;
+	int own_ref;
 
 	/* DC blocking filter states */
 	int tx_1, tx_2, rx_1, rx_2;
@@ -67,39 +109,378 @@ struct oslec_state {
 	int cng_rndnum;
 	int cng_filter;
 
-	/* snapshot sample of coeffs used for development */
+	/* snapshot sample of coeffs used for development, allocated by the
+	   first oslec_snapshot() */
 	int16_t *snapshot;
+
+	/* the block holding this descriptor, the taps and, for a canceller
+	   from oslec_create(), its reference too */
+	struct oslec_arena arena;
+
+	/* active window of taps, see oslec_scan_window() */
+	int win_start;
+	int win_len;
+	int log2win;
+	int64_t Pwin;
+	int scan_count;
+	int scans;
+
+	/* samples processed, and how many of them had a silent far end */
+	uint64_t samples;
+	uint64_t silent_samples;
+
+	/* partial update, see partial_select().  The window is split into
+	   pu_blocks blocks of pu_block taps, and 1 in 2^pu_log2 of them are
+	   adapted each sample, or all of them if pu_log2 is 0. */
+	int pu_log2;
+	int pu_block;
+	int pu_blocks;
+	int pu_next;
+	int pu_count;
+	/* the history energy in each block, for M-max */
+	int64_t pu_energy[PARTIAL_BLOCKS];
+	uint8_t pu_order[PARTIAL_BLOCKS];
+	/* the blocks the pending update in factor applies to */
+	uint8_t pu_sel[PARTIAL_BLOCKS];
+};
+
+/*!
+    Transmit side state.  Everything here depends only on the tx signal, so
+    it is worked out once per block and shared by all the cancellers for
+    the same far end, for example one per microphone.
+*/
+struct oslec_ref {
+	int taps;
+	int log2taps;
+	int max_block;
+	int adaption_mode;
+
+	/* Filter history, newest sample at the lowest index, so the taps - 1
+	   samples before a sample are always the contiguous run after it.
+	   There are taps + max_block free samples below the taps kept, so the
+	   history only needs sliding back up once in that many samples. */
+	int16_t *history;
+	int size;
+	int pos;
+
+	/* Pstates after each sample of the last block */
+	int32_t *Pstates;
+	int32_t Pstates_now;
+
+	/* DC blocking filter states */
+	int tx_1, tx_2;
+
+	/* the block holding this descriptor, the history and Pstates */
+	struct oslec_arena arena;
 };
 
-static inline void lms_adapt_bg(struct oslec_state *ec, int clean,				    int shift)
+static inline int32_t lms_factor(int clean, int shift)
 {
-	int i;
+	/* a multiply, as clean is often negative */
+	if (shift >= 0)
+		return clean * (1 << shift);
+	return (clean + (1 << (-shift - 1))) >> -shift;
+}
 
-	int offset1;
-	int offset2;
-	int factor;
-	int exp;
+/* Partial update ----------------------------------------------------------*/
+
+/* Updating every tap every sample is most of the cost of a long canceller.
+   With a partial update only some blocks of taps are adapted each sample,
+   so the update costs 1/2^pu_log2 of what it did.  There are at most
+   PARTIAL_BLOCKS blocks, as each run of them is a kernel call, and each
+   is a multiple of PARTIAL_BLOCK taps, so the kernels run at full width.
+
+   Sequential update steps through the blocks in turn, so each tap is
+   adapted once in 2^pu_log2 samples, and convergence is about that much
+   slower.  M-max update adapts the blocks whose tx history has the most
+   energy, as they are the ones with the most to gain, and so converges
+   faster for the same cost.  The energy of a block only moves a little
+   from one sample to the next, so the blocks are picked again once every
+   PARTIAL_PICK_INTERVAL samples rather than every sample. */
+
+/* Partly sort order[] so that it starts with the k blocks of most
+   energy, as nth_element() would */
+static void partial_nth(const int64_t *energy, uint8_t *order, int n, int k)
+{
+	int64_t pivot;
+	uint8_t t;
+	int lo, hi;
+	int i, j;
+
+	lo = 0;
+	hi = n - 1;
+	while (lo < hi) {
+		pivot = energy[order[(lo + hi) >> 1]];
+		i = lo;
+		j = hi;
+		while (i <= j) {
+			while (energy[order[i]] > pivot)
+				i++;
+			while (energy[order[j]] < pivot)
+				j--;
+			if (i <= j) {
+				t = order[i];
+				order[i++] = order[j];
+				order[j--] = t;
+			}
+		}
+		if (k - 1 <= j)
+			hi = j;
+		else if (k - 1 >= i)
+			lo = i;
+		else
+			break;
+	}
+}
 
-	if (shift > 0)
-		factor = clean << shift;
-	else
-		factor = clean >> -shift;
+/* Pick the blocks the update worked out for this sample will be applied
+   to.  hist is the sample's history. */
+static void partial_select(struct oslec_state *ec, const int16_t *hist)
+{
+	int n = ec->pu_blocks;
+	int k = (n + (1 << ec->pu_log2) - 1) >> ec->pu_log2;
+	int len;
+	int j;
+
+	if (ec->adaption_mode & ECHO_CAN_USE_PARTIAL_MMAX) {
+		if (--ec->pu_count > 0)
+			return;
+		ec->pu_count = PARTIAL_PICK_INTERVAL;
+
+		hist += ec->win_start;
+		for (j = 0; j < n; j++) {
+			len = ec->win_len - j * ec->pu_block;
+			if (len > ec->pu_block)
+				len = ec->pu_block;
+			ec->pu_energy[j] = fir16_dot(&hist[j * ec->pu_block],
+						     &hist[j * ec->pu_block],
+						     len);
+		}
+		partial_nth(ec->pu_energy, ec->pu_order, n, k);
+
+		memset(ec->pu_sel, 0, n);
+		for (j = 0; j < k; j++)
+			ec->pu_sel[ec->pu_order[j]] = 1;
+	} else {
+		memset(ec->pu_sel, 0, n);
+		for (j = 0; j < k; j++) {
+			ec->pu_sel[ec->pu_next] = 1;
+			if (++ec->pu_next >= n)
+				ec->pu_next = 0;
+		}
+	}
+}
+
+/* A transfer makes the foreground use the background's taps, instead of
+   copying them, which used to cost a pass over the whole filter each time
+   and could happen on every sample while converging.  The two only part
+   again when the background next adapts: the update reads the shared taps
+   and writes into the spare buffer, which becomes the background, so it
+   costs no more than an update in place.  This gives the buffer the
+   updated taps go to, and copies over the taps outside the window, which
+   the update does not touch. */
+static inline int16_t *bg_taps(struct oslec_state *ec)
+{
+	int16_t *src = ec->fir_taps16[1];
+	int16_t *dst = ec->fir_spare;
+	int end;
+
+	if (ec->fir_taps16[0] != src)
+		return src;
+
+	end = ec->win_start + ec->win_len;
+	memcpy(dst, src, ec->win_start * sizeof(int16_t));
+	memcpy(dst + end, src + end, (ec->taps - end) * sizeof(int16_t));
+	ec->fir_taps16[1] = dst;
+	return dst;
+}
+
+static inline void lms_adapt_bg(struct oslec_state *ec,
+				const int16_t *hist, int32_t factor)
+{
+	const int16_t *src = ec->fir_taps16[1] + ec->win_start;
+	int16_t *coeffs = bg_taps(ec) + ec->win_start;
+	int start, end;
+	int i, j;
+
+	hist += ec->win_start;
 
 	/* Update the FIR taps */
 
-	offset2 = ec->curr_pos;
-	offset1 = ec->taps - offset2;
+	if (!ec->pu_log2) {
+		ec->kern->lms(coeffs, src, hist, factor, ec->win_len);
+		return;
+	}
 
-	for (i = ec->taps - 1; i >= offset1; i--) {
-		exp = (ec->fir_state_bg.history[i - offset1] * factor);
-		ec->fir_taps16[1][i] += (int16_t) ((exp + (1 << 14)) >> 15);
+	/* only the picked blocks, a run of them at a time.  The others are
+	   copied if the taps have just been parted. */
+	for (i = 0; i < ec->pu_blocks; i = j) {
+		for (j = i + 1; j < ec->pu_blocks &&
+		     ec->pu_sel[j] == ec->pu_sel[i]; j++)
+			;
+		start = i * ec->pu_block;
+		end = j * ec->pu_block;
+		if (end > ec->win_len)
+			end = ec->win_len;
+		if (ec->pu_sel[i])
+			fir16_lms(coeffs + start, src + start, hist + start,
+				  factor, end - start);
+		else if (coeffs != src)
+			memcpy(coeffs + start, src + start,
+			       (end - start) * sizeof(int16_t));
 	}
-	for (; i >= 0; i--) {
-		exp = (ec->fir_state_bg.history[i + offset2] * factor);
-		ec->fir_taps16[1][i] += (int16_t) ((exp + (1 << 14)) >> 15);
+}
+
+/* Background filter with the LMS update fused into it.  The update worked
+   out for the previous sample is left pending in ec->factor, and applied
+   during the same sweep that computes this sample's output, so the taps
+   and history only stream through the cache once.  The result is exactly
+   the same as adapting straight away.
+
+   The pending update needs the previous sample's history, which is just
+   hist + 1, as the sample leaving the filter is still in the history
+   buffer.  A partial update touches scattered runs of taps, so it is
+   applied on its own first. */
+static inline int32_t fir16_bg(struct oslec_state *ec, const int16_t *hist)
+{
+	const int16_t *src;
+	int64_t y;
+
+	if (ec->factor && ec->pu_log2) {
+		lms_adapt_bg(ec, hist + 1, ec->factor);
+		ec->factor = 0;
 	}
+
+	src = ec->fir_taps16[1] + ec->win_start;
+	hist += ec->win_start;
+	if (ec->factor)
+		y = ec->kern->dot_lms(bg_taps(ec) + ec->win_start, src, hist,
+				      ec->factor, ec->win_len);
+	else
+		y = ec->kern->dot(src, hist, ec->win_len);
+	ec->factor = 0;
+
+	return (int32_t) (y >> 15);
+}
+
+/* The history of the last sample the reference has seen */
+static inline const int16_t *oslec_ref_last(const struct oslec_ref *ref)
+{
+	return &ref->history[ref->pos];
+}
+
+static void oslec_set_window(struct oslec_state *ec, const int16_t *hist,
+			     int start, int len)
+{
+	int i;
+
+	ec->win_start = start;
+	ec->win_len = len;
+	ec->log2win = top_bit(len);
+	ec->kern = fir16_kernels(len);
+
+	/* The power in the window, as it was for the last sample */
+	ec->Pwin = 0;
+	for (i = start; i < start + len; i++)
+		ec->Pwin += (int32_t) hist[i] * hist[i];
+
+	/* the blocks move with the window, so a pending partial update is
+	   applied to blocks picked again */
+	ec->pu_block = (len + PARTIAL_BLOCKS - 1) / PARTIAL_BLOCKS;
+	ec->pu_block = (ec->pu_block + PARTIAL_BLOCK - 1) & ~(PARTIAL_BLOCK - 1);
+	ec->pu_blocks = (len + ec->pu_block - 1) / ec->pu_block;
+	for (i = 0; i < ec->pu_blocks; i++)
+		ec->pu_order[i] = i;
+	ec->pu_next = 0;
+	ec->pu_count = 0;
+	if (ec->pu_log2)
+		partial_select(ec, hist);
+}
+
+static int64_t tap_energy(const int16_t *taps, int len)
+{
+	int64_t e;
+	int i;
+
+	e = 0;
+	for (i = 0; i < len; i++)
+		e += (int32_t) taps[i] * taps[i];
+	return e;
 }
 
+/* Find the window of taps that holds the echo.  In a typical room the
+   energy of the converged echo path is bunched up in a fraction of the
+   taps, and the rest only model noise.  The window is trimmed in from
+   each end of the background filter, in ACTIVE_BLOCK steps, past every
+   block whose energy is more than ACTIVE_TRIM_LOG2 bits (3dB per bit)
+   below the strongest block, then widened again by a guard band so a
+   drifting echo is still caught.  Taps outside the window are neither
+   filtered nor adapted.
+
+   Echo can also appear outside the window if the path changes, so every
+   ACTIVE_FULL_SCANS scans the whole filter is run for one interval, as it
+   is until the background filter has converged. */
+static __attribute__((noinline))
+void oslec_scan_window(struct oslec_state *ec, const int16_t *hist)
+{
+	const int16_t *taps = ec->fir_taps16[1];
+	int64_t limit;
+	int64_t e;
+	int start;
+	int end;
+	int len;
+	int i;
+
+	ec->scan_count = ACTIVE_SCAN_INTERVAL;
+	if (++ec->scans >= ACTIVE_FULL_SCANS ||
+	    (ec->nonupdate_dwell == 0 && ec->Ltx > MIN_TX_LEVEL_FOR_SCAN &&
+	     8 * ec->Lclean_bg >= ec->Ltx)) {
+		ec->scans = 0;
+		oslec_set_window(ec, hist, 0, ec->taps);
+		return;
+	}
+
+	limit = 0;
+	for (i = 0; i < ec->taps; i += ACTIVE_BLOCK) {
+		len = ec->taps - i;
+		if (len > ACTIVE_BLOCK)
+			len = ACTIVE_BLOCK;
+		e = tap_energy(&taps[i], len);
+		if (e > limit)
+			limit = e;
+	}
+	limit >>= ACTIVE_TRIM_LOG2;
+	if (limit == 0) {
+		oslec_set_window(ec, hist, 0, ec->taps);
+		return;
+	}
+
+	start = 0;
+	for (;;) {
+		len = ec->taps - start;
+		if (len > ACTIVE_BLOCK)
+			len = ACTIVE_BLOCK;
+		if (tap_energy(&taps[start], len) > limit)
+			break;
+		start += len;
+	}
+
+	end = ec->taps;
+	for (;;) {
+		len = end % ACTIVE_BLOCK ? end % ACTIVE_BLOCK : ACTIVE_BLOCK;
+		if (tap_energy(&taps[end - len], len) > limit)
+			break;
+		end -= len;
+	}
+
+	start -= ACTIVE_GUARD;
+	if (start < 0)
+		start = 0;
+	end += ACTIVE_GUARD;
+	if (end > ec->taps)
+		end = ec->taps;
+	oslec_set_window(ec, hist, start, end - start);
+}
 
 const char *usage =
     "Usage:\n %s [options]\n"
@@ -107,11 +488,22 @@ const char *usage =
     " -i PCM            playback PCM (default)\n"
     " -o PCM            capture PCM (default)\n"
     " -r rate           sample rate (16000)\n"
+    " -R rate           sound card sample rate, resampled to and from the -r rate (the -r rate)\n"
     " -c channels       recording channels (2)\n"
-    " -b size           buffer size (262144)\n"
-    " -d delay          system delay between playback and capture (0)\n"
+    " -b size           ring buffer frames, at least 4 periods (4 periods)\n"
+    " -d delay          fixed system delay between playback and capture (estimated)\n"
     " -f filter_length  AEC filter length (2048)\n"
+    " -e engine         echo canceller, oslec, float, fdaf or subband (oslec)\n"
+    " -j threads        threads to share the channels between (1)\n"
+    " -a cpus           pin the threads to a comma separated list of CPUs\n"
+    " -u update         adapt 1/N of the oslec filter each sample, seq:N or mmax:N\n"
     " -s                save audio to /tmp/playback.raw, /tmp/recording.raw and /tmp/out.raw\n"
+    " --realtime[=io[,dsp]]\n"
+    "                   run the I/O and DSP threads SCHED_FIFO at these priorities (60,59),\n"
+    "                   lock memory and prefault the buffers\n"
+    " --io-cpu cpu      pin the I/O thread to a CPU\n"
+    " --latency profile ALSA period and buffer, low (10ms x 2), medium (20ms x 3)\n"
+    "                   or high (64ms x 2) (high)\n"
     " -D                daemonize\n"
     " -h                display this help text\n"
     "Note:\n"
@@ -121,8 +513,14 @@ const char *usage =
     " Only support mono playback\n";
 
 volatile int g_is_quit = 0;
-struct oslec_state *oslec;
-extern int fifo_setup(conf_t *conf);
+struct oslec_ref *oslec_ref;
+struct oslec_state **oslec;
+struct fdaf_state **fdaf;
+struct oslec_float_state **oslec_float;
+struct subband_state **subband;
+struct delay_est_state *delay_est;
+struct delay_line_state *ref_line;
+extern int fifo_setup(conf_t *conf, struct reactor *reactor);
 extern int fifo_write(void *buf, size_t frames);
 
 void int_handler(int signal)
@@ -133,74 +531,221 @@ void int_handler(int signal)
 }
 
 ////// oslec
-struct oslec_state *oslec_create(int len, int adaption_mode)
+
+/* Block size of the reference owned by a canceller from oslec_create() */
+#define OWN_REF_BLOCK		256
+
+/* Memory ------------------------------------------------------------------*/
+
+/* Each canceller and each reference lives in a single block of memory: the
+   descriptor, then the taps or history, each starting on a cache line.
+   This keeps what the filters stream through at known alignments, and
+   makes creating and freeing one allocation each. */
+
+static size_t arena_align(size_t n)
 {
-	struct oslec_state *ec;
-	int i;
+	return (n + OSLEC_ALIGN - 1) & ~(size_t) (OSLEC_ALIGN - 1);
+}
 
-	ec = calloc(1, sizeof(*ec));
-	if (!ec)
-		return NULL;
+static void *arena_take(char **p, size_t n)
+{
+	void *mem = *p;
 
-	ec->taps = len;
-	ec->log2taps = top_bit(len);
-	ec->curr_pos = ec->taps - 1;
-
-	for (i = 0; i < 2; i++) {
-		ec->fir_taps16[i] =
-		    calloc(ec->taps, sizeof(int16_t));
-		if (!ec->fir_taps16[i])
-			goto error_oom;
+	*p += arena_align(n);
+	return mem;
+}
+
+static char *arena_get(struct oslec_arena *arena, void *mem, size_t size,
+		       int flags)
+{
+	arena->size = size;
+	if (mem) {
+		if ((uintptr_t) mem & (OSLEC_ALIGN - 1))
+			return NULL;
+		arena->kind = ARENA_CALLER;
+	} else if (flags & OSLEC_ARENA_HUGEPAGES) {
+		arena->size = (size + HUGE_PAGE_SIZE - 1) &
+		    ~(size_t) (HUGE_PAGE_SIZE - 1);
+		mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		/* reserved huge pages if there are any */
+		mem = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		if (mem == MAP_FAILED) {
+			/* else transparent ones */
+			mem = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mem == MAP_FAILED)
+				return NULL;
+#ifdef MADV_HUGEPAGE
+			madvise(mem, arena->size, MADV_HUGEPAGE);
+#endif
+		}
+		arena->kind = ARENA_MMAP;
+	} else {
+		if (posix_memalign(&mem, OSLEC_ALIGN, size))
+			return NULL;
+		arena->kind = ARENA_HEAP;
 	}
 
-	fir16_create(&ec->fir_state, ec->fir_taps16[0], ec->taps);
-	fir16_create(&ec->fir_state_bg, ec->fir_taps16[1], ec->taps);
+	arena->base = mem;
+	memset(mem, 0, size);
+	return mem;
+}
 
-	for (i = 0; i < 5; i++) {
-		ec->xvtx[i] = ec->yvtx[i] = ec->xvrx[i] = ec->yvrx[i] = 0;
-	}
+static void arena_put(struct oslec_arena *arena)
+{
+	if (arena->kind == ARENA_HEAP)
+		free(arena->base);
+	else if (arena->kind == ARENA_MMAP)
+		munmap(arena->base, arena->size);
+}
+
+static size_t oslec_state_size(int len)
+{
+	return arena_align(sizeof(struct oslec_state)) +
+	    2 * arena_align(len * sizeof(int16_t));
+}
+
+static size_t oslec_ref_size(int len, int max_block)
+{
+	return arena_align(sizeof(struct oslec_ref)) +
+	    arena_align((2 * len + max_block) * sizeof(int16_t)) +
+	    arena_align(max_block * sizeof(int32_t));
+}
+
+size_t oslec_arena_size(int len)
+{
+	return oslec_state_size(len) + oslec_ref_size(len, OWN_REF_BLOCK);
+}
+
+/* Lay out a canceller descriptor and its taps */
+static struct oslec_state *oslec_carve(char **p, int len)
+{
+	struct oslec_state *ec;
+
+	ec = arena_take(p, sizeof(*ec));
+	ec->taps = len;
+	ec->fir_taps16[0] = arena_take(p, len * sizeof(int16_t));
+	ec->fir_taps16[1] = arena_take(p, len * sizeof(int16_t));
+
+	return ec;
+}
+
+/* Lay out a reference descriptor and its history */
+static struct oslec_ref *oslec_ref_carve(char **p, int len, int max_block,
+					 int adaption_mode)
+{
+	struct oslec_ref *ref;
+
+	ref = arena_take(p, sizeof(*ref));
+	ref->taps = len;
+	ref->log2taps = top_bit(len);
+	ref->max_block = max_block;
+	ref->adaption_mode = adaption_mode;
+	ref->size = 2 * len + max_block;
+	ref->history = arena_take(p, ref->size * sizeof(int16_t));
+	ref->Pstates = arena_take(p, max_block * sizeof(int32_t));
+	oslec_ref_flush(ref);
+
+	return ref;
+}
+
+/* Set up a canceller whose memory has been laid out and zeroed */
+static void oslec_init(struct oslec_state *ec, struct oslec_ref *ref,
+		       int adaption_mode)
+{
+	fir_simd_init();
+
+	ec->ref = ref;
 
 	ec->cng_level = 1000;
+	oslec_set_window(ec, oslec_ref_last(ref), 0, ec->taps);
+	ec->scan_count = ACTIVE_SCAN_INTERVAL;
 	oslec_adaption_mode(ec, adaption_mode);
 
-	ec->snapshot = calloc(ec->taps, sizeof(int16_t));
-	if (!ec->snapshot)
-		goto error_oom;
-
-	ec->cond_met = 0;
-	ec->Pstates = 0;
-	ec->Ltxacc = ec->Lrxacc = ec->Lcleanacc = ec->Lclean_bgacc = 0;
-	ec->Ltx = ec->Lrx = ec->Lclean = ec->Lclean_bg = 0;
-	ec->tx_1 = ec->tx_2 = ec->rx_1 = ec->rx_2 = 0;
-	ec->Lbgn = ec->Lbgn_acc = 0;
 	ec->Lbgn_upper = 200;
 	ec->Lbgn_upper_acc = ec->Lbgn_upper << 13;
+}
+
+/* Echo canceller ----------------------------------------------------------*/
+
+struct oslec_state *oslec_create(int len, int adaption_mode)
+{
+	return oslec_create_arena(len, adaption_mode, NULL, 0);
+}
+
+struct oslec_state *oslec_create_arena(int len, int adaption_mode,
+				       void *mem, int flags)
+{
+	struct oslec_arena arena;
+	struct oslec_state *ec;
+	struct oslec_ref *ref;
+	char *p;
+
+	p = arena_get(&arena, mem, oslec_arena_size(len), flags);
+	if (!p)
+		return NULL;
+
+	/* the reference straight after the taps, so it is all one stream */
+	ec = oslec_carve(&p, len);
+	/* tx high pass filtering is left to oslec_hpf_tx() here, as it
+	   always has been */
+	ref = oslec_ref_carve(&p, len, OWN_REF_BLOCK,
+			      adaption_mode & ~ECHO_CAN_USE_TX_HPF);
+	oslec_init(ec, ref, adaption_mode);
+	ec->own_ref = 1;
+	ec->arena = arena;
 
 	return ec;
+}
 
-      error_oom:
-	for (i = 0; i < 2; i++)
-		free(ec->fir_taps16[i]);
+struct oslec_state *oslec_create_with_ref(struct oslec_ref *ref,
+					  int adaption_mode)
+{
+	struct oslec_arena arena;
+	struct oslec_state *ec;
+	char *p;
+
+	p = arena_get(&arena, NULL, oslec_state_size(ref->taps), 0);
+	if (!p)
+		return NULL;
+
+	ec = oslec_carve(&p, ref->taps);
+	oslec_init(ec, ref, adaption_mode);
+	ec->arena = arena;
 
-	free(ec);
-	return NULL;
+	return ec;
 }
 
 void oslec_free(struct oslec_state *ec)
 {
-	int i;
+	struct oslec_arena arena = ec->arena;
 
-	fir16_free(&ec->fir_state);
-	fir16_free(&ec->fir_state_bg);
-	for (i = 0; i < 2; i++)
-		free(ec->fir_taps16[i]);
+	/* an own reference is in the same block */
 	free(ec->snapshot);
-	free(ec);
+	arena_put(&arena);
 }
 
 void oslec_adaption_mode(struct oslec_state *ec, int adaption_mode)
 {
 	ec->adaption_mode = adaption_mode;
+	ec->pu_log2 = 0;
+	if (adaption_mode &
+	    (ECHO_CAN_USE_PARTIAL_SEQ | ECHO_CAN_USE_PARTIAL_MMAX)) {
+		ec->pu_log2 = (adaption_mode & ECHO_CAN_PARTIAL_MASK) >>
+		    ECHO_CAN_PARTIAL_SHIFT;
+		if (ec->pu_log2 == 0)
+			ec->pu_log2 = 1;
+	}
+
+	/* setting the window again sets the partial update up too */
+	if (adaption_mode & ECHO_CAN_USE_ACTIVE_WINDOW)
+		oslec_set_window(ec, oslec_ref_last(ec->ref), ec->win_start,
+				 ec->win_len);
+	else
+		oslec_set_window(ec, oslec_ref_last(ec->ref), 0, ec->taps);
 }
 
 void oslec_flush(struct oslec_state *ec)
@@ -216,39 +761,70 @@ void oslec_flush(struct oslec_state *ec)
 	ec->Lbgn_upper_acc = ec->Lbgn_upper << 13;
 
 	ec->nonupdate_dwell = 0;
+	ec->factor = 0;
 
-	fir16_flush(&ec->fir_state);
-	fir16_flush(&ec->fir_state_bg);
-	ec->fir_state.curr_pos = ec->taps - 1;
-	ec->fir_state_bg.curr_pos = ec->taps - 1;
+	if (ec->fir_taps16[0] == ec->fir_taps16[1])
+		ec->fir_taps16[1] = ec->fir_spare;
 	for (i = 0; i < 2; i++)
 		memset(ec->fir_taps16[i], 0, ec->taps * sizeof(int16_t));
 
-	ec->curr_pos = ec->taps - 1;
-	ec->Pstates = 0;
+	/* a shared reference is flushed by its owner */
+	if (ec->own_ref)
+		oslec_ref_flush(ec->ref);
+
+	oslec_set_window(ec, oslec_ref_last(ec->ref), 0, ec->taps);
+	ec->scan_count = ACTIVE_SCAN_INTERVAL;
+	ec->scans = 0;
 }
 
 void oslec_snapshot(struct oslec_state *ec)
 {
+	if (!ec->snapshot) {
+		ec->snapshot = malloc(ec->taps * sizeof(int16_t));
+		if (!ec->snapshot)
+			return;
+	}
 	memcpy(ec->snapshot, ec->fir_taps16[0], ec->taps * sizeof(int16_t));
 }
 
+void oslec_get_stats(struct oslec_state *ec, struct oslec_stats *stats)
+{
+	stats->window_start = ec->win_start;
+	stats->window_len = ec->win_len;
+	stats->taps = ec->taps;
+	stats->samples = ec->samples;
+	stats->silent_samples = ec->silent_samples;
+}
+
 /* Dual Path Echo Canceller ------------------------------------------------*/
 
-int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx)
+/* The per-sample canceller body.  hist is the sample's tx history from the
+   reference, newest first, and Pstates the reference power after it.  It
+   is forced inline so that oslec_update_rx_block() can run it against a
+   stack copy of the state:
+   nothing outside the block loop can alias that copy, which lets the
+   compiler keep the level filters, DTD and transfer state in registers
+   for the whole block instead of reloading them for every sample. */
+
+static inline __attribute__((always_inline))
+int16_t oslec_process(struct oslec_state *ec, const int16_t *hist,
+		      int32_t Pstates, int16_t rx)
 {
 	int32_t echo_value;
+	int16_t tx;
 	int clean_bg;
 	int tmp, tmp1;
+	int new, old;
+	int silent;
 
-	/* Input scaling was found be required to prevent problems when tx
-	   starts clipping.  Another possible way to handle this would be the
-	   filter coefficent scaling. */
+	/* The input used to be halved here, as the 32 bit sums in the FIRs
+	   could overflow when tx started clipping.  The kernels now sum in 64
+	   bits, so the full range is kept.  echo_value and clean can go past
+	   16 bits, so they are ints, and only the output is saturated. */
 
+	tx = hist[0];
 	ec->tx = tx;
 	ec->rx = rx;
-	tx >>= 1;
-	rx >>= 1;
 
 	/*
 	   Filter DC, 3dB point is 160Hz (I think), note 32 bit precision required
@@ -266,7 +842,9 @@ int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx)
 	 */
 
 	if (ec->adaption_mode & ECHO_CAN_USE_RX_HPF) {
-		tmp = rx << 15;
+		/* Q14 rather than Q15, to leave the filter state the same
+		   headroom it had with halved input */
+		tmp = rx * (1 << 14);
 #if 1
 		/* Make sure the gain of the HPF is 1.0. This can still saturate a little under
 		   impulse conditions, and it might roll to 32768 and need clipping on sustained peak
@@ -276,34 +854,35 @@ int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx)
 #endif
 		ec->rx_1 += -(ec->rx_1 >> DC_LOG2BETA) + tmp - ec->rx_2;
 
-		/* hard limit filter to prevent clipping.  Note that at this stage
-		   rx should be limited to +/- 16383 due to right shift above */
-		tmp1 = ec->rx_1 >> 15;
-		if (tmp1 > 16383)
-			tmp1 = 16383;
-		if (tmp1 < -16383)
-			tmp1 = -16383;
+		/* hard limit filter to prevent clipping */
+		tmp1 = ec->rx_1 >> 14;
+		if (tmp1 > 32767)
+			tmp1 = 32767;
+		if (tmp1 < -32767)
+			tmp1 = -32767;
 		rx = tmp1;
 		ec->rx_2 = tmp;
 	}
 
-	/* Block average of power in the filter states.  Used for
-	   adaption power calculation. */
-
-	{
-		int new, old;
-
-		/* efficient "out with the old and in with the new" algorithm so
-		   we don't have to recalculate over the whole block of
-		   samples. */
-		new = (int)tx *(int)tx;
-		old = (int)ec->fir_state.history[ec->fir_state.curr_pos] *
-		    (int)ec->fir_state.history[ec->fir_state.curr_pos];
-		ec->Pstates +=
-		    ((new - old) + (1 << ec->log2taps)) >> ec->log2taps;
-		if (ec->Pstates < 0)
-			ec->Pstates = 0;
-	}
+	/* Pstates is averaged over the whole filter, and can be far below the
+	   power in a short active window for a long time after a quiet spell,
+	   which would make the adaption step far too big.  Keep the power in
+	   the window itself too.  It also tells us when there is nothing in
+	   the window to make an echo from. */
+
+	new = hist[ec->win_start];
+	old = hist[ec->win_start + ec->win_len];
+	ec->Pwin += new * new - old * old;
+	if (ec->Pwin < 0)
+		ec->Pwin = 0;
+
+	/* While the far end is silent over the whole window the echo
+	   estimates are next to nothing, and there is nothing to adapt to, so
+	   the filters are skipped.  The level filters, DTD, transfer logic and
+	   NLP all still run, as rx does not stop. */
+	silent = ec->Pwin <= (int64_t) ec->win_len * SILENT_TX_POWER;
+	ec->samples++;
+	ec->silent_samples += silent;
 
 	/* Calculate short term average levels using simple single pole IIRs */
 
@@ -314,15 +893,27 @@ int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx)
 
 	/* Foreground filter --------------------------------------------------- */
 
-	ec->fir_state.coeffs = ec->fir_taps16[0];
-	echo_value = fir16(&ec->fir_state, tx);
+	echo_value = 0;
+	if (!silent)
+		echo_value = (int32_t) (ec->kern->dot(ec->fir_taps16[0] +
+						      ec->win_start,
+						      hist + ec->win_start,
+						      ec->win_len) >> 15);
 	ec->clean = rx - echo_value;
 	ec->Lcleanacc += abs(ec->clean) - ec->Lclean;
 	ec->Lclean = (ec->Lcleanacc + (1 << 4)) >> 5;
 
 	/* Background filter --------------------------------------------------- */
 
-	echo_value = fir16(&ec->fir_state_bg, tx);
+	if (silent) {
+		/* the last sample's update is still owed */
+		if (ec->factor)
+			lms_adapt_bg(ec, hist + 1, ec->factor);
+		ec->factor = 0;
+		echo_value = 0;
+	} else {
+		echo_value = fir16_bg(ec, hist);
+	}
 	clean_bg = rx - echo_value;
 	ec->Lclean_bgacc += abs(clean_bg) - ec->Lclean_bg;
 	ec->Lclean_bg = (ec->Lclean_bgacc + (1 << 4)) >> 5;
@@ -333,9 +924,8 @@ int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx)
 	   detection to minimise adaption in cases of strong double talk.
 	   However this is not critical for the dual path algorithm.
 	 */
-	ec->factor = 0;
 	ec->shift = 0;
-	if ((ec->nonupdate_dwell == 0)) {
+	if ((ec->nonupdate_dwell == 0) && !silent) {
 		int P, logP, shift;
 
 		/* Determine:
@@ -371,12 +961,19 @@ int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx)
 		   for a divide versus a top_bit() implementation.
 		 */
 
-		P = MIN_TX_POWER_FOR_ADAPTION + ec->Pstates;
-		logP = top_bit(P) + ec->log2taps;
+		if (ec->adaption_mode & ECHO_CAN_USE_ACTIVE_WINDOW)
+			P = MIN_TX_POWER_FOR_ADAPTION +
+			    (int)(ec->Pwin >> ec->log2win);
+		else
+			P = MIN_TX_POWER_FOR_ADAPTION + Pstates;
+		logP = top_bit(P) + ec->log2win;
 		shift = 30 - 2 - logP;
 		ec->shift = shift;
 
-		lms_adapt_bg(ec, clean_bg, shift);
+		/* applied by fir16_bg() on the next sample */
+		ec->factor = lms_factor(clean_bg, shift);
+		if (ec->pu_log2)
+			partial_select(ec, hist);
 	}
 
 	/* very simple DTD to make sure we dont try and adapt with strong
@@ -402,8 +999,17 @@ int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx)
 		if (ec->cond_met == 6) {
 			/* BG filter has had better results for 6 consecutive samples */
 			ec->adapt = 1;
-			memcpy(ec->fir_taps16[0], ec->fir_taps16[1],
-			       ec->taps * sizeof(int16_t));
+			/* the foreground needs this sample's update too */
+			if (ec->factor) {
+				lms_adapt_bg(ec, hist, ec->factor);
+				ec->factor = 0;
+			}
+			/* the foreground takes the background's taps, see
+			   bg_taps() */
+			if (ec->fir_taps16[0] != ec->fir_taps16[1]) {
+				ec->fir_spare = ec->fir_taps16[0];
+				ec->fir_taps16[0] = ec->fir_taps16[1];
+			}
 		} else
 			ec->cond_met++;
 	} else
@@ -458,24 +1064,64 @@ int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx)
 			   include high level signals like near end speech.  When
 			   combined with CNG or especially CLIP seems to work OK.
 			 */
-			if (ec->Lclean < 40) {
+			if (ec->Lclean < BGN_LEVEL_LIMIT) {
 				ec->Lbgn_acc += abs(ec->clean) - ec->Lbgn;
 				ec->Lbgn = (ec->Lbgn_acc + (1 << 11)) >> 12;
 			}
 		}
 	}
 
-	/* Roll around the taps buffer */
-	if (ec->curr_pos <= 0)
-		ec->curr_pos = ec->taps;
-	ec->curr_pos--;
+	if ((ec->adaption_mode & ECHO_CAN_USE_ACTIVE_WINDOW) &&
+	    --ec->scan_count <= 0)
+		oslec_scan_window(ec, hist);
 
 	if (ec->adaption_mode & ECHO_CAN_DISABLE)
 		ec->clean_nlp = rx;
 
-	/* Output scaled back up again to match input scaling */
+	if (ec->clean_nlp > 32767)
+		return 32767;
+	if (ec->clean_nlp < -32768)
+		return -32768;
+	return (int16_t) ec->clean_nlp;
+}
+
+int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx)
+{
+	oslec_ref_update_block(ec->ref, &tx, 1);
+	return oslec_process(ec, oslec_ref_last(ec->ref), ec->ref->Pstates[0],
+			     rx);
+}
 
-	return (int16_t) ec->clean_nlp << 1;
+void oslec_update_block(struct oslec_state *ec, const int16_t *tx,
+			const int16_t *rx, int16_t *out, int n)
+{
+	int len;
+
+	while (n > 0) {
+		len = n < ec->ref->max_block ? n : ec->ref->max_block;
+		oslec_ref_update_block(ec->ref, tx, len);
+		oslec_update_rx_block(ec, rx, out, len);
+		tx += len;
+		rx += len;
+		out += len;
+		n -= len;
+	}
+}
+
+void oslec_update_rx_block(struct oslec_state *ec, const int16_t *rx,
+			   int16_t *out, int n)
+{
+	struct oslec_state s = *ec;
+	const struct oslec_ref *ref = ec->ref;
+	const int16_t *hist;
+	int i;
+
+	/* the block is in the history newest first */
+	hist = &ref->history[ref->pos + n - 1];
+	for (i = 0; i < n; i++)
+		out[i] = oslec_process(&s, hist - i, ref->Pstates[i], rx[i]);
+
+	*ec = s;
 }
 
 /* This function is seperated from the echo canceller is it is usually called
@@ -499,47 +1145,260 @@ int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx)
    precision, which noise shapes things, giving very clean DC removal.
 */
 
-int16_t oslec_hpf_tx(struct oslec_state * ec, int16_t tx)
+static inline int16_t hpf_tx(int *tx_1, int *tx_2, int16_t tx)
 {
 	int tmp, tmp1;
 
-	if (ec->adaption_mode & ECHO_CAN_USE_TX_HPF) {
-		tmp = tx << 15;
+	tmp = tx << 15;
 #if 1
-		/* Make sure the gain of the HPF is 1.0. The first can still saturate a little under
-		   impulse conditions, and it might roll to 32768 and need clipping on sustained peak
-		   level signals. However, the scale of such clipping is small, and the error due to
-		   any saturation should not markedly affect the downstream processing. */
-		tmp -= (tmp >> 4);
+	/* Make sure the gain of the HPF is 1.0. The first can still saturate a little under
+	   impulse conditions, and it might roll to 32768 and need clipping on sustained peak
+	   level signals. However, the scale of such clipping is small, and the error due to
+	   any saturation should not markedly affect the downstream processing. */
+	tmp -= (tmp >> 4);
 #endif
-		ec->tx_1 += -(ec->tx_1 >> DC_LOG2BETA) + tmp - ec->tx_2;
-		tmp1 = ec->tx_1 >> 15;
-		if (tmp1 > 32767)
-			tmp1 = 32767;
-		if (tmp1 < -32767)
-			tmp1 = -32767;
-		tx = tmp1;
-		ec->tx_2 = tmp;
-	}
+	*tx_1 += -(*tx_1 >> DC_LOG2BETA) + tmp - *tx_2;
+	tmp1 = *tx_1 >> 15;
+	if (tmp1 > 32767)
+		tmp1 = 32767;
+	if (tmp1 < -32767)
+		tmp1 = -32767;
+	*tx_2 = tmp;
+
+	return tmp1;
+}
+
+int16_t oslec_hpf_tx(struct oslec_state * ec, int16_t tx)
+{
+	if (ec->adaption_mode & ECHO_CAN_USE_TX_HPF)
+		tx = hpf_tx(&ec->tx_1, &ec->tx_2, tx);
 
 	return tx;
 }
+
+/* Shared transmit side ----------------------------------------------------*/
+
+struct oslec_ref *oslec_ref_create(int len, int max_block, int adaption_mode)
+{
+	struct oslec_arena arena;
+	struct oslec_ref *ref;
+	char *p;
+
+	p = arena_get(&arena, NULL, oslec_ref_size(len, max_block), 0);
+	if (!p)
+		return NULL;
+
+	ref = oslec_ref_carve(&p, len, max_block, adaption_mode);
+	ref->arena = arena;
+
+	return ref;
+}
+
+void oslec_ref_free(struct oslec_ref *ref)
+{
+	struct oslec_arena arena = ref->arena;
+
+	arena_put(&arena);
+}
+
+void oslec_ref_flush(struct oslec_ref *ref)
+{
+	memset(ref->history, 0, ref->size * sizeof(int16_t));
+	ref->pos = ref->size - ref->taps;
+	ref->Pstates_now = 0;
+	ref->tx_1 = ref->tx_2 = 0;
+}
+
+void oslec_ref_update_block(struct oslec_ref *ref, const int16_t *tx, int n)
+{
+	int16_t *hist;
+	int16_t x;
+	int new, old;
+	int i;
+
+	/* Slide the kept history back up to the top when the block would not
+	   fit below it */
+	if (ref->pos < n) {
+		memmove(&ref->history[ref->size - ref->taps],
+			&ref->history[ref->pos], ref->taps * sizeof(int16_t));
+		ref->pos = ref->size - ref->taps;
+	}
+
+	for (i = 0; i < n; i++) {
+		x = tx[i];
+		if (ref->adaption_mode & ECHO_CAN_USE_TX_HPF)
+			x = hpf_tx(&ref->tx_1, &ref->tx_2, x);
+
+		hist = &ref->history[--ref->pos];
+		hist[0] = x;
+
+		/* Block average of power in the filter states.  Used for
+		   adaption power calculation. */
+
+		/* efficient "out with the old and in with the new" algorithm so
+		   we don't have to recalculate over the whole block of
+		   samples. */
+		new = (int)x * (int)x;
+		old = (int)hist[ref->taps] * (int)hist[ref->taps];
+		ref->Pstates_now +=
+		    ((new - old) + (1 << ref->log2taps)) >> ref->log2taps;
+		if (ref->Pstates_now < 0)
+			ref->Pstates_now = 0;
+
+		ref->Pstates[i] = ref->Pstates_now;
+	}
+}
 //////
 
+enum engine_type
+{
+    ENGINE_OSLEC,
+    ENGINE_FLOAT,
+    ENGINE_FDAF,
+    ENGINE_SUBBAND
+};
+
+// what the channel tasks of a frame work on
+struct frame_work
+{
+    int frame_size;
+    enum engine_type engine;
+    unsigned rec_channels;
+    unsigned out_channels;
+    const int16_t *rec;
+    const int16_t *ref;
+    int16_t *out;
+    int16_t *mic;       // frame_size samples for each channel
+};
+
+// cancel the echo on one recording channel
+static void cancel_channel(void *arg, int c)
+{
+    struct frame_work *work = (struct frame_work *)arg;
+    int16_t *mic = &work->mic[c * work->frame_size];
+
+    for (int i = 0; i < work->frame_size; i++)
+    {
+        mic[i] = work->rec[i * work->rec_channels + c];
+    }
+    switch (work->engine)
+    {
+    case ENGINE_OSLEC:
+        oslec_update_rx_block(oslec[c], mic, mic, work->frame_size);
+        break;
+    case ENGINE_FLOAT:
+        oslec_float_update_block(oslec_float[c], work->ref, mic, mic, work->frame_size);
+        break;
+    case ENGINE_FDAF:
+        fdaf_update_block(fdaf[c], work->ref, mic, mic, work->frame_size);
+        break;
+    case ENGINE_SUBBAND:
+        subband_update_block(subband[c], work->ref, mic, mic, work->frame_size);
+        break;
+    }
+    for (int i = 0; i < work->frame_size; i++)
+    {
+        work->out[i * work->out_channels + c] = mic[i];
+    }
+}
+
+// ALSA period sizes, in ms, and the playback buffer, in periods
+struct latency_profile
+{
+    const char *name;
+    unsigned period_ms;
+    unsigned periods;
+};
+
+static const struct latency_profile latency_profiles[] = {
+    {"low", 10, 2},         // a period for each canceller frame
+    {"medium", 20, 3},
+    {"high", 64, 2}         // 1024 frames at 16kHz
+};
+
+static const struct latency_profile *find_latency_profile(const char *name)
+{
+    for (size_t i = 0; i < sizeof(latency_profiles) / sizeof(latency_profiles[0]); i++)
+    {
+        if (strcmp(latency_profiles[i].name, name) == 0)
+        {
+            return &latency_profiles[i];
+        }
+    }
+    return NULL;
+}
+
+// what the devices came to, and the latency each direction adds: the
+// capture waits in the device and then in the ring for a whole frame, the
+// playback for a chunk from the FIFO and then in the device
+static void report_latency(conf_t *conf, int frame_size)
+{
+    audio_latency_t latency;
+    double device_ms = 1000.0 / conf->device_rate;
+    double ms = 1000.0 / conf->rate;
+
+    audio_get_latency(&latency);
+    printf("capture period %.1f ms, buffer %.1f ms, device delay %.1f ms, ring %.1f ms with %.1f ms queued\n",
+           latency.capture_period * device_ms, latency.capture_buffer * device_ms, latency.capture_delay * device_ms,
+           latency.capture_ring * ms, latency.capture_queued * ms);
+    printf("playback period %.1f ms, buffer %.1f ms, device delay %.1f ms, ring %.1f ms with %.1f ms queued\n",
+           latency.playback_period * device_ms, latency.playback_buffer * device_ms, latency.playback_delay * device_ms,
+           latency.playback_ring * ms, latency.playback_queued * ms);
+    printf("latency: capture %.1f ms, playback %.1f ms\n",
+           latency.capture_delay * device_ms + (latency.capture_queued + frame_size) * ms,
+           (latency.playback_period + latency.playback_delay) * device_ms);
+}
+
+// parse a comma separated list of CPUs, one for each thread
+static int *parse_cpus(const char *list, int threads)
+{
+    int *cpus = (int *)malloc(threads * sizeof(int));
+    char *copy = strdup(list);
+    char *save = NULL;
+    char *tok = strtok_r(copy, ",", &save);
+
+    for (int i = 0; i < threads; i++)
+    {
+        cpus[i] = tok ? atoi(tok) : -1;
+        if (tok)
+        {
+            tok = strtok_r(NULL, ",", &save);
+        }
+    }
+    free(copy);
+
+    return cpus;
+}
 
 int main(int argc, char *argv[])
 {
     int16_t *rec = NULL;
     int16_t *far = NULL;
     int16_t *out = NULL;
+    int16_t *mic = NULL;
+    int16_t *ref = NULL;
+    int16_t *chan = NULL;
     FILE *fp_rec = NULL;
     FILE *fp_far = NULL;
     FILE *fp_out = NULL;
 
     int opt = 0;
-    int delay = 0;
+    int delay = -1;
+    int ref_delay = 0;
+    unsigned frames = 0;
     int save_audio = 0;
     int daemonize = 0;
+    char *engine = "oslec";
+    char *update = NULL;
+    int threads = 1;
+    char *cpu_list = NULL;
+    int *cpus = NULL;
+    struct pool *pool = NULL;
+    struct reactor *reactor = NULL;
+    int io_priority = 0;
+    int dsp_priority = 0;
+    int io_cpu = -1;
+    const struct latency_profile *profile = find_latency_profile("high");
 
     conf_t config = {
         .rec_pcm = "default",
@@ -547,20 +1406,64 @@ int main(int argc, char *argv[])
         .playback_fifo = "/tmp/ec.input",
         .out_fifo = "/tmp/ec.output",
         .rate = 16000,
+        .device_rate = 0,
         .rec_channels = 2,
         .ref_channels = 1,
         .out_channels = 2,
         .bits_per_sample = 16,
-        .buffer_size = 1024 * 16,
+        .buffer_size = 0,
         .playback_fifo_size = 1024 * 4,
         .filter_length = 4096,
-        .bypass = 1
+        .bypass = 1,
+        .realtime = 0
+    };
+
+    enum
+    {
+        OPT_REALTIME = 256,
+        OPT_IO_CPU,
+        OPT_LATENCY
+    };
+    static const struct option long_options[] = {
+        {"realtime", optional_argument, NULL, OPT_REALTIME},
+        {"io-cpu", required_argument, NULL, OPT_IO_CPU},
+        {"latency", required_argument, NULL, OPT_LATENCY},
+        {NULL, 0, NULL, 0}
     };
 
-    while ((opt = getopt(argc, argv, "b:c:d:Df:hi:o:r:s")) != -1)
+    while ((opt = getopt_long(argc, argv, "a:b:c:d:De:f:hi:j:o:r:R:su:", long_options, NULL)) != -1)
     {
         switch (opt)
         {
+        case OPT_REALTIME:
+            config.realtime = 1;
+            io_priority = 60;
+            dsp_priority = 0;
+            if (optarg)
+            {
+                sscanf(optarg, "%d,%d", &io_priority, &dsp_priority);
+            }
+            if (dsp_priority <= 0)
+            {
+                // below the I/O, which must never wait for the DSP
+                dsp_priority = io_priority > 1 ? io_priority - 1 : 1;
+            }
+            break;
+        case OPT_IO_CPU:
+            io_cpu = atoi(optarg);
+            break;
+        case OPT_LATENCY:
+            profile = find_latency_profile(optarg);
+            if (profile == NULL)
+            {
+                printf("Unknown latency profile %s\n\n", optarg);
+                printf(usage, argv[0]);
+                exit(1);
+            }
+            break;
+        case 'a':
+            cpu_list = optarg;
+            break;
         case 'b':
             config.buffer_size = atoi(optarg);
             break;
@@ -574,6 +1477,9 @@ int main(int argc, char *argv[])
         case 'D':
             daemonize = 1;
             break;
+        case 'e':
+            engine = optarg;
+            break;
         case 'f':
             config.filter_length = atoi(optarg);
             break;
@@ -583,15 +1489,24 @@ int main(int argc, char *argv[])
         case 'i':
             config.rec_pcm = optarg;
             break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
         case 'o':
             config.out_pcm = optarg;
             break;
         case 'r':
             config.rate = atoi(optarg);
             break;
+        case 'R':
+            config.device_rate = atoi(optarg);
+            break;
         case 's':
             save_audio = 1;
             break;
+        case 'u':
+            update = optarg;
+            break;
         case '?':
             printf("\n");
             printf(usage, argv[0]);
@@ -601,6 +1516,20 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (config.device_rate == 0)
+    {
+        config.device_rate = config.rate;
+    }
+
+    config.period_size = config.rate * profile->period_ms / 1000;
+    config.periods = profile->periods;
+
+    // the capture ring has to hold the frames skipped for a fixed delay
+    if (delay > 0 && config.buffer_size < delay + 4 * config.period_size)
+    {
+        config.buffer_size = delay + 4 * config.period_size;
+    }
+
     if (daemonize)
     {
         pid_t pid, sid;
@@ -640,6 +1569,15 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (config.realtime)
+    {
+        // before anything is allocated, so that it all comes in resident
+        if (memory_lock() != 0)
+        {
+            printf("Fail to lock memory (%s), it may still page fault\n", strerror(errno));
+        }
+    }
+
     int frame_size = config.rate * 10 / 1000; // 10 ms
 
     if (save_audio)
@@ -658,12 +1596,24 @@ int main(int argc, char *argv[])
     rec = (int16_t *)calloc(frame_size * config.rec_channels, sizeof(int16_t));
     far = (int16_t *)calloc(frame_size * config.ref_channels, sizeof(int16_t));
     out = (int16_t *)calloc(frame_size * config.out_channels, sizeof(int16_t));
+    mic = (int16_t *)calloc(frame_size, sizeof(int16_t));
+    ref = (int16_t *)calloc(frame_size, sizeof(int16_t));
+    chan = (int16_t *)calloc(frame_size * config.rec_channels, sizeof(int16_t));
 
-    if (rec == NULL || far == NULL || out == NULL)
+    if (rec == NULL || far == NULL || out == NULL || mic == NULL || ref == NULL || chan == NULL)
     {
         printf("Fail to allocate memory\n");
         exit(1);
     }
+    if (config.realtime)
+    {
+        memory_prefault(rec, frame_size * config.rec_channels * sizeof(int16_t));
+        memory_prefault(far, frame_size * config.ref_channels * sizeof(int16_t));
+        memory_prefault(out, frame_size * config.out_channels * sizeof(int16_t));
+        memory_prefault(mic, frame_size * sizeof(int16_t));
+        memory_prefault(ref, frame_size * sizeof(int16_t));
+        memory_prefault(chan, frame_size * config.rec_channels * sizeof(int16_t));
+    }
 
     // Configures signal handling.
     struct sigaction sig_int_handler;
@@ -671,6 +1621,8 @@ int main(int argc, char *argv[])
     sigemptyset(&sig_int_handler.sa_mask);
     sig_int_handler.sa_flags = 0;
     sigaction(SIGINT, &sig_int_handler, NULL);
+    // a reader leaving the output FIFO is handled where it is written
+    signal(SIGPIPE, SIG_IGN);
 /*
     echo_state = speex_echo_state_init_mc(frame_size,
                                           config.filter_length,
@@ -678,19 +1630,168 @@ int main(int argc, char *argv[])
                                           config.ref_channels);
     speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &(config.rate));
 */
-    oslec = oslec_create(frame_size, ECHO_CAN_USE_ADAPTION | ECHO_CAN_USE_NLP | ECHO_CAN_USE_CLIP | ECHO_CAN_USE_TX_HPF | ECHO_CAN_USE_RX_HPF);
-    
+    // one canceller per recording channel
+    enum engine_type engine_type = ENGINE_OSLEC;
+    int mode = ECHO_CAN_USE_ADAPTION | ECHO_CAN_USE_NLP | ECHO_CAN_USE_CLIP | ECHO_CAN_USE_TX_HPF | ECHO_CAN_USE_RX_HPF | ECHO_CAN_USE_ACTIVE_WINDOW;
+    if (strcmp(engine, "fdaf") == 0)
+    {
+        engine_type = ENGINE_FDAF;
+    }
+    else if (strcmp(engine, "float") == 0)
+    {
+        engine_type = ENGINE_FLOAT;
+    }
+    else if (strcmp(engine, "subband") == 0)
+    {
+        engine_type = ENGINE_SUBBAND;
+    }
+    else if (strcmp(engine, "oslec") != 0)
+    {
+        printf("Unknown echo canceller %s\n", engine);
+        exit(1);
+    }
+    if (update != NULL)
+    {
+        char *fraction = strchr(update, ':');
+        int n = fraction ? atoi(fraction + 1) : 0;
+        int log2n = n > 0 ? top_bit(n) : 0;
+
+        if (n != 1 << log2n || log2n < 1 || log2n > 5)
+        {
+            printf("The update fraction must be 2, 4, 8, 16 or 32\n");
+            exit(1);
+        }
+        if (strncmp(update, "seq:", 4) == 0)
+        {
+            mode |= ECHO_CAN_USE_PARTIAL_SEQ | ECHO_CAN_PARTIAL(log2n);
+        }
+        else if (strncmp(update, "mmax:", 5) == 0)
+        {
+            mode |= ECHO_CAN_USE_PARTIAL_MMAX | ECHO_CAN_PARTIAL(log2n);
+        }
+        else
+        {
+            printf("Unknown update %s\n", update);
+            exit(1);
+        }
+    }
 
-    playback_start(&config);
-    capture_start(&config);
-    fifo_setup(&config);
+    oslec = (struct oslec_state **)calloc(config.rec_channels, sizeof(struct oslec_state *));
+    oslec_float = (struct oslec_float_state **)calloc(config.rec_channels, sizeof(struct oslec_float_state *));
+    fdaf = (struct fdaf_state **)calloc(config.rec_channels, sizeof(struct fdaf_state *));
+    subband = (struct subband_state **)calloc(config.rec_channels, sizeof(struct subband_state *));
+    if (oslec == NULL || oslec_float == NULL || fdaf == NULL || subband == NULL)
+    {
+        printf("Fail to allocate memory\n");
+        exit(1);
+    }
 
+    if (engine_type == ENGINE_OSLEC)
+    {
+        // the playback side work is shared by all the channels
+        oslec_ref = oslec_ref_create(config.filter_length, frame_size, mode);
+        if (oslec_ref == NULL)
+        {
+            printf("Fail to create echo canceller\n");
+            exit(1);
+        }
+    }
+    for (unsigned c = 0; c < config.rec_channels; c++)
+    {
+        switch (engine_type)
+        {
+        case ENGINE_OSLEC:
+            oslec[c] = oslec_create_with_ref(oslec_ref, mode);
+            break;
+        case ENGINE_FLOAT:
+            oslec_float[c] = oslec_float_create(config.filter_length, mode);
+            break;
+        case ENGINE_FDAF:
+            // frequency domain canceller for long tails, 8 ms blocks at 16 kHz
+            fdaf[c] = fdaf_create(config.filter_length, 128, mode);
+            break;
+        case ENGINE_SUBBAND:
+            // short cancellers at 1/8 of the rate, for 32 and 48 kHz
+            subband[c] = subband_create(config.filter_length, mode);
+            break;
+        }
+        if (oslec[c] == NULL && oslec_float[c] == NULL && fdaf[c] == NULL && subband[c] == NULL)
+        {
+            printf("Fail to create echo canceller\n");
+            exit(1);
+        }
+    }
+
+    // without a fixed delay, track it and delay the reference to match
+    int max_delay = config.rate / 2;
+    int delay_margin = config.rate / 250;     // 4 ms of taps before the echo
+    if (delay < 0)
+    {
+        delay_est = delay_est_create(max_delay, 4);
+        ref_line = delay_line_create(max_delay);
+        if (delay_est == NULL || ref_line == NULL)
+        {
+            printf("Fail to create delay estimator\n");
+            exit(1);
+        }
+    }
+
+    // one thread does all the audio and FIFO I/O, and hands the frames to
+    // this one through the ring buffers
+    reactor = reactor_create();
+    if (reactor == NULL)
+    {
+        printf("Fail to create I/O thread\n");
+        exit(1);
+    }
+    playback_start(&config, reactor);
+    capture_start(&config, reactor);
+    fifo_setup(&config, reactor);
+    if (reactor_start(reactor, io_priority, io_cpu) != 0)
+    {
+        printf("Fail to create I/O thread\n");
+        exit(1);
+    }
+
+    // the channels are shared between the threads, with the main thread as
+    // one of them; started after the I/O thread, so that it does not
+    // inherit the main thread's affinity
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    if (cpu_list)
+    {
+        cpus = parse_cpus(cpu_list, threads);
+    }
+    pool = pool_create(threads, cpus, dsp_priority);
+    if (pool == NULL)
+    {
+        printf("Fail to create worker threads\n");
+        exit(1);
+    }
+
+    struct frame_work work = {
+        .frame_size = frame_size,
+        .engine = engine_type,
+        .rec_channels = config.rec_channels,
+        .out_channels = config.out_channels,
+        .rec = rec,
+        .ref = ref,
+        .out = out,
+        .mic = chan
+    };
+
+    printf("FIR kernels: %s\n", fir_simd_name());
     printf("Running... Press Ctrl+C to exit\n");
 
     int timeout = 200 * 1000 * frame_size / config.rate;    // ms
 
     // system delay between recording and playback
-    printf("skip frames %d\n", capture_skip(delay));
+    if (delay > 0)
+    {
+        printf("skip frames %d\n", capture_skip(delay));
+    }
 
     while (!g_is_quit)
     {
@@ -700,7 +1801,55 @@ int main(int argc, char *argv[])
         if (!config.bypass)
         {
             //speex_echo_cancellation(echo_state, rec, far, out);
-            *out=oslec_update(oslec, *far, *rec);
+            memcpy(out, rec, frame_size * config.rec_channels * config.bits_per_sample / 8);
+
+            memcpy(ref, far, frame_size * sizeof(int16_t));
+            if (delay_est)
+            {
+                // estimate the delay on the first recording channel
+                for (int i = 0; i < frame_size; i++)
+                {
+                    mic[i] = rec[i * config.rec_channels];
+                }
+
+                int estimate = delay_est_update(delay_est, far, mic, frame_size);
+                // compared after the clamp, or an echo under delay_margin
+                // would never match the 0 it is clamped to
+                int target = estimate > delay_margin ? estimate - delay_margin : 0;
+                if (estimate >= 0 && abs(target - ref_delay) > delay_margin / 2)
+                {
+                    ref_delay = target;
+                    printf("delay %d samples\n", estimate);
+
+                    // the filters were modelling the old alignment
+                    for (unsigned c = 0; c < config.rec_channels; c++)
+                    {
+                        switch (engine_type)
+                        {
+                        case ENGINE_OSLEC:
+                            oslec_flush(oslec[c]);
+                            break;
+                        case ENGINE_FLOAT:
+                            oslec_float_flush(oslec_float[c]);
+                            break;
+                        case ENGINE_FDAF:
+                            fdaf_flush(fdaf[c]);
+                            break;
+                        case ENGINE_SUBBAND:
+                            subband_flush(subband[c]);
+                            break;
+                        }
+                    }
+                }
+                delay_line_process(ref_line, far, ref, frame_size, ref_delay);
+            }
+
+            // cancel the echo on every recording channel
+            if (engine_type == ENGINE_OSLEC)
+            {
+                oslec_ref_update_block(oslec_ref, ref, frame_size);
+            }
+            pool_run(pool, cancel_channel, &work, config.rec_channels);
         }
         else
         {
@@ -715,6 +1864,37 @@ int main(int argc, char *argv[])
         }
 
         fifo_write(out, frame_size);
+
+        // once the devices have run for half a second, what the latency is
+        if (++frames == 50)
+        {
+            report_latency(&config, frame_size);
+        }
+
+        // report how much of the filter is in use, how much of the time it
+        // could be skipped, and what the resampling costs, every 10 s
+        if (frames % 1000 == 0)
+        {
+            if (engine_type == ENGINE_OSLEC)
+            {
+                struct oslec_stats stats;
+
+                for (unsigned c = 0; c < config.rec_channels; c++)
+                {
+                    oslec_get_stats(oslec[c], &stats);
+                    printf("channel %u active taps %d-%d of %d, far end silent for %llu of %llu samples\n", c, stats.window_start, stats.window_start + stats.window_len - 1, stats.taps, (unsigned long long)stats.silent_samples, (unsigned long long)stats.samples);
+                }
+            }
+            if (config.device_rate != config.rate)
+            {
+                audio_stats_t stats;
+
+                audio_get_stats(&stats);
+                printf("resampling %u Hz: capture %.1f us, playback %.1f us per second of audio\n", config.device_rate,
+                       stats.capture_frames ? stats.capture_ns / 1000.0 * config.rate / stats.capture_frames : 0.0,
+                       stats.playback_frames ? stats.playback_ns / 1000.0 * config.rate / stats.playback_frames : 0.0);
+            }
+        }
     }
 
     if (fp_far)
@@ -727,9 +1907,47 @@ int main(int argc, char *argv[])
     free(rec);
     free(far);
     free(out);
+    free(mic);
+    free(ref);
+    free(chan);
+    pool_free(pool);
+    free(cpus);
+    if (delay_est)
+    {
+        delay_est_free(delay_est);
+        delay_line_free(ref_line);
+    }
+    for (unsigned c = 0; c < config.rec_channels; c++)
+    {
+        switch (engine_type)
+        {
+        case ENGINE_OSLEC:
+            oslec_free(oslec[c]);
+            break;
+        case ENGINE_FLOAT:
+            oslec_float_free(oslec_float[c]);
+            break;
+        case ENGINE_FDAF:
+            fdaf_free(fdaf[c]);
+            break;
+        case ENGINE_SUBBAND:
+            subband_free(subband[c]);
+            break;
+        }
+    }
+    if (oslec_ref)
+    {
+        oslec_ref_free(oslec_ref);
+    }
+    free(oslec);
+    free(oslec_float);
+    free(fdaf);
+    free(subband);
 
+    reactor_stop(reactor);
     capture_stop();
     playback_stop();
+    reactor_free(reactor);
 
     exit(0);
 
@@ -27,6 +27,9 @@
 #ifndef __OSLEC_H
 #define __OSLEC_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* TODO: document interface */
 
 /* Mask bits for the adaption mode */
@@ -37,6 +40,38 @@
 #define ECHO_CAN_USE_TX_HPF	0x10
 #define ECHO_CAN_USE_RX_HPF	0x20
 #define ECHO_CAN_DISABLE	0x40
+#define ECHO_CAN_USE_ACTIVE_WINDOW	0x80
+#define ECHO_CAN_USE_PARTIAL_SEQ	0x100
+#define ECHO_CAN_USE_PARTIAL_MMAX	0x200
+
+/* With ECHO_CAN_USE_PARTIAL_SEQ or ECHO_CAN_USE_PARTIAL_MMAX, only 1 in 2^n
+   of the background taps are adapted each sample, in blocks: the next
+   blocks in turn for SEQ, or the blocks whose history has the most energy
+   for MMAX.  n is 1 to 5, and is given with ECHO_CAN_PARTIAL(n). */
+#define ECHO_CAN_PARTIAL_SHIFT	12
+#define ECHO_CAN_PARTIAL_MASK	(7 << ECHO_CAN_PARTIAL_SHIFT)
+#define ECHO_CAN_PARTIAL(n)	((n) << ECHO_CAN_PARTIAL_SHIFT)
+
+/* Flags for oslec_create_arena() */
+#define OSLEC_ARENA_HUGEPAGES	0x01
+
+/*!
+    Echo canceller statistics, for monitoring.
+*/
+struct oslec_stats {
+	/*! The first tap of the window of taps being filtered. */
+	int window_start;
+	/*! The number of taps being filtered. This is the full length of the
+	    canceller unless ECHO_CAN_USE_ACTIVE_WINDOW is set. */
+	int window_len;
+	/*! The full length of the canceller. */
+	int taps;
+	/*! The number of samples processed since the canceller was created. */
+	uint64_t samples;
+	/*! How many of those samples found the far end silent over the whole
+	    window, so the filters were skipped. */
+	uint64_t silent_samples;
+};
 
 /*!
     G.168 echo canceller descriptor. This defines the working state for a line
@@ -44,18 +79,57 @@
 */
 struct oslec_state;
 
+/*!
+    Transmit side state. This holds the tx history and power, which only
+    depend on the tx signal, so several cancellers working against the same
+    far end signal (one per microphone, say) can share them.
+*/
+struct oslec_ref;
+
 /*! Create a voice echo canceller context.
     \param len The length of the canceller, in samples.
     \return The new canceller context, or NULL if the canceller could not be created.
 */
 struct oslec_state *oslec_create(int len, int adaption_mode);
 
+/*! The size of the memory needed by a canceller from oslec_create_arena().
+    \param len The length of the canceller, in samples.
+    \return The size, in bytes.
+*/
+size_t oslec_arena_size(int len);
+
+/*! Create a voice echo canceller context, as oslec_create() does, with all
+    of its state in one block of memory. The descriptor, the taps and the
+    history each start on a cache line.
+    \param len The length of the canceller, in samples.
+    \param adaption_mode The mode.
+    \param mem The memory to use, oslec_arena_size() bytes aligned to 64
+           bytes, which must outlive the canceller; or NULL to allocate it.
+           Several cancellers can be carved from one larger region this way.
+    \param flags OSLEC_ARENA_HUGEPAGES to back memory the canceller allocates
+           with huge pages, where the system has them.
+    \return The new canceller context, or NULL if the canceller could not be
+            created.
+*/
+struct oslec_state *oslec_create_arena(int len, int adaption_mode,
+				       void *mem, int flags);
+
+/*! Create a voice echo canceller context which filters the tx signal held
+    by a shared reference.  Its length is the length of the reference.
+    \param ref The reference. It must outlive the canceller.
+    \param adaption_mode The mode.
+    \return The new canceller context, or NULL if the canceller could not be created.
+*/
+struct oslec_state *oslec_create_with_ref(struct oslec_ref *ref,
+					  int adaption_mode);
+
 /*! Free a voice echo canceller context.
     \param ec The echo canceller context.
 */
 void oslec_free(struct oslec_state *ec);
 
-/*! Flush (reinitialise) a voice echo canceller context.
+/*! Flush (reinitialise) a voice echo canceller context. A shared
+    reference is not flushed, as other cancellers may be using it.
     \param ec The echo canceller context.
 */
 void oslec_flush(struct oslec_state *ec);
@@ -66,9 +140,20 @@ void oslec_flush(struct oslec_state *ec);
 */
 void oslec_adaption_mode(struct oslec_state *ec, int adaption_mode);
 
+/*! Copy the foreground taps aside, for development. The copy is
+    allocated the first time.
+    \param ec The echo canceller context.
+*/
 void oslec_snapshot(struct oslec_state *ec);
 
-/*! Process a sample through a voice echo canceller.
+/*! Get the current statistics of a voice echo canceller context.
+    \param ec The echo canceller context.
+    \param stats The structure to fill in.
+*/
+void oslec_get_stats(struct oslec_state *ec, struct oslec_stats *stats);
+
+/*! Process a sample through a voice echo canceller created with
+    oslec_create().
     \param ec The echo canceller context.
     \param tx The transmitted audio sample.
     \param rx The received audio sample.
@@ -76,6 +161,33 @@ void oslec_snapshot(struct oslec_state *ec);
 */
 int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx);
 
+/*! Process a block of samples through a voice echo canceller created with
+    oslec_create(). This gives
+    the same result as calling oslec_update() for each sample in turn, but
+    without the per-sample call overhead.
+    \param ec The echo canceller context.
+    \param tx The transmitted audio samples.
+    \param rx The received audio samples.
+    \param out The clean (echo cancelled) received samples. This may be the
+           same buffer as rx.
+    \param n The number of samples in the block.
+*/
+void oslec_update_block(struct oslec_state *ec, const int16_t *tx,
+			const int16_t *rx, int16_t *out, int n);
+
+/*! Process a block of received samples through a voice echo canceller
+    created with oslec_create_with_ref(), against the tx block last given to
+    its reference by oslec_ref_update_block().
+    \param ec The echo canceller context.
+    \param rx The received audio samples.
+    \param out The clean (echo cancelled) received samples. This may be the
+           same buffer as rx.
+    \param n The number of samples in the block. This must be the number
+           last given to oslec_ref_update_block().
+*/
+void oslec_update_rx_block(struct oslec_state *ec, const int16_t *rx,
+			   int16_t *out, int n);
+
 /*! Process to high pass filter the tx signal.
     \param ec The echo canceller context.
     \param tx The transmitted auio sample.
@@ -83,4 +195,34 @@ int16_t oslec_update(struct oslec_state *ec, int16_t tx, int16_t rx);
 */
 int16_t oslec_hpf_tx(struct oslec_state *ec, int16_t tx);
 
+/*! Create a shared transmit side reference.
+    \param len The length of the cancellers that will use it, in samples.
+    \param max_block The largest block that will be given to
+           oslec_ref_update_block().
+    \param adaption_mode The mode. Only ECHO_CAN_USE_TX_HPF matters here,
+           and high pass filters the reference, rather than the signal
+           actually sent as oslec_hpf_tx() does.
+    \return The new reference, or NULL if it could not be created.
+*/
+struct oslec_ref *oslec_ref_create(int len, int max_block, int adaption_mode);
+
+/*! Free a shared transmit side reference.
+    \param ref The reference.
+*/
+void oslec_ref_free(struct oslec_ref *ref);
+
+/*! Flush (reinitialise) a shared transmit side reference.
+    \param ref The reference.
+*/
+void oslec_ref_flush(struct oslec_ref *ref);
+
+/*! Add a block of transmitted samples to a shared reference. Each canceller
+    using it should then be given the matching received block with
+    oslec_update_rx_block().
+    \param ref The reference.
+    \param tx The transmitted audio samples.
+    \param n The number of samples, at most the reference's max_block.
+*/
+void oslec_ref_update_block(struct oslec_ref *ref, const int16_t *tx, int n);
+
 #endif /* __OSLEC_H */
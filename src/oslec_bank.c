@@ -0,0 +1,480 @@
+/*
+ * oslec_bank.c - Many OSLEC echo cancellers run side by side
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fir_simd.h"
+#include "bit_operations.h"
+#include "oslec_bank.h"
+
+/* as in oslec */
+#define DC_LOG2BETA			3
+#define MIN_TX_POWER_FOR_ADAPTION	256
+#define MIN_RX_POWER_FOR_ADAPTION	128
+#define DTD_HANGOVER			600
+#define BGN_LEVEL_LIMIT			80
+#define SILENT_TX_POWER			4	/* as in oslec */
+
+#define BANK_ALIGN			64	/* a cache line */
+
+#define L				FIR16_LANES
+
+/*
+   One group of channels.  The taps and history are interleaved by lane, so
+   tap i of lane l is at [i*L + l].  The history is mirrored, as in fir16,
+   with sample curr_pos + taps holding the sample which is just leaving the
+   filter until the group's filters have run, as the pending background
+   update still needs it.
+*/
+struct oslec_bank_group {
+	int16_t *fg;
+	int16_t *bg;
+	int16_t *history;
+	int curr_pos;
+	unsigned int active;
+
+	/* pending background update, and the filter outputs */
+	int32_t factor[L];
+	int64_t y_fg[L];
+	int64_t y_bg[L];
+
+	int32_t Pstates[L];
+	int64_t Pwin[L];
+
+	/* Average levels and averaging filter states */
+	int Ltxacc[L], Lrxacc[L], Lcleanacc[L], Lclean_bgacc[L];
+	int Ltx[L], Lrx[L];
+	int Lclean[L];
+	int Lclean_bg[L];
+	int Lbgn[L], Lbgn_acc[L];
+
+	int nonupdate_dwell[L];
+	int cond_met[L];
+
+	/* DC blocking filter states */
+	int rx_1[L], rx_2[L];
+
+	/* Parameters for the optional Hoth noise generator */
+	int cng_level[L];
+	int cng_rndnum[L];
+	int cng_filter[L];
+};
+
+struct oslec_bank {
+	int taps;
+	int log2taps;
+	int adaption_mode;
+
+	/* groups, NULL where a group has no channels left */
+	struct oslec_bank_group **groups;
+	int ngroups;
+};
+
+static struct oslec_bank_group *group_create(int taps)
+{
+	struct oslec_bank_group *g;
+	void *mem;
+
+	if (posix_memalign(&mem, BANK_ALIGN, sizeof(*g)))
+		return NULL;
+	g = mem;
+	memset(g, 0, sizeof(*g));
+
+	/* fg, bg and the mirrored history in one block */
+	if (posix_memalign(&mem, BANK_ALIGN, 4 * taps * L * sizeof(int16_t))) {
+		free(g);
+		return NULL;
+	}
+	memset(mem, 0, 4 * taps * L * sizeof(int16_t));
+	g->fg = mem;
+	g->bg = g->fg + taps * L;
+	g->history = g->bg + taps * L;
+	g->curr_pos = taps - 1;
+
+	return g;
+}
+
+static void group_free(struct oslec_bank_group *g)
+{
+	free(g->fg);
+	free(g);
+}
+
+struct oslec_bank *oslec_bank_create(int len, int adaption_mode)
+{
+	struct oslec_bank *bank;
+
+	fir_simd_init();
+
+	bank = calloc(1, sizeof(*bank));
+	if (!bank)
+		return NULL;
+
+	bank->taps = len;
+	bank->log2taps = top_bit(len);
+	bank->adaption_mode = adaption_mode;
+
+	return bank;
+}
+
+void oslec_bank_free(struct oslec_bank *bank)
+{
+	int i;
+
+	for (i = 0; i < bank->ngroups; i++) {
+		if (bank->groups[i])
+			group_free(bank->groups[i]);
+	}
+	free(bank->groups);
+	free(bank);
+}
+
+void oslec_bank_adaption_mode(struct oslec_bank *bank, int adaption_mode)
+{
+	bank->adaption_mode = adaption_mode;
+}
+
+void oslec_bank_flush(struct oslec_bank *bank, int chan)
+{
+	struct oslec_bank_group *g = bank->groups[chan / L];
+	int l = chan % L;
+	int i;
+
+	for (i = 0; i < bank->taps; i++)
+		g->fg[i * L + l] = g->bg[i * L + l] = 0;
+	for (i = 0; i < 2 * bank->taps; i++)
+		g->history[i * L + l] = 0;
+
+	g->factor[l] = 0;
+	g->Pstates[l] = 0;
+	g->Pwin[l] = 0;
+	g->Ltxacc[l] = g->Lrxacc[l] = g->Lcleanacc[l] = g->Lclean_bgacc[l] = 0;
+	g->Ltx[l] = g->Lrx[l] = g->Lclean[l] = g->Lclean_bg[l] = 0;
+	g->Lbgn[l] = g->Lbgn_acc[l] = 0;
+	g->nonupdate_dwell[l] = 0;
+	g->cond_met[l] = 0;
+	g->rx_1[l] = g->rx_2[l] = 0;
+	g->cng_level[l] = 1000;
+	g->cng_rndnum[l] = 0;
+	g->cng_filter[l] = 0;
+}
+
+int oslec_bank_add(struct oslec_bank *bank)
+{
+	struct oslec_bank_group **groups;
+	struct oslec_bank_group *g;
+	int i;
+	int l;
+
+	/* the first free lane, in a group which is already running if
+	   possible, so the groups stay full */
+	for (i = 0; i < bank->ngroups; i++) {
+		g = bank->groups[i];
+		if (g && g->active != (1U << L) - 1)
+			break;
+	}
+	if (i == bank->ngroups) {
+		for (i = 0; i < bank->ngroups; i++) {
+			if (!bank->groups[i])
+				break;
+		}
+	}
+
+	if (i == bank->ngroups) {
+		/* only the table of groups grows */
+		groups = realloc(bank->groups, (i + 1) * sizeof(*groups));
+		if (!groups)
+			return -1;
+		groups[i] = NULL;
+		bank->groups = groups;
+		bank->ngroups++;
+	}
+	if (!bank->groups[i]) {
+		bank->groups[i] = group_create(bank->taps);
+		if (!bank->groups[i])
+			return -1;
+	}
+
+	g = bank->groups[i];
+	for (l = 0; g->active & (1U << l); l++) ;
+	g->active |= 1U << l;
+	oslec_bank_flush(bank, i * L + l);
+
+	return i * L + l;
+}
+
+void oslec_bank_remove(struct oslec_bank *bank, int chan)
+{
+	struct oslec_bank_group *g = bank->groups[chan / L];
+
+	/* flushed, so the lane just filters silence with zero taps until it
+	   is used again */
+	oslec_bank_flush(bank, chan);
+	g->active &= ~(1U << (chan % L));
+	if (!g->active) {
+		group_free(g);
+		bank->groups[chan / L] = NULL;
+	}
+}
+
+static inline int32_t lms_factor(int clean, int shift)
+{
+	if (shift >= 0)
+		return clean << shift;
+	return (clean + (1 << (-shift - 1))) >> -shift;
+}
+
+/* Apply one lane's pending update straight away, for a transfer */
+static void lane_lms(int16_t *coeffs, const int16_t *hist, int32_t factor,
+		     int len)
+{
+	int32_t exp;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		exp = hist[i * L] * factor;
+		coeffs[i * L] += (int16_t) ((exp + (1 << 14)) >> 15);
+	}
+}
+
+/* One sample through a group.  This is oslec_process() with every lane
+   done side by side: the per-lane logic is written as selects rather than
+   branches, in simple loops over the lanes, as the lanes each take their
+   own way through it and branching on them would mispredict constantly.
+   Lanes not in use see silence, so they can go through it all too. */
+static void group_process(struct oslec_bank *bank, struct oslec_bank_group *g,
+			  const int16_t *x, int16_t *r, int16_t *out)
+{
+	int mode = bank->adaption_mode;
+	int taps = bank->taps;
+	int log2taps = bank->log2taps;
+	int16_t *hist = &g->history[g->curr_pos * L];
+	int clean[L];
+	int clean_bg[L];
+	unsigned int transfer;
+	unsigned int silent;
+	int pending;
+	int new, old;
+	int tmp, tmp1;
+	int l;
+
+	for (l = 0; l < L; l++) {
+		/* Pstates, as in oslec_ref_update_block() */
+		new = (int)x[l] * (int)x[l];
+		old = (int)hist[l] * (int)hist[l];
+		g->Pstates[l] += ((new - old) + (1 << log2taps)) >> log2taps;
+		if (g->Pstates[l] < 0)
+			g->Pstates[l] = 0;
+		g->Pwin[l] += new - old;
+		if (g->Pwin[l] < 0)
+			g->Pwin[l] = 0;
+		hist[l] = x[l];
+
+		g->Ltxacc[l] += abs(x[l]) - g->Ltx[l];
+		g->Ltx[l] = (g->Ltxacc[l] + (1 << 4)) >> 5;
+	}
+
+	if (mode & ECHO_CAN_USE_RX_HPF) {
+		for (l = 0; l < L; l++) {
+			tmp = r[l] << 14;
+			tmp -= (tmp >> 4);
+			g->rx_1[l] += -(g->rx_1[l] >> DC_LOG2BETA) + tmp - g->rx_2[l];
+			tmp1 = g->rx_1[l] >> 14;
+			if (tmp1 > 32767)
+				tmp1 = 32767;
+			if (tmp1 < -32767)
+				tmp1 = -32767;
+			r[l] = tmp1;
+			g->rx_2[l] = tmp;
+		}
+	}
+
+	for (l = 0; l < L; l++) {
+		g->Lrxacc[l] += abs(r[l]) - g->Lrx[l];
+		g->Lrx[l] = (g->Lrxacc[l] + (1 << 4)) >> 5;
+	}
+
+	/* Lanes whose far end is silent over the whole filter get no echo
+	   estimate and no adaption, as in oslec.  When the whole group is
+	   silent, with no update left over, the filters are skipped. */
+	silent = 0;
+	pending = 0;
+	for (l = 0; l < L; l++) {
+		silent |= (unsigned int)(g->Pwin[l] <=
+					 (int64_t) taps * SILENT_TX_POWER) << l;
+		pending |= g->factor[l] != 0;
+	}
+
+	/* Both filters, and the background update left from the last sample */
+	if (silent == (1U << L) - 1 && !pending) {
+		memset(g->y_fg, 0, sizeof(g->y_fg));
+		memset(g->y_bg, 0, sizeof(g->y_bg));
+	} else {
+		fir16_lanes(g->fg, g->bg, hist, g->factor, g->y_fg, g->y_bg,
+			    taps);
+		for (l = 0; l < L; l++) {
+			if (silent & (1U << l))
+				g->y_fg[l] = g->y_bg[l] = 0;
+		}
+	}
+	memcpy(&hist[taps * L], hist, L * sizeof(int16_t));
+
+	for (l = 0; l < L; l++) {
+		clean[l] = r[l] - (int32_t) (g->y_fg[l] >> 15);
+		g->Lcleanacc[l] += abs(clean[l]) - g->Lclean[l];
+		g->Lclean[l] = (g->Lcleanacc[l] + (1 << 4)) >> 5;
+
+		clean_bg[l] = r[l] - (int32_t) (g->y_bg[l] >> 15);
+		g->Lclean_bgacc[l] += abs(clean_bg[l]) - g->Lclean_bg[l];
+		g->Lclean_bg[l] = (g->Lclean_bgacc[l] + (1 << 4)) >> 5;
+	}
+
+	/* Background filter adaption, applied by fir16_lanes() on the next
+	   sample, then the DTD and the transfer conditions */
+	transfer = 0;
+	for (l = 0; l < L; l++) {
+		int P, logP, shift;
+		int32_t factor;
+		int cond;
+
+		P = MIN_TX_POWER_FOR_ADAPTION + g->Pstates[l];
+		logP = top_bit(P) + log2taps;
+		shift = 30 - 2 - logP;
+		factor = lms_factor(clean_bg[l], shift);
+		g->factor[l] = (g->nonupdate_dwell[l] == 0) &
+		    !(silent & (1U << l)) ? factor : 0;
+
+		if ((g->Lrx[l] > MIN_RX_POWER_FOR_ADAPTION)
+		    & (g->Lrx[l] > g->Ltx[l]))
+			g->nonupdate_dwell[l] = DTD_HANGOVER;
+		g->nonupdate_dwell[l] -= g->nonupdate_dwell[l] != 0;
+
+		cond = (g->nonupdate_dwell[l] == 0) &
+		    (8 * g->Lclean_bg[l] < 7 * g->Lclean[l]) &
+		    (8 * g->Lclean_bg[l] < g->Ltx[l]);
+		transfer |= (unsigned int)(cond & (g->cond_met[l] == 6)) << l;
+		g->cond_met[l] = cond ? g->cond_met[l] + (g->cond_met[l] != 6) : 0;
+	}
+
+	/* The transfers are rare, so these are done lane by lane */
+	if (!(mode & ECHO_CAN_USE_ADAPTION))
+		transfer = 0;
+	for (l = 0; transfer; l++, transfer >>= 1) {
+		int i;
+
+		if (!(transfer & 1))
+			continue;
+		/* the foreground needs this sample's update too */
+		if (g->factor[l]) {
+			lane_lms(g->bg + l, hist + l, g->factor[l], taps);
+			g->factor[l] = 0;
+		}
+		for (i = 0; i < taps; i++)
+			g->fg[i * L + l] = g->bg[i * L + l];
+	}
+
+	/* Non-Linear Processing */
+	for (l = 0; l < L; l++) {
+		int clean_nlp = clean[l];
+		int residual;
+		int bgn;
+		int on;
+
+		on = (mode & ECHO_CAN_USE_NLP) && (16 * g->Lclean[l] < g->Ltx[l]);
+		if (mode & ECHO_CAN_USE_CNG) {
+			unsigned int rnd;
+			int filter;
+
+			rnd = 1664525U * g->cng_rndnum[l] + 1013904223U;
+			filter = ((int)(rnd & 0xFFFF) - 32768 +
+				  5 * g->cng_filter[l]) >> 3;
+			g->cng_level[l] = on ? g->Lbgn[l] : g->cng_level[l];
+			g->cng_rndnum[l] = on ? (int)rnd : g->cng_rndnum[l];
+			g->cng_filter[l] = on ? filter : g->cng_filter[l];
+			residual = (filter * g->Lbgn[l] * 8) >> 14;
+		} else if (mode & ECHO_CAN_USE_CLIP) {
+			residual = clean_nlp;
+			if (residual > g->Lbgn[l])
+				residual = g->Lbgn[l];
+			if (residual < -g->Lbgn[l])
+				residual = -g->Lbgn[l];
+		} else {
+			residual = 0;
+		}
+		clean_nlp = on ? residual : clean_nlp;
+
+		/* background noise estimator */
+		bgn = (mode & ECHO_CAN_USE_NLP) && !on && (g->Lclean[l] < BGN_LEVEL_LIMIT);
+		g->Lbgn_acc[l] += bgn ? abs(clean[l]) - g->Lbgn[l] : 0;
+		g->Lbgn[l] = bgn ? (g->Lbgn_acc[l] + (1 << 11)) >> 12 : g->Lbgn[l];
+
+		if (mode & ECHO_CAN_DISABLE)
+			clean_nlp = r[l];
+
+		if (clean_nlp > 32767)
+			clean_nlp = 32767;
+		if (clean_nlp < -32768)
+			clean_nlp = -32768;
+		out[l] = (int16_t) clean_nlp;
+	}
+
+	if (g->curr_pos <= 0)
+		g->curr_pos = taps;
+	g->curr_pos--;
+}
+
+static void group_update_block(struct oslec_bank *bank,
+			       struct oslec_bank_group *g, int first,
+			       const int16_t *tx, const int16_t *rx,
+			       int16_t *out, int stride, int n)
+{
+	int16_t x[L], r[L], o[L];
+	int k;
+	int l;
+
+	for (k = 0; k < n; k++) {
+		for (l = 0; l < L; l++) {
+			x[l] = r[l] = 0;
+			if (g->active & (1U << l)) {
+				x[l] = tx[k * stride + first + l];
+				r[l] = rx[k * stride + first + l];
+			}
+		}
+
+		group_process(bank, g, x, r, o);
+
+		for (l = 0; l < L; l++) {
+			if (g->active & (1U << l))
+				out[k * stride + first + l] = o[l];
+		}
+	}
+}
+
+void oslec_bank_update_block(struct oslec_bank *bank, const int16_t *tx,
+			     const int16_t *rx, int16_t *out, int stride,
+			     int n)
+{
+	int i;
+
+	/* A whole block for each group in turn, so the group's taps and
+	   state stay in cache */
+	for (i = 0; i < bank->ngroups; i++) {
+		if (bank->groups[i])
+			group_update_block(bank, bank->groups[i], i * L, tx,
+					   rx, out, stride, n);
+	}
+}
+
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,99 @@
+/*
+ * oslec_bank.h - Many OSLEC echo cancellers run side by side
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*! \page oslec_bank_page Echo canceller banks
+\section oslec_bank_page_sec_1 What does it do?
+Runs a large number of independent OSLEC echo cancellers, each with its own
+far end and near end signals, for something like a conference bridge with
+one canceller per leg.  Each channel gives exactly the same output as an
+oslec_create() canceller of the same length and mode would.
+
+\section oslec_bank_page_sec_2 How does it work?
+The channels are kept in groups of FIR16_LANES.  Within a group the filter
+taps, the tx histories and all the level filters are stored structure of
+arrays, interleaved by channel, so one SIMD lane works on one channel and a
+single sweep through the taps filters and adapts the whole group.  Groups
+are allocated separately, so channels can be added and removed without
+moving the channels already running.
+*/
+
+#if !defined(_OSLEC_BANK_H_)
+#define _OSLEC_BANK_H_
+
+#include <stdint.h>
+
+#include "oslec.h"
+
+/*!
+    Echo canceller bank descriptor.
+*/
+struct oslec_bank;
+
+/*! Create an empty echo canceller bank.
+    \param len The length of every canceller, in samples.
+    \param adaption_mode The mode of every canceller, using the same
+           ECHO_CAN_xxx bits as oslec_create(). ECHO_CAN_USE_ACTIVE_WINDOW,
+           ECHO_CAN_USE_TX_HPF and the partial updates are not supported.
+    \return The new bank, or NULL if the bank could not be created.
+*/
+struct oslec_bank *oslec_bank_create(int len, int adaption_mode);
+
+/*! Free an echo canceller bank, and all its channels.
+    \param bank The bank.
+*/
+void oslec_bank_free(struct oslec_bank *bank);
+
+/*! Set the adaption mode of every canceller in a bank.
+    \param bank The bank.
+    \param adaption_mode The mode.
+*/
+void oslec_bank_adaption_mode(struct oslec_bank *bank, int adaption_mode);
+
+/*! Add a channel to a bank. The lowest free channel number is used, so the
+    channel numbers stay dense as channels come and go.
+    \param bank The bank.
+    \return The channel number, or -1 if the channel could not be added.
+*/
+int oslec_bank_add(struct oslec_bank *bank);
+
+/*! Remove a channel from a bank. Its number may be given out again by
+    oslec_bank_add().
+    \param bank The bank.
+    \param chan The channel number.
+*/
+void oslec_bank_remove(struct oslec_bank *bank, int chan);
+
+/*! Flush (reinitialise) one channel of a bank.
+    \param bank The bank.
+    \param chan The channel number.
+*/
+void oslec_bank_flush(struct oslec_bank *bank, int chan);
+
+/*! Process a block of samples through every channel of a bank. The samples
+    are interleaved, so sample k of channel c is at [k*stride + c] in each
+    of the buffers. Only the channels in use are read or written.
+    \param bank The bank.
+    \param tx The transmitted audio samples.
+    \param rx The received audio samples.
+    \param out The clean (echo cancelled) received samples. This may be the
+           same buffer as rx.
+    \param stride The number of samples between one sample of a channel and
+           the next. This must be more than the highest channel number in use.
+    \param n The number of samples per channel.
+*/
+void oslec_bank_update_block(struct oslec_bank *bank, const int16_t *tx,
+			     const int16_t *rx, int16_t *out, int stride,
+			     int n);
+
+#endif
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,230 @@
+/*
+ * oslec_float.c - Floating point version of the OSLEC echo canceller
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "fir_new.h"
+#include "oslec_float.h"
+
+/* The levels are those of oslec, doubled, as the input here is not halved */
+#define DC_BETA			0.125f	/* DC filter Beta, as in oslec */
+#define MIN_TX_POWER_FOR_ADAPTION	256.0f	/* per tap */
+#define MIN_RX_LEVEL_FOR_ADAPTION	128.0f
+#define DTD_HANGOVER			600	/* 600 samples, or 75ms */
+#define TRANSFER_SAMPLES		6
+#define STEP_SIZE			0.5f	/* normalised LMS step, Beta */
+#define LEVEL_SMOOTHING			(1.0f / 32.0f)
+#define BGN_SMOOTHING			(1.0f / 4096.0f)
+#define BGN_LEVEL_LIMIT			80.0f
+
+struct oslec_float_state {
+	int taps;
+	int adaption_mode;
+
+	/* the tx history, and the foreground taps */
+	fir_float_state_t fir;
+	float *fir_taps[2];
+
+	/* tx power in the filter states.  This is a running sum, so it is
+	   kept in double to stop the rounding errors building up. */
+	double Pstates;
+
+	/* the background update due on the next sample, as in oslec */
+	float factor;
+
+	/* levels, as mean magnitude per sample */
+	float Ltx, Lrx, Lclean, Lclean_bg, Lbgn;
+	int nonupdate_dwell;
+	int cond_met;
+
+	/* DC blocking filter state */
+	float rx_1, rx_2;
+};
+
+struct oslec_float_state *oslec_float_create(int len, int adaption_mode)
+{
+	struct oslec_float_state *ec;
+	void *mem;
+
+	if (len < 1)
+		return NULL;
+
+	ec = calloc(1, sizeof(*ec));
+	if (!ec)
+		return NULL;
+	ec->taps = len;
+
+	if (posix_memalign(&mem, FIR_HISTORY_ALIGN, 2 * len * sizeof(float))) {
+		free(ec);
+		return NULL;
+	}
+	ec->fir_taps[0] = mem;
+	ec->fir_taps[1] = &ec->fir_taps[0][len];
+	if (!fir_float_create(&ec->fir, ec->fir_taps[0], len)) {
+		free(ec->fir_taps[0]);
+		free(ec);
+		return NULL;
+	}
+
+	oslec_float_adaption_mode(ec, adaption_mode);
+	oslec_float_flush(ec);
+
+	return ec;
+}
+
+void oslec_float_free(struct oslec_float_state *ec)
+{
+	fir_float_free(&ec->fir);
+	free(ec->fir_taps[0]);
+	free(ec);
+}
+
+void oslec_float_adaption_mode(struct oslec_float_state *ec,
+			       int adaption_mode)
+{
+	ec->adaption_mode = adaption_mode;
+}
+
+void oslec_float_flush(struct oslec_float_state *ec)
+{
+	memset(ec->fir_taps[0], 0, 2 * ec->taps * sizeof(float));
+	fir_float_flush(&ec->fir);
+	ec->fir.curr_pos = ec->taps - 1;
+	ec->Pstates = 0.0;
+	ec->factor = 0.0f;
+
+	ec->Ltx = ec->Lrx = ec->Lclean = ec->Lclean_bg = 0.0f;
+	ec->Lbgn = 0.0f;
+	ec->nonupdate_dwell = 0;
+	ec->cond_met = 0;
+	ec->rx_1 = ec->rx_2 = 0.0f;
+}
+
+static int16_t oslec_float_process(struct oslec_float_state *ec, int16_t tx,
+				   int16_t rx_in)
+{
+	float *hist;
+	float x;
+	float old;
+	float rx;
+	float tmp;
+	float echo;
+	float clean;
+	float clean_bg;
+	int i;
+
+	x = tx;
+	rx = rx_in;
+
+	/* DC block the rx signal, as oslec does */
+	if (ec->adaption_mode & ECHO_CAN_USE_RX_HPF) {
+		tmp = rx * (1.0f - 1.0f / 16.0f);
+		ec->rx_1 += -ec->rx_1 * DC_BETA + tmp - ec->rx_2;
+		ec->rx_2 = tmp;
+		rx = ec->rx_1;
+	}
+
+	/* The new sample goes in first, but its mirror copy waits until the
+	   background filter has used the old sample under it, as the deferred
+	   update needs the history of the previous sample. */
+	hist = &ec->fir.history[ec->fir.curr_pos];
+	old = hist[ec->taps];
+	hist[0] = x;
+	ec->Pstates += (double) x * x - (double) old * old;
+	if (ec->Pstates < 0.0)
+		ec->Pstates = 0.0;
+
+	ec->Ltx += (fabsf(x) - ec->Ltx) * LEVEL_SMOOTHING;
+	ec->Lrx += (fabsf(rx) - ec->Lrx) * LEVEL_SMOOTHING;
+
+	/* Background filter, with the update from the last sample */
+	echo = fir_float_dot_lms(ec->fir_taps[1], hist, ec->factor, ec->taps);
+	ec->factor = 0.0f;
+	clean_bg = rx - echo;
+	ec->Lclean_bg += (fabsf(clean_bg) - ec->Lclean_bg) * LEVEL_SMOOTHING;
+
+	/* Foreground filter */
+	echo = fir_float(&ec->fir, x);
+	clean = rx - echo;
+	ec->Lclean += (fabsf(clean) - ec->Lclean) * LEVEL_SMOOTHING;
+
+	/* Normalised LMS, f = Beta*clean_bg/P, with P the power in the filter
+	   states.  The floor on P stops the step blowing up on quiet tx.
+	   oslec uses Beta = 0.25, but its top_bit() estimate of P can be low
+	   by up to a factor of 2, so its real step is anywhere from 0.25 to
+	   0.5.  With an exact P the top of that range converges fastest. */
+	if (ec->nonupdate_dwell == 0) {
+		ec->factor = STEP_SIZE * clean_bg /
+		    ((float) ec->Pstates + ec->taps * MIN_TX_POWER_FOR_ADAPTION);
+	}
+
+	/* very simple DTD, as in oslec */
+	if ((ec->Lrx > MIN_RX_LEVEL_FOR_ADAPTION) && (ec->Lrx > ec->Ltx))
+		ec->nonupdate_dwell = DTD_HANGOVER;
+	if (ec->nonupdate_dwell)
+		ec->nonupdate_dwell--;
+
+	/* Transfer logic, as in oslec */
+	if ((ec->adaption_mode & ECHO_CAN_USE_ADAPTION) &&
+	    (ec->nonupdate_dwell == 0) &&
+	    (8 * ec->Lclean_bg < 7 * ec->Lclean) &&
+	    (8 * ec->Lclean_bg < ec->Ltx)) {
+		if (ec->cond_met == TRANSFER_SAMPLES) {
+			/* the foreground needs this sample's update too */
+			for (i = 0; i < ec->taps; i++)
+				ec->fir_taps[1][i] += ec->factor * hist[i];
+			ec->factor = 0.0f;
+			memcpy(ec->fir_taps[0], ec->fir_taps[1],
+			       ec->taps * sizeof(float));
+		} else
+			ec->cond_met++;
+	} else
+		ec->cond_met = 0;
+
+	/* Non-linear processing */
+	if (ec->adaption_mode & ECHO_CAN_USE_NLP) {
+		if (16 * ec->Lclean < ec->Ltx) {
+			if (ec->adaption_mode & ECHO_CAN_USE_CLIP) {
+				if (clean > ec->Lbgn)
+					clean = ec->Lbgn;
+				if (clean < -ec->Lbgn)
+					clean = -ec->Lbgn;
+			} else
+				clean = 0.0f;
+		} else if (ec->Lclean < BGN_LEVEL_LIMIT) {
+			ec->Lbgn += (fabsf(clean) - ec->Lbgn) * BGN_SMOOTHING;
+		}
+	}
+
+	if (ec->adaption_mode & ECHO_CAN_DISABLE)
+		clean = rx;
+	if (clean > 32767.0f)
+		clean = 32767.0f;
+	if (clean < -32768.0f)
+		clean = -32768.0f;
+	return (int16_t) lrintf(clean);
+}
+
+void oslec_float_update_block(struct oslec_float_state *ec, const int16_t *tx,
+			      const int16_t *rx, int16_t *out, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		out[i] = oslec_float_process(ec, tx[i], rx[i]);
+}
+
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,81 @@
+/*
+ * oslec_float.h - Floating point version of the OSLEC echo canceller
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*! \page oslec_float_page Floating point echo canceller
+\section oslec_float_page_sec_1 What does it do?
+The same dual path time domain canceller as OSLEC - a background filter
+which always adapts, and a foreground filter which produces the output and
+is only updated from the background one when that is doing better - with
+the taps, the tx history and all the levels held as 32 bit floats.
+
+\section oslec_float_page_sec_2 How does it work?
+The filters are fir_float_state_t filters, run by the float kernels in
+fir_simd.c, which use FMA where the CPU has it.  Working in float removes
+the compromises of the 16 bit version: the input is not halved to keep the
+32 bit sums from overflowing, so long filters keep their full headroom, and
+the normalised LMS step is a true division by the tx power, rather than a
+shift by its top bit, which could be out by a factor of 2.
+*/
+
+#if !defined(_OSLEC_FLOAT_H_)
+#define _OSLEC_FLOAT_H_
+
+#include <stdint.h>
+
+#include "oslec.h"
+
+/*!
+    Floating point echo canceller descriptor.
+*/
+struct oslec_float_state;
+
+/*! Create a floating point echo canceller context.
+    \param len The length of the canceller, in samples.
+    \param adaption_mode The mode, using the same ECHO_CAN_xxx bits as
+           oslec_create(). ECHO_CAN_USE_ADAPTION, ECHO_CAN_USE_NLP,
+           ECHO_CAN_USE_CLIP, ECHO_CAN_USE_RX_HPF and ECHO_CAN_DISABLE are
+           supported.
+    \return The new canceller context, or NULL if the canceller could not be created.
+*/
+struct oslec_float_state *oslec_float_create(int len, int adaption_mode);
+
+/*! Free a floating point echo canceller context.
+    \param ec The echo canceller context.
+*/
+void oslec_float_free(struct oslec_float_state *ec);
+
+/*! Flush (reinitialise) a floating point echo canceller context.
+    \param ec The echo canceller context.
+*/
+void oslec_float_flush(struct oslec_float_state *ec);
+
+/*! Set the adaption mode of a floating point echo canceller context.
+    \param ec The echo canceller context.
+    \param adaption_mode The mode.
+*/
+void oslec_float_adaption_mode(struct oslec_float_state *ec,
+			       int adaption_mode);
+
+/*! Process a block of samples through a floating point echo canceller.
+    \param ec The echo canceller context.
+    \param tx The transmitted audio samples.
+    \param rx The received audio samples.
+    \param out The clean (echo cancelled) received samples. This may be the
+           same buffer as rx.
+    \param n The number of samples.
+*/
+void oslec_float_update_block(struct oslec_float_state *ec, const int16_t *tx,
+			      const int16_t *rx, int16_t *out, int n);
+
+#endif
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "util.h"
+
+// One queue per worker, a cache line each so the workers do not fight
+// over each other's lines.  The tasks of a frame are fixed when it starts,
+// so a queue is just the range [lo, hi) of task numbers, packed into one
+// word: the owner takes from lo, and thieves take from hi.
+struct pool_queue
+{
+    _Atomic uint64_t range;
+} __attribute__((aligned(64)));
+
+struct pool_worker
+{
+    struct pool *pool;
+    pthread_t thread;
+    int index;
+    int cpu;
+};
+
+struct pool
+{
+    int threads;
+    struct pool_queue *queues;
+    struct pool_worker *workers;
+
+    // frame start and end, for the calling thread and all the workers
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    int quit;
+
+    pool_task_t task;
+    void *arg;
+};
+
+static uint64_t range_pack(uint32_t lo, uint32_t hi)
+{
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static int queue_pop(struct pool_queue *q)
+{
+    uint64_t range = atomic_load_explicit(&q->range, memory_order_relaxed);
+
+    for (;;)
+    {
+        uint32_t lo = (uint32_t)range;
+        uint32_t hi = (uint32_t)(range >> 32);
+
+        if (lo >= hi)
+        {
+            return -1;
+        }
+        if (atomic_compare_exchange_weak(&q->range, &range, range_pack(lo + 1, hi)))
+        {
+            return lo;
+        }
+    }
+}
+
+static int queue_steal(struct pool_queue *q)
+{
+    uint64_t range = atomic_load_explicit(&q->range, memory_order_relaxed);
+
+    for (;;)
+    {
+        uint32_t lo = (uint32_t)range;
+        uint32_t hi = (uint32_t)(range >> 32);
+
+        if (lo >= hi)
+        {
+            return -1;
+        }
+        if (atomic_compare_exchange_weak(&q->range, &range, range_pack(lo, hi - 1)))
+        {
+            return hi - 1;
+        }
+    }
+}
+
+static void pool_work(struct pool *pool, int self)
+{
+    int task;
+
+    while ((task = queue_pop(&pool->queues[self])) >= 0)
+    {
+        pool->task(pool->arg, task);
+    }
+
+    // No tasks are added during a frame, so one pass over the others is
+    // enough: a queue found empty stays empty.
+    for (int i = 1; i < pool->threads; i++)
+    {
+        struct pool_queue *victim = &pool->queues[(self + i) % pool->threads];
+
+        while ((task = queue_steal(victim)) >= 0)
+        {
+            pool->task(pool->arg, task);
+        }
+    }
+}
+
+static void *pool_thread(void *ptr)
+{
+    struct pool_worker *worker = (struct pool_worker *)ptr;
+    struct pool *pool = worker->pool;
+
+    for (;;)
+    {
+        pthread_barrier_wait(&pool->start);
+        if (pool->quit)
+        {
+            break;
+        }
+        pool_work(pool, worker->index);
+        pthread_barrier_wait(&pool->done);
+    }
+
+    return NULL;
+}
+
+struct pool *pool_create(int threads, const int *cpus, int priority)
+{
+    struct pool *pool;
+    void *mem;
+
+    if (threads < 1)
+    {
+        return NULL;
+    }
+
+    pool = (struct pool *)calloc(1, sizeof(struct pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->threads = threads;
+
+    if (posix_memalign(&mem, 64, threads * sizeof(struct pool_queue)))
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->queues = (struct pool_queue *)mem;
+    for (int i = 0; i < threads; i++)
+    {
+        atomic_init(&pool->queues[i].range, 0);
+    }
+
+    pool->workers = (struct pool_worker *)calloc(threads, sizeof(struct pool_worker));
+    if (pool->workers == NULL)
+    {
+        free(pool->queues);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_barrier_init(&pool->start, NULL, threads);
+    pthread_barrier_init(&pool->done, NULL, threads);
+
+    // The calling thread is worker 0.  It is pinned last, as the others
+    // would start out with its affinity.
+    for (int i = threads - 1; i >= 0; i--)
+    {
+        struct pool_worker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->index = i;
+        worker->cpu = cpus ? cpus[i] : -1;
+        if (i == 0)
+        {
+            worker->thread = pthread_self();
+        }
+        else if (pthread_create(&worker->thread, NULL, pool_thread, worker) != 0)
+        {
+            fprintf(stderr, "Fail to create worker thread %d\n", i);
+            exit(1);
+        }
+        if (thread_pin(worker->thread, worker->cpu) != 0)
+        {
+            fprintf(stderr, "Fail to pin worker thread %d to CPU %d\n", i, worker->cpu);
+        }
+        if (thread_priority(worker->thread, priority) != 0)
+        {
+            fprintf(stderr, "Fail to set worker thread %d to SCHED_FIFO priority %d\n", i, priority);
+        }
+    }
+
+    return pool;
+}
+
+void pool_free(struct pool *pool)
+{
+    if (pool->threads > 1)
+    {
+        pool->quit = 1;
+        pthread_barrier_wait(&pool->start);
+        for (int i = 1; i < pool->threads; i++)
+        {
+            pthread_join(pool->workers[i].thread, NULL);
+        }
+    }
+
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    free(pool->workers);
+    free(pool->queues);
+    free(pool);
+}
+
+int pool_threads(struct pool *pool)
+{
+    return pool->threads;
+}
+
+void pool_run(struct pool *pool, pool_task_t task, void *arg, int tasks)
+{
+    if (pool->threads == 1)
+    {
+        for (int i = 0; i < tasks; i++)
+        {
+            task(arg, i);
+        }
+        return;
+    }
+
+    pool->task = task;
+    pool->arg = arg;
+
+    // The same split every frame, so each task keeps to one worker unless
+    // it is stolen.
+    for (int i = 0; i < pool->threads; i++)
+    {
+        uint32_t lo = (uint32_t)((int64_t)tasks * i / pool->threads);
+        uint32_t hi = (uint32_t)((int64_t)tasks * (i + 1) / pool->threads);
+
+        atomic_store_explicit(&pool->queues[i].range, range_pack(lo, hi), memory_order_relaxed);
+    }
+
+    // the barriers order everything written before and after the frame
+    pthread_barrier_wait(&pool->start);
+    pool_work(pool, 0);
+    pthread_barrier_wait(&pool->done);
+}
@@ -0,0 +1,29 @@
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+// A fixed set of worker threads for per-frame DSP work.
+//
+// Each frame is a batch of independent tasks, numbered 0 to n - 1 (one per
+// channel, say).  Every worker has its own queue, which gets the same run of
+// task numbers every frame so a channel's state stays in one core's cache.
+// A worker which empties its own queue steals from the far end of the
+// others.  pool_run() returns once every task of the frame is done.
+
+typedef void (*pool_task_t)(void *arg, int task);
+
+struct pool;
+
+// threads includes the calling thread, which does its share of the work in
+// pool_run().  cpus, if not NULL, gives the CPU for each thread, the calling
+// thread first; cpus[i] < 0 leaves thread i unpinned.  priority, if not 0,
+// runs every thread, the calling one too, SCHED_FIFO at that priority.
+struct pool *pool_create(int threads, const int *cpus, int priority);
+void pool_free(struct pool *pool);
+
+int pool_threads(struct pool *pool);
+
+// Run tasks 0 to tasks - 1 and wait for all of them.
+void pool_run(struct pool *pool, pool_task_t task, void *arg, int tasks);
+
+#endif // _POOL_H_
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "reactor.h"
+#include "util.h"
+
+#define REACTOR_EVENTS 16
+
+// One per descriptor, as the epoll data, and on a list to find it by fd.
+// Removed watches are only unlinked, and freed after the epoll_wait() batch,
+// as a handler may remove a descriptor whose event is still to come in the
+// same batch.
+struct reactor_watch
+{
+    int fd;
+    int removed;
+    reactor_handler_t handler;
+    void *arg;
+    struct reactor_watch *next;
+};
+
+struct reactor
+{
+    int epfd;
+    int wake;   // eventfd, to get the thread out of epoll_wait() to quit
+    volatile int quit;
+    pthread_t thread;
+    struct reactor_watch *watches;
+    struct reactor_watch *removed;
+};
+
+static struct reactor_watch *reactor_find(struct reactor *reactor, int fd)
+{
+    for (struct reactor_watch *w = reactor->watches; w; w = w->next)
+    {
+        if (w->fd == fd)
+        {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+static void reactor_free_removed(struct reactor *reactor)
+{
+    while (reactor->removed)
+    {
+        struct reactor_watch *w = reactor->removed;
+        reactor->removed = w->next;
+        free(w);
+    }
+}
+
+static void reactor_wake(void *arg, int fd, uint32_t events)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        perror("reactor wake");
+    }
+}
+
+struct reactor *reactor_create(void)
+{
+    struct reactor *reactor = (struct reactor *)calloc(1, sizeof(struct reactor));
+    if (reactor == NULL)
+    {
+        return NULL;
+    }
+
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->epfd < 0 || reactor->wake < 0 ||
+        reactor_add(reactor, reactor->wake, EPOLLIN, reactor_wake, reactor) < 0)
+    {
+        reactor_free(reactor);
+        return NULL;
+    }
+
+    return reactor;
+}
+
+void reactor_free(struct reactor *reactor)
+{
+    while (reactor->watches)
+    {
+        struct reactor_watch *w = reactor->watches;
+        reactor->watches = w->next;
+        free(w);
+    }
+    reactor_free_removed(reactor);
+    if (reactor->wake >= 0)
+    {
+        close(reactor->wake);
+    }
+    if (reactor->epfd >= 0)
+    {
+        close(reactor->epfd);
+    }
+    free(reactor);
+}
+
+int reactor_add(struct reactor *reactor, int fd, uint32_t events, reactor_handler_t handler, void *arg)
+{
+    struct reactor_watch *w = (struct reactor_watch *)calloc(1, sizeof(struct reactor_watch));
+    if (w == NULL)
+    {
+        return -1;
+    }
+    w->fd = fd;
+    w->handler = handler;
+    w->arg = arg;
+
+    struct epoll_event ev = {.events = events, .data.ptr = w};
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        free(w);
+        return -1;
+    }
+
+    w->next = reactor->watches;
+    reactor->watches = w;
+
+    return 0;
+}
+
+int reactor_modify(struct reactor *reactor, int fd, uint32_t events)
+{
+    struct reactor_watch *w = reactor_find(reactor, fd);
+    if (w == NULL)
+    {
+        return -1;
+    }
+
+    struct epoll_event ev = {.events = events, .data.ptr = w};
+    return epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void reactor_remove(struct reactor *reactor, int fd)
+{
+    for (struct reactor_watch **p = &reactor->watches; *p; p = &(*p)->next)
+    {
+        struct reactor_watch *w = *p;
+
+        if (w->fd == fd)
+        {
+            epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, fd, NULL);
+            w->removed = 1;
+            *p = w->next;
+            w->next = reactor->removed;
+            reactor->removed = w;
+            return;
+        }
+    }
+}
+
+static void *reactor_thread(void *ptr)
+{
+    struct reactor *reactor = (struct reactor *)ptr;
+    struct epoll_event events[REACTOR_EVENTS];
+
+    while (!reactor->quit)
+    {
+        int n = epoll_wait(reactor->epfd, events, REACTOR_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("epoll_wait");
+                exit(1);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            struct reactor_watch *w = (struct reactor_watch *)events[i].data.ptr;
+
+            if (!w->removed)
+            {
+                w->handler(w->arg, w->fd, events[i].events);
+            }
+        }
+        reactor_free_removed(reactor);
+    }
+
+    return NULL;
+}
+
+int reactor_start(struct reactor *reactor, int priority, int cpu)
+{
+    int err = pthread_create(&reactor->thread, NULL, reactor_thread, reactor);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    if (thread_pin(reactor->thread, cpu) != 0)
+    {
+        fprintf(stderr, "Fail to pin the I/O thread to CPU %d\n", cpu);
+    }
+    if (thread_priority(reactor->thread, priority) != 0)
+    {
+        fprintf(stderr, "Fail to set the I/O thread to SCHED_FIFO priority %d\n", priority);
+    }
+
+    return 0;
+}
+
+void reactor_stop(struct reactor *reactor)
+{
+    uint64_t one = 1;
+
+    reactor->quit = 1;
+    if (write(reactor->wake, &one, sizeof(one)) < 0)
+    {
+        perror("reactor wake");
+    }
+    pthread_join(reactor->thread, NULL);
+}
@@ -0,0 +1,34 @@
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdint.h>
+
+// One thread which does all the I/O.
+//
+// Every file descriptor the audio path waits on (the ALSA PCMs' poll
+// descriptors, the FIFOs, timers and eventfds) goes into one epoll set, with
+// a handler to call when it is ready.  The handlers must not block; they do
+// what the descriptor allows and return.  Descriptors may be added, changed
+// and removed from the handlers themselves.
+
+typedef void (*reactor_handler_t)(void *arg, int fd, uint32_t events);
+
+struct reactor;
+
+struct reactor *reactor_create(void);
+void reactor_free(struct reactor *reactor);
+
+// Watch fd for the EPOLLxxx events (level triggered).  EPOLLERR and
+// EPOLLHUP are always watched, so events 0 parks a descriptor.
+int reactor_add(struct reactor *reactor, int fd, uint32_t events, reactor_handler_t handler, void *arg);
+int reactor_modify(struct reactor *reactor, int fd, uint32_t events);
+void reactor_remove(struct reactor *reactor, int fd);
+
+// Run the handlers on a new thread, until reactor_stop().  The thread is
+// pinned to cpu unless it is < 0, and runs SCHED_FIFO at priority unless
+// that is 0.
+int reactor_start(struct reactor *reactor, int priority, int cpu);
+void reactor_stop(struct reactor *reactor);
+
+#endif // _REACTOR_H_
@@ -0,0 +1,248 @@
+/*
+ * resample.c - Polyphase sample rate conversion of 16 bit audio
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "fir_simd.h"
+#include "resample.h"
+
+#define RESAMPLE_ZEROS		16	/* sinc zero crossings either side */
+#define RESAMPLE_CUTOFF		0.9	/* of the lower Nyquist frequency */
+#define RESAMPLE_BETA		8.0	/* Kaiser window, about 80dB stopband */
+#define RESAMPLE_ROUND		16	/* branch lengths, for the SIMD kernels */
+
+struct resample_state {
+	int up;
+	int down;
+	int channels;
+	int max_frames;
+
+	/* taps per branch, and the up branches, each reversed */
+	int taps;
+	int16_t *coeffs;
+
+	/* the input sample and branch for the next output frame, with the
+	   sample counted from the start of the next block */
+	int pos;
+	int phase;
+
+	/* per channel, the last taps - 1 input samples followed by the
+	   block, oldest first */
+	int16_t *hist;
+	int hist_len;
+};
+
+static int gcd(int a, int b)
+{
+	int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static double bessel_i0(double x)
+{
+	double sum;
+	double term;
+	int k;
+
+	sum = term = 1.0;
+	for (k = 1; k < 40; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/* Kaiser windowed sinc at up times the input rate, with a gain of up, as
+   the interpolation leaves up - 1 zeros between the input samples.  Branch
+   p holds taps p, p + up, p + 2*up..., last first.
+
+   Rounding each tap on its own would leave each branch with a slightly
+   different gain, which puts the branch pattern on the signal as spurs, so
+   each branch is rounded to a sum of exactly 1.0, moving the taps which
+   were closest to rounding the other way. */
+static int resample_design(struct resample_state *rs, double cutoff)
+{
+	double *p;
+	double *frac;
+	double sum;
+	double t;
+	double x;
+	int len;
+	int err;
+	int n;
+	int k;
+	int j;
+
+	len = rs->taps * rs->up;
+	p = malloc(len * sizeof(*p));
+	frac = malloc(rs->taps * sizeof(*frac));
+	if (p == NULL || frac == NULL) {
+		free(p);
+		free(frac);
+		return -1;
+	}
+	sum = 0.0;
+	for (n = 0; n < len; n++) {
+		t = n - (len - 1) / 2.0;
+		x = M_PI * cutoff * t;
+		p[n] = (x == 0.0) ? 1.0 : sin(x) / x;
+		x = 2.0 * t / (len - 1);
+		p[n] *= bessel_i0(RESAMPLE_BETA * sqrt(1.0 - x * x)) /
+		    bessel_i0(RESAMPLE_BETA);
+		sum += p[n];
+	}
+	for (n = 0; n < rs->up; n++) {
+		int16_t *c = &rs->coeffs[n * rs->taps];
+
+		err = 32768;
+		for (k = 0; k < rs->taps; k++) {
+			x = 32768.0 * rs->up * p[n + (rs->taps - 1 - k) * rs->up] / sum;
+			c[k] = lrint(x);
+			frac[k] = x - c[k];
+			err -= c[k];
+		}
+		for (; err != 0; err += (err < 0) ? 1 : -1) {
+			j = 0;
+			for (k = 1; k < rs->taps; k++) {
+				if ((err > 0) ? frac[k] > frac[j] : frac[k] < frac[j])
+					j = k;
+			}
+			c[j] += (err > 0) ? 1 : -1;
+			frac[j] -= (err > 0) ? 1.0 : -1.0;
+		}
+	}
+	free(p);
+	free(frac);
+	return 0;
+}
+
+struct resample_state *resample_create(int in_rate, int out_rate,
+				       int channels, int max_frames)
+{
+	struct resample_state *rs;
+	double cutoff;
+	int low;
+	int g;
+
+	if (in_rate < 1 || out_rate < 1 || channels < 1 || max_frames < 1)
+		return NULL;
+
+	rs = calloc(1, sizeof(*rs));
+	if (rs == NULL)
+		return NULL;
+
+	g = gcd(in_rate, out_rate);
+	rs->up = out_rate / g;
+	rs->down = in_rate / g;
+	rs->channels = channels;
+	rs->max_frames = max_frames;
+
+	/* the same number of zero crossings at any ratio, so decimating
+	   needs more taps per branch than interpolating */
+	low = (in_rate < out_rate) ? in_rate : out_rate;
+	cutoff = RESAMPLE_CUTOFF * low / ((double) in_rate * rs->up);
+	rs->taps = (int) ceil(2 * RESAMPLE_ZEROS / (cutoff * rs->up));
+	rs->taps = (rs->taps + RESAMPLE_ROUND - 1) & ~(RESAMPLE_ROUND - 1);
+
+	rs->hist_len = rs->taps - 1 + max_frames;
+	rs->coeffs = malloc(rs->up * rs->taps * sizeof(int16_t));
+	rs->hist = calloc(channels * rs->hist_len, sizeof(int16_t));
+	if (rs->coeffs == NULL || rs->hist == NULL ||
+	    resample_design(rs, cutoff)) {
+		resample_free(rs);
+		return NULL;
+	}
+
+	fir_simd_init();
+	return rs;
+}
+
+void resample_free(struct resample_state *rs)
+{
+	free(rs->coeffs);
+	free(rs->hist);
+	free(rs);
+}
+
+void resample_flush(struct resample_state *rs)
+{
+	memset(rs->hist, 0, rs->channels * rs->hist_len * sizeof(int16_t));
+	rs->pos = 0;
+	rs->phase = 0;
+}
+
+int resample_out_max(struct resample_state *rs, int frames)
+{
+	return (int) (((int64_t) frames * rs->up + rs->down - 1) / rs->down) + 1;
+}
+
+int resample_process(struct resample_state *rs, const int16_t *in,
+		     int frames, int16_t *out)
+{
+	const int step = rs->down / rs->up;
+	const int frac = rs->down % rs->up;
+	int16_t *hist;
+	int64_t y;
+	int phase;
+	int pos;
+	int c;
+	int i;
+	int n;
+
+	if (frames > rs->max_frames)
+		frames = rs->max_frames;
+
+	n = 0;
+	pos = rs->pos;
+	phase = rs->phase;
+	for (c = 0; c < rs->channels; c++) {
+		hist = &rs->hist[c * rs->hist_len];
+		for (i = 0; i < frames; i++)
+			hist[rs->taps - 1 + i] = in[i * rs->channels + c];
+
+		/* hist[pos] is the oldest sample of the output frame's span */
+		pos = rs->pos;
+		phase = rs->phase;
+		for (n = 0; pos < frames; n++) {
+			y = fir16_dot(&rs->coeffs[phase * rs->taps], &hist[pos],
+				      rs->taps);
+			y = (y + (1 << 14)) >> 15;
+			if (y > INT16_MAX)
+				y = INT16_MAX;
+			else if (y < INT16_MIN)
+				y = INT16_MIN;
+			out[n * rs->channels + c] = (int16_t) y;
+
+			pos += step;
+			phase += frac;
+			if (phase >= rs->up) {
+				phase -= rs->up;
+				pos++;
+			}
+		}
+		memmove(hist, &hist[frames], (rs->taps - 1) * sizeof(int16_t));
+	}
+	rs->pos = pos - frames;
+	rs->phase = phase;
+	return n;
+}
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,83 @@
+/*
+ * resample.h - Polyphase sample rate conversion of 16 bit audio
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*! \page resample_page Sample rate conversion
+\section resample_page_sec_1 What does it do?
+Converts interleaved 16 bit audio between two fixed sample rates, so the
+sound card can run at its native rate (typically 44.1 or 48kHz) while the
+echo canceller runs at the rate chosen for it, without going through the
+generic rate conversion of an ALSA plug device.
+
+\section resample_page_sec_2 How does it work?
+The ratio of the rates is reduced to up/down, and the conversion is done as
+an interpolation by up, a low pass filter and a decimation by down.  The
+filter is a Kaiser windowed sinc, with its cutoff just below the lower of
+the two Nyquist frequencies, split into up polyphase branches of a few
+dozen taps each.  Only the branch which lands on an output sample is ever
+run, so each output sample is one short dot product of the most recent
+input samples, done by the fir16_dot() SIMD kernel.  Each branch is stored
+reversed, so that the input can be kept oldest first, in a linear buffer.
+*/
+
+#if !defined(_RESAMPLE_H_)
+#define _RESAMPLE_H_
+
+#include <stdint.h>
+
+/*!
+    Sample rate converter descriptor.
+*/
+struct resample_state;
+
+/*! Create a sample rate converter.
+    \param in_rate The input sample rate, in Hz.
+    \param out_rate The output sample rate, in Hz.
+    \param channels The number of interleaved channels.
+    \param max_frames The largest number of input frames which will be
+           passed to resample_process() at once.
+    \return The new converter, or NULL if the converter could not be created.
+*/
+struct resample_state *resample_create(int in_rate, int out_rate,
+				       int channels, int max_frames);
+
+/*! Free a sample rate converter.
+    \param rs The converter.
+*/
+void resample_free(struct resample_state *rs);
+
+/*! Flush (reinitialise) a sample rate converter.
+    \param rs The converter.
+*/
+void resample_flush(struct resample_state *rs);
+
+/*! The most output frames resample_process() can produce from a block.
+    \param rs The converter.
+    \param frames The number of input frames.
+    \return The number of output frames the output buffer must hold.
+*/
+int resample_out_max(struct resample_state *rs, int frames);
+
+/*! Convert a block of frames. The output lags the input by half the filter
+    length, a little over 1ms at 16kHz.
+    \param rs The converter.
+    \param in The input frames, interleaved.
+    \param frames The number of input frames, at most max_frames.
+    \param out The output frames, interleaved. This must have room for
+           resample_out_max() frames.
+    \return The number of output frames.
+*/
+int resample_process(struct resample_state *rs, const int16_t *in,
+		     int frames, int16_t *out);
+
+#endif
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,367 @@
+/*
+ * subband.c - Subband echo canceller, OSLEC in each band of a filterbank
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "fft.h"
+#include "subband.h"
+
+#define DC_BETA			0.125f	/* DC filter Beta, as in oslec */
+#define BINS			(SUBBAND_BANDS / 2 + 1)
+#define PROTO_CUTOFF		1.15	/* in half band spacings */
+#define PROTO_BETA		7.0	/* Kaiser window */
+
+#if (SUBBAND_PROTO % SUBBAND_BANDS) || (SUBBAND_BANDS != 4 * SUBBAND_DECIMATION)
+#error The prototype must be a whole number of bands long, oversampled 4 times
+#endif
+
+/* the modes the full band does, rather than the bands */
+#define FULL_BAND_MODES		(ECHO_CAN_USE_TX_HPF | ECHO_CAN_USE_RX_HPF)
+
+struct subband_state {
+	int adaption_mode;
+
+	struct fft_state *fft;
+	struct oslec_state *band[BINS];
+
+	/* analysis and synthesis prototype filters */
+	float h[SUBBAND_PROTO];
+	float g[SUBBAND_PROTO];
+
+	/* the last SUBBAND_PROTO tx and rx samples, oldest first.  The last
+	   SUBBAND_DECIMATION are filled in as they arrive. */
+	float tx_hist[SUBBAND_PROTO];
+	float rx_hist[SUBBAND_PROTO];
+	int pos;
+
+	/* synthesis overlap-add, from the next output sample on */
+	float y[SUBBAND_PROTO];
+	int16_t out_buf[SUBBAND_DECIMATION];
+
+	/* the number of hops, modulo 4, for the sideband modulation */
+	int hop;
+
+	/* work space */
+	float u[SUBBAND_BANDS];
+	float fold[SUBBAND_BANDS];
+	complexf_t U_tx[BINS];
+	complexf_t U_rx[BINS];
+
+	/* DC blocking filter state */
+	float rx_1, rx_2;
+};
+
+static double bessel_i0(double x)
+{
+	double sum;
+	double term;
+	int k;
+
+	sum = term = 1.0;
+	for (k = 1; k < 40; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/* Kaiser windowed sinc.  The cutoff is a little past the half band spacing,
+   so that the power responses of neighbouring bands add up flat (to 0.1dB)
+   across the crossover, and the window puts the response 75dB down by the
+   next band's centre, where the decimated band would start to overlap its
+   sideband image.
+
+   The analysis filter has unity gain at DC, so the band signals have the
+   same levels as the full band ones.  Each output sample is made from
+   SUBBAND_BANDS/SUBBAND_DECIMATION hops, of the power gain of the
+   prototype each, so the synthesis filter is scaled to undo that. */
+static void subband_prototype(struct subband_state *ec)
+{
+	double p[SUBBAND_PROTO];
+	double sum;
+	double power;
+	double t;
+	double x;
+	int n;
+
+	sum = 0.0;
+	for (n = 0; n < SUBBAND_PROTO; n++) {
+		t = n - (SUBBAND_PROTO - 1) / 2.0;
+		x = M_PI * PROTO_CUTOFF * t / SUBBAND_BANDS;
+		p[n] = (x == 0.0) ? 1.0 : sin(x) / x;
+		x = 2.0 * t / (SUBBAND_PROTO - 1);
+		p[n] *= bessel_i0(PROTO_BETA * sqrt(1.0 - x * x)) /
+		    bessel_i0(PROTO_BETA);
+		sum += p[n];
+	}
+	power = 0.0;
+	for (n = 0; n < SUBBAND_PROTO; n++) {
+		p[n] /= sum;
+		power += p[n] * p[n];
+	}
+	for (n = 0; n < SUBBAND_PROTO; n++) {
+		ec->h[n] = p[n];
+		ec->g[n] = p[n] * SUBBAND_DECIMATION / power;
+	}
+}
+
+struct subband_state *subband_create(int len, int adaption_mode)
+{
+	struct subband_state *ec;
+	int taps;
+	int k;
+
+	if (len < 1)
+		return NULL;
+
+	ec = calloc(1, sizeof(*ec));
+	if (!ec)
+		return NULL;
+
+	/* The band filters also have to cover the spread of the filterbank */
+	taps = (len + SUBBAND_PROTO + SUBBAND_DECIMATION - 1) /
+	    SUBBAND_DECIMATION;
+
+	ec->fft = fft_create(SUBBAND_BANDS);
+	if (!ec->fft) {
+		subband_free(ec);
+		return NULL;
+	}
+	for (k = 0; k < BINS; k++) {
+		ec->band[k] = oslec_create(taps,
+					   adaption_mode & ~FULL_BAND_MODES);
+		if (!ec->band[k]) {
+			subband_free(ec);
+			return NULL;
+		}
+	}
+
+	subband_prototype(ec);
+	subband_adaption_mode(ec, adaption_mode);
+	subband_flush(ec);
+
+	return ec;
+}
+
+void subband_free(struct subband_state *ec)
+{
+	int k;
+
+	for (k = 0; k < BINS; k++) {
+		if (ec->band[k])
+			oslec_free(ec->band[k]);
+	}
+	if (ec->fft)
+		fft_free(ec->fft);
+	free(ec);
+}
+
+void subband_adaption_mode(struct subband_state *ec, int adaption_mode)
+{
+	int k;
+
+	ec->adaption_mode = adaption_mode;
+	for (k = 0; k < BINS; k++)
+		oslec_adaption_mode(ec->band[k],
+				    adaption_mode & ~FULL_BAND_MODES);
+}
+
+void subband_flush(struct subband_state *ec)
+{
+	int k;
+
+	for (k = 0; k < BINS; k++)
+		oslec_flush(ec->band[k]);
+	memset(ec->tx_hist, 0, sizeof(ec->tx_hist));
+	memset(ec->rx_hist, 0, sizeof(ec->rx_hist));
+	memset(ec->y, 0, sizeof(ec->y));
+	memset(ec->out_buf, 0, sizeof(ec->out_buf));
+	ec->pos = 0;
+	ec->hop = 0;
+	ec->rx_1 = ec->rx_2 = 0.0f;
+}
+
+static int16_t saturate(float x)
+{
+	if (x > 32767.0f)
+		return 32767;
+	if (x < -32768.0f)
+		return -32768;
+	return (int16_t) lrintf(x);
+}
+
+/* Polyphase analysis.  The prototype filter is applied to the last
+   SUBBAND_PROTO samples, which are folded down to SUBBAND_BANDS, and the
+   DFT of those gives every band, moved down to DC, at once.  The filter
+   runs newest sample first, but it is symmetric, so it can be applied to
+   the history as it is stored, oldest first, in straight runs, and the
+   fold reversed afterwards. */
+static void subband_analysis(struct subband_state *ec, const float *hist,
+			     complexf_t *U)
+{
+	int n;
+	int r;
+
+	memset(ec->fold, 0, sizeof(ec->fold));
+	for (n = 0; n < SUBBAND_PROTO; n += SUBBAND_BANDS) {
+		for (r = 0; r < SUBBAND_BANDS; r++)
+			ec->fold[r] += ec->h[n + r] * hist[n + r];
+	}
+	for (r = 0; r < SUBBAND_BANDS; r++)
+		ec->u[r] = ec->fold[SUBBAND_BANDS - 1 - r];
+	fft_real(ec->fft, ec->u, U);
+}
+
+/* The real signal of band k.  The band is conj(U[k]), times
+   exp(-j*2*pi*k*hop*SUBBAND_DECIMATION/SUBBAND_BANDS) for the time the
+   hop starts at, and it is moved up by a quarter of the decimated rate
+   with exp(j*pi*hop/2).  With 4 times oversampling both are quarter turns,
+   so the real part is just one of the parts of U[k].  The bands in the
+   middle also have their mirror images, beyond half the sample rate, so
+   they count twice. */
+static int sideband_turns(int k, int hop)
+{
+	return ((1 - k) * hop) & 3;
+}
+
+static int16_t sideband_real(const complexf_t *U, int k, int hop)
+{
+	float s;
+
+	switch (sideband_turns(k, hop)) {
+	case 0:
+		s = U[k].re;
+		break;
+	case 1:
+		s = U[k].im;
+		break;
+	case 2:
+		s = -U[k].re;
+		break;
+	default:
+		s = -U[k].im;
+		break;
+	}
+	if (k != 0 && k != BINS - 1)
+		s *= 2.0f;
+	return saturate(s);
+}
+
+/* The inverse of sideband_real(), for the synthesis.  The image this
+   leaves at half the decimated rate is removed by the synthesis filter.
+   The bands at DC and half the sample rate are real. */
+static void sideband_complex(complexf_t *Z, int16_t s, int k, int hop)
+{
+	float x;
+
+	x = s;
+	if (k == 0 || k == BINS - 1)
+		x *= 2.0f;
+	Z[k].re = Z[k].im = 0.0f;
+	switch (sideband_turns(k, hop)) {
+	case 0:
+		Z[k].re = x;
+		break;
+	case 1:
+		Z[k].im = -x;
+		break;
+	case 2:
+		Z[k].re = -x;
+		break;
+	default:
+		Z[k].im = x;
+		break;
+	}
+	if (k == 0 || k == BINS - 1)
+		Z[k].im = 0.0f;
+}
+
+/* One hop of SUBBAND_DECIMATION samples, from ec->tx_hist and ec->rx_hist
+   into ec->out_buf */
+static void subband_process(struct subband_state *ec)
+{
+	complexf_t *Z = ec->U_rx;
+	int16_t clean;
+	int k;
+	int n;
+	int r;
+
+	subband_analysis(ec, ec->tx_hist, ec->U_tx);
+	subband_analysis(ec, ec->rx_hist, ec->U_rx);
+
+	for (k = 0; k < BINS; k++) {
+		clean = oslec_update(ec->band[k],
+				     sideband_real(ec->U_tx, k, ec->hop),
+				     sideband_real(ec->U_rx, k, ec->hop));
+		sideband_complex(Z, clean, k, ec->hop);
+	}
+
+	/* Synthesis.  The bands were taken with the newest sample of the
+	   hop as time 0, and the prototype filters delay them by
+	   SUBBAND_PROTO - 1, so the inverse DFT is read from there. */
+	fft_real_inverse(ec->fft, Z, ec->u);
+	for (r = 0; r < SUBBAND_BANDS; r++)
+		ec->fold[r] = ec->u[(r - (SUBBAND_PROTO - 1)) &
+				    (SUBBAND_BANDS - 1)];
+	for (n = 0; n < SUBBAND_PROTO; n += SUBBAND_BANDS) {
+		for (r = 0; r < SUBBAND_BANDS; r++)
+			ec->y[n + r] += ec->g[n + r] * ec->fold[r];
+	}
+
+	for (n = 0; n < SUBBAND_DECIMATION; n++)
+		ec->out_buf[n] = saturate(ec->y[n]);
+	memmove(ec->y, &ec->y[SUBBAND_DECIMATION],
+		(SUBBAND_PROTO - SUBBAND_DECIMATION) * sizeof(float));
+	memset(&ec->y[SUBBAND_PROTO - SUBBAND_DECIMATION], 0,
+	       SUBBAND_DECIMATION * sizeof(float));
+
+	memmove(ec->tx_hist, &ec->tx_hist[SUBBAND_DECIMATION],
+		(SUBBAND_PROTO - SUBBAND_DECIMATION) * sizeof(float));
+	memmove(ec->rx_hist, &ec->rx_hist[SUBBAND_DECIMATION],
+		(SUBBAND_PROTO - SUBBAND_DECIMATION) * sizeof(float));
+	ec->hop = (ec->hop + 1) & 3;
+}
+
+void subband_update_block(struct subband_state *ec, const int16_t *tx,
+			  const int16_t *rx, int16_t *out, int n)
+{
+	int16_t clean;
+	float x;
+	float tmp;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		/* DC block the rx signal, as oslec does */
+		x = rx[i];
+		if (ec->adaption_mode & ECHO_CAN_USE_RX_HPF) {
+			tmp = x * (1.0f - 1.0f / 16.0f);
+			ec->rx_1 += -ec->rx_1 * DC_BETA + tmp - ec->rx_2;
+			ec->rx_2 = tmp;
+			x = ec->rx_1;
+		}
+
+		clean = ec->out_buf[ec->pos];
+		ec->tx_hist[SUBBAND_PROTO - SUBBAND_DECIMATION + ec->pos] = tx[i];
+		ec->rx_hist[SUBBAND_PROTO - SUBBAND_DECIMATION + ec->pos] = x;
+		out[i] = clean;
+		if (++ec->pos == SUBBAND_DECIMATION) {
+			subband_process(ec);
+			ec->pos = 0;
+		}
+	}
+}
+
+/*- End of file ------------------------------------------------------------*/
@@ -0,0 +1,104 @@
+/*
+ * subband.h - Subband echo canceller, OSLEC in each band of a filterbank
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*! \page subband_page Subband echo canceller
+\section subband_page_sec_1 What does it do?
+This is an alternative to the full band OSLEC canceller for high sample
+rates.  For a fixed tail duration the full band canceller's taps grow with
+the sample rate, and so does the number of samples per second, so its cost
+grows with the square of the rate: a 250ms tail at 48kHz is 12000 taps.
+Here the signals are split into bands which are run at an eighth of the
+rate, each through its own short OSLEC canceller, so the cost only grows
+linearly with the rate.
+
+\section subband_page_sec_2 How does it work?
+The tx and rx signals are each split by the same oversampled polyphase DFT
+filterbank, with SUBBAND_BANDS bands decimated by SUBBAND_DECIMATION.  Each
+band comes out as a complex signal, which a time domain canceller with real
+taps can not model.  The bands are oversampled 4 times, though, so each
+one only fills half of its decimated spectrum, and it can be moved up by a
+quarter of the decimated rate and replaced by its real part without losing
+anything (single sideband modulation).  The real subband signals go
+through an oslec_state canceller each, and their outputs are moved back
+down and put back together by the synthesis filterbank.  A real signal only
+needs the bands from DC to half the sample rate, SUBBAND_BANDS/2 + 1 of
+them.
+
+The filterbank delays the output by SUBBAND_DELAY samples.
+*/
+
+#if !defined(_SUBBAND_H_)
+#define _SUBBAND_H_
+
+#include <stdint.h>
+
+#include "oslec.h"
+
+/*! The number of filterbank bands, of which SUBBAND_BANDS/2 + 1 are used. */
+#define SUBBAND_BANDS		32
+/*! The decimation of the bands. This must be SUBBAND_BANDS/4. */
+#define SUBBAND_DECIMATION	8
+/*! The length of the filterbank prototype filter. */
+#define SUBBAND_PROTO		192
+/*! The delay through the analysis and synthesis filterbanks, in samples:
+    SUBBAND_PROTO - 1 for the filters, and one more as the output of a hop
+    starts with the sample after the one which completed it. */
+#define SUBBAND_DELAY		SUBBAND_PROTO
+
+/*!
+    Subband echo canceller descriptor.
+*/
+struct subband_state;
+
+/*! Create a subband echo canceller context.
+    \param len The length of the echo tail to cancel, in samples at the full
+           rate.
+    \param adaption_mode The mode, using the same ECHO_CAN_xxx bits as
+           oslec_create(). These are passed on to the canceller in each
+           band, except for ECHO_CAN_USE_RX_HPF, which is done on the full
+           band rx signal, and ECHO_CAN_USE_TX_HPF, which is not supported.
+    \return The new canceller context, or NULL if the canceller could not be created.
+*/
+struct subband_state *subband_create(int len, int adaption_mode);
+
+/*! Free a subband echo canceller context.
+    \param ec The echo canceller context.
+*/
+void subband_free(struct subband_state *ec);
+
+/*! Flush (reinitialise) a subband echo canceller context.
+    \param ec The echo canceller context.
+*/
+void subband_flush(struct subband_state *ec);
+
+/*! Set the adaption mode of a subband echo canceller context.
+    \param ec The echo canceller context.
+    \param adaption_mode The mode.
+*/
+void subband_adaption_mode(struct subband_state *ec, int adaption_mode);
+
+/*! Process a block of samples through a subband echo canceller. Any number
+    of samples may be passed; the output lags the input by SUBBAND_DELAY
+    samples.
+    \param ec The echo canceller context.
+    \param tx The transmitted audio samples.
+    \param rx The received audio samples.
+    \param out The clean (echo cancelled) received samples. This may be the
+           same buffer as rx.
+    \param n The number of samples.
+*/
+void subband_update_block(struct subband_state *ec, const int16_t *tx,
+			  const int16_t *rx, int16_t *out, int n);
+
+#endif
+/*- End of file ------------------------------------------------------------*/
@@ -1,3 +1,13 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "util.h"
+
 // from http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
 unsigned power2(unsigned v)
 {
@@ -10,4 +20,59 @@ unsigned power2(unsigned v)
     v++;
 
     return v;
-}
\ No newline at end of file
+}
+
+int thread_pin(pthread_t thread, int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+    {
+        return 0;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+int thread_priority(pthread_t thread, int priority)
+{
+    struct sched_param param = {.sched_priority = priority};
+
+    if (priority <= 0)
+    {
+        return 0;
+    }
+
+    return pthread_setschedparam(thread, SCHED_FIFO, &param);
+}
+
+int memory_lock(void)
+{
+    // an mmap()ed allocation would fault on first use, and a trimmed heap
+    // on the next allocation
+    mallopt(M_MMAP_MAX, 0);
+    mallopt(M_TRIM_THRESHOLD, -1);
+
+    return mlockall(MCL_CURRENT | MCL_FUTURE);
+}
+
+void memory_prefault(void *buf, size_t bytes)
+{
+    char *p = (char *)buf;
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (buf == NULL || bytes == 0)
+    {
+        return;
+    }
+
+    // a write which leaves the data as it is; a read would only map the
+    // shared zero page, and a read then a write would fault twice
+    __atomic_fetch_or(&p[0], 0, __ATOMIC_RELAXED);
+    for (size_t i = -(uintptr_t)buf & (page - 1); i < bytes; i += page)
+    {
+        __atomic_fetch_or(&p[i], 0, __ATOMIC_RELAXED);
+    }
+}
@@ -1,6 +1,24 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <stddef.h>
+#include <pthread.h>
+
 unsigned power2(unsigned v);
 
-#endif // _UTIL_H_
\ No newline at end of file
+// Pin a thread to one CPU; cpu < 0 leaves it where it is.
+int thread_pin(pthread_t thread, int cpu);
+
+// Run a thread SCHED_FIFO at priority (1 to 99); 0 leaves it SCHED_OTHER.
+int thread_priority(pthread_t thread, int priority);
+
+// Keep all the process's memory, and all it maps from now on, resident, and
+// have malloc() take it from the heap and never give it back, so that
+// nothing page faults once running.
+int memory_lock(void);
+
+// Write to every page of a buffer, so that its pages are there before it
+// is used.
+void memory_prefault(void *buf, size_t bytes);
+
+#endif // _UTIL_H_